@@ -0,0 +1,465 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+#define TRUE 1
+#define FALSE 0
+
+#define BAD_RESULT (-1)
+
+#define MAX_SHELLS 8
+#define MAX_RUNS 100
+#define PATH_LEN 4096
+
+#define DEFAULT_RUNS 5
+#define DEFAULT_SCALE 1
+
+#define TEMPLATE "/tmp/shell-bench-XXXXXX"
+
+#define SYSCALL_STOP (SIGTRAP | 0x80)
+
+
+struct Workload_St {
+    char const *name;
+    void (*generate)(FILE *file, char const *dir, int scale);
+};
+
+typedef struct Workload_St Workload;
+
+struct Result_St {
+    double wall_ms;
+    double cpu_ms;
+    long long syscalls;
+    int status;
+};
+
+typedef struct Result_St Result;
+
+
+static void generate_commands(FILE *file, char const *dir, int scale);
+
+static void generate_pipelines(FILE *file, char const *dir, int scale);
+
+static void generate_background(FILE *file, char const *dir, int scale);
+
+static void generate_arguments(FILE *file, char const *dir, int scale);
+
+static void generate_redirects(FILE *file, char const *dir, int scale);
+
+static int workload_write(Workload const *workload,
+                          char const *dir,
+                          int scale,
+                          char *path);
+
+static int shell_resolve(char const *name, char *path);
+
+static pid_t bench_spawn(char const *shell, char const *script, char traced);
+
+static int bench_time(char const *shell, char const *script, Result *result);
+
+static long long bench_syscalls(char const *shell, char const *script);
+
+static int is_syscall_entry(pid_t pid);
+
+static double median(double *values, size_t count);
+
+static int compare_doubles(void const *lhs, void const *rhs);
+
+static double timespec_ms(struct timespec const *started,
+                          struct timespec const *finished);
+
+static double timeval_ms(struct timeval const *value);
+
+static void print_usage(char const *name);
+
+
+static Workload const workloads[] = {
+        {"commands",   generate_commands},
+        {"pipelines",  generate_pipelines},
+        {"background", generate_background},
+        {"arguments",  generate_arguments},
+        {"redirects",  generate_redirects},
+};
+
+#define WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+
+/*
+ * Runs every generated workload script under each given shell. Wall and CPU
+ * time are the medians of several plain runs; syscalls are counted in one
+ * extra run of the whole process tree under ptrace, so tracing does not
+ * disturb the timings.
+ */
+int main(int argc, char *argv[]) {
+    int runs = DEFAULT_RUNS;
+    int scale = DEFAULT_SCALE;
+    char const *json_path = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "r:s:o:")) != BAD_RESULT) {
+        switch (option) {
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 's':
+                scale = atoi(optarg);
+                break;
+            case 'o':
+                json_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc || runs < 1 || runs > MAX_RUNS || scale < 1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char shells[MAX_SHELLS][PATH_LEN];
+    size_t number_of_shells = 0;
+    for (; optind < argc && number_of_shells < MAX_SHELLS; ++optind) {
+        if (shell_resolve(argv[optind], shells[number_of_shells])
+            == BAD_RESULT) {
+            fprintf(stderr, "bench: %s: not found, skipped\n", argv[optind]);
+            continue;
+        }
+
+        ++number_of_shells;
+    }
+
+    char dir[] = TEMPLATE;
+    if (!mkdtemp(dir)) {
+        perror("Couldn't create workload directory");
+        return EXIT_FAILURE;
+    }
+
+    FILE *json = json_path ? fopen(json_path, "w") : NULL;
+    if (json_path && !json) {
+        perror("Couldn't open JSON output");
+        return EXIT_FAILURE;
+    }
+
+    if (json) {
+        fprintf(json, "{\"runs\":%d,\"scale\":%d,\"results\":[", runs, scale);
+    }
+
+    printf("%-12s %-16s %12s %12s %12s\n",
+           "workload", "shell", "wall ms", "cpu ms", "syscalls");
+
+    int exit_code = EXIT_SUCCESS;
+    char separator = FALSE;
+    size_t index;
+    for (index = 0; index < WORKLOADS; ++index) {
+        char script[PATH_LEN];
+        if (workload_write(&workloads[index], dir, scale, script)
+            == BAD_RESULT) {
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+
+        size_t shell_index;
+        for (shell_index = 0; shell_index < number_of_shells; ++shell_index) {
+            char const *shell = shells[shell_index];
+            double wall[MAX_RUNS];
+            double cpu[MAX_RUNS];
+            Result result = {0, 0, 0, 0};
+
+            int run;
+            for (run = 0; run < runs; ++run) {
+                if (bench_time(shell, script, &result) == BAD_RESULT) {
+                    exit_code = EXIT_FAILURE;
+                }
+
+                wall[run] = result.wall_ms;
+                cpu[run] = result.cpu_ms;
+            }
+
+            result.wall_ms = median(wall, (size_t) runs);
+            result.cpu_ms = median(cpu, (size_t) runs);
+            result.syscalls = bench_syscalls(shell, script);
+
+            char const *shell_name = strrchr(shell, '/');
+            printf("%-12s %-16s %12.2f %12.2f %12lld%s\n",
+                   workloads[index].name,
+                   shell_name ? shell_name + 1 : shell,
+                   result.wall_ms, result.cpu_ms, result.syscalls,
+                   result.status ? " (failed)" : "");
+
+            if (json) {
+                fprintf(json, "%s{\"workload\":\"%s\",\"shell\":\"%s\","
+                              "\"wall_ms\":%.3f,\"cpu_ms\":%.3f,"
+                              "\"syscalls\":%lld,\"status\":%d}",
+                        separator ? "," : "", workloads[index].name, shell,
+                        result.wall_ms, result.cpu_ms, result.syscalls,
+                        result.status);
+                separator = TRUE;
+            }
+        }
+
+        unlink(script);
+    }
+
+    if (json) {
+        fprintf(json, "]}\n");
+        fclose(json);
+    }
+
+    char data[PATH_LEN];
+    snprintf(data, sizeof(data), "%s/input", dir);
+    unlink(data);
+    snprintf(data, sizeof(data), "%s/output", dir);
+    unlink(data);
+    rmdir(dir);
+    return exit_code;
+}
+
+static void generate_commands(FILE *file, char const *dir, int scale) {
+    int index;
+    for (index = 0; index < 500 * scale; ++index) {
+        fprintf(file, "/bin/true\n");
+    }
+}
+
+static void generate_pipelines(FILE *file, char const *dir, int scale) {
+    int index;
+    for (index = 0; index < 50 * scale; ++index) {
+        fprintf(file, "/bin/echo pipeline");
+
+        int stage;
+        for (stage = 0; stage < 16; ++stage) {
+            fprintf(file, " | cat");
+        }
+
+        fprintf(file, " > /dev/null\n");
+    }
+}
+
+static void generate_background(FILE *file, char const *dir, int scale) {
+    int index;
+    for (index = 0; index < 20 * scale; ++index) {
+        int job;
+        for (job = 0; job < 16; ++job) {
+            fprintf(file, "/bin/true &\n");
+        }
+
+        fprintf(file, "wait\n");
+    }
+}
+
+static void generate_arguments(FILE *file, char const *dir, int scale) {
+    int index;
+    for (index = 0; index < 200 * scale; ++index) {
+        fprintf(file, "/bin/echo");
+
+        int argument;
+        for (argument = 0; argument < 200; ++argument) {
+            fprintf(file, " a%d", argument);
+        }
+
+        fprintf(file, " > /dev/null\n");
+    }
+}
+
+static void generate_redirects(FILE *file, char const *dir, int scale) {
+    int index;
+    for (index = 0; index < 200 * scale; ++index) {
+        fprintf(file, "/bin/echo line%d > %s/input\n", index, dir);
+        fprintf(file, "cat < %s/input >> %s/output\n", dir, dir);
+    }
+}
+
+static int workload_write(Workload const *workload,
+                          char const *dir,
+                          int scale,
+                          char *path) {
+    snprintf(path, PATH_LEN, "%s/%s.sh", dir, workload->name);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Couldn't write workload");
+        return BAD_RESULT;
+    }
+
+    workload->generate(file, dir, scale);
+    fclose(file);
+    return EXIT_SUCCESS;
+}
+
+static int shell_resolve(char const *name, char *path) {
+    if (strchr(name, '/')) {
+        snprintf(path, PATH_LEN, "%s", name);
+        return access(path, X_OK);
+    }
+
+    char const *directories = getenv("PATH");
+    while (directories && *directories) {
+        size_t len = strcspn(directories, ":");
+        snprintf(path, PATH_LEN, "%.*s/%s", (int) len, directories, name);
+        if (access(path, X_OK) == EXIT_SUCCESS) {
+            return EXIT_SUCCESS;
+        }
+
+        directories += len + (directories[len] == ':');
+    }
+
+    return BAD_RESULT;
+}
+
+static pid_t bench_spawn(char const *shell, char const *script, char traced) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid == BAD_RESULT) {
+            perror("Couldn't create process");
+        }
+
+        return pid;
+    }
+
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    if (traced) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+    }
+
+    execl(shell, shell, script, (char *) NULL);
+    perror("Couldn't execute shell");
+    _exit(127);
+}
+
+static int bench_time(char const *shell, char const *script, Result *result) {
+    struct timespec started;
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    pid_t pid = bench_spawn(shell, script, FALSE);
+    if (pid == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == BAD_RESULT) {
+        perror("Couldn't wait for shell");
+        return BAD_RESULT;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    result->wall_ms = timespec_ms(&started, &finished);
+    result->cpu_ms = timeval_ms(&usage.ru_utime) + timeval_ms(&usage.ru_stime);
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Counts syscall entries of the shell and every process it starts. Forks
+ * are followed automatically, the initial SIGSTOP of new tracees and the
+ * ptrace event stops are swallowed, other signals are passed on.
+ */
+static long long bench_syscalls(char const *shell, char const *script) {
+    pid_t pid = bench_spawn(shell, script, TRUE);
+    if (pid == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == BAD_RESULT || !WIFSTOPPED(status)) {
+        return BAD_RESULT;
+    }
+
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK
+                   | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE
+                   | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) options) == BAD_RESULT) {
+        perror("Couldn't trace shell");
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return BAD_RESULT;
+    }
+
+    long long syscalls = 0;
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    pid_t traced;
+    while ((traced = waitpid(-1, &status, __WALL)) != BAD_RESULT) {
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        int signal = WSTOPSIG(status);
+        if (signal == SYSCALL_STOP) {
+            syscalls += is_syscall_entry(traced);
+            signal = 0;
+        } else if (status >> 16 || signal == SIGSTOP || signal == SIGTRAP) {
+            signal = 0;
+        }
+
+        ptrace(PTRACE_SYSCALL, traced, NULL, (void *) (long) signal);
+    }
+
+    return syscalls;
+}
+
+/*
+ * Every syscall stops the tracee twice. Without PTRACE_GET_SYSCALL_INFO
+ * both stops are counted as halves.
+ */
+static int is_syscall_entry(pid_t pid) {
+#ifdef PTRACE_GET_SYSCALL_INFO
+    struct __ptrace_syscall_info info;
+    long size = ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *) sizeof(info),
+                       &info);
+    return size > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY;
+#else
+    static char entry = FALSE;
+    entry = (char) !entry;
+    return entry;
+#endif
+}
+
+static double median(double *values, size_t count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return count % 2
+           ? values[count / 2]
+           : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static int compare_doubles(void const *lhs, void const *rhs) {
+    double left = *(double const *) lhs;
+    double right = *(double const *) rhs;
+    return (left > right) - (left < right);
+}
+
+static double timespec_ms(struct timespec const *started,
+                          struct timespec const *finished) {
+    return (double) (finished->tv_sec - started->tv_sec) * 1e3
+           + (double) (finished->tv_nsec - started->tv_nsec) / 1e6;
+}
+
+static double timeval_ms(struct timeval const *value) {
+    return (double) value->tv_sec * 1e3 + (double) value->tv_usec / 1e3;
+}
+
+static void print_usage(char const *name) {
+    fprintf(stderr, "usage: %s [-r runs] [-s scale] [-o file.json] shell...\n",
+            name);
+}
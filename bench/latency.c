@@ -0,0 +1,437 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+#define TRUE 1
+#define FALSE 0
+
+#define END '\0'
+
+#define BAD_RESULT (-1)
+
+#define MAX_LINE 1024
+#define OUTPUT_BUFFER 4096
+
+#define DEFAULT_PROMPT "(*_*)$>"
+#define DEFAULT_COMMANDS 2000
+#define DEFAULT_PERCENTILE 99
+#define DEFAULT_WAIT_MS 10000
+
+#define CONTROL_PREFIX '^'
+#define NO_WAIT_PREFIX "- "
+#define COMMENT '#'
+
+#define CONTROL(key) ((key) & 0x1F)
+
+
+struct Session_St {
+    FILE *file;
+    size_t generated;
+    size_t count;
+};
+
+typedef struct Session_St Session;
+
+struct Terminal_St {
+    int master;
+    pid_t pid;
+    char const *prompt;
+    size_t matched;
+};
+
+typedef struct Terminal_St Terminal;
+
+struct Samples_St {
+    double *values;
+    size_t count;
+    size_t capacity;
+};
+
+typedef struct Samples_St Samples;
+
+
+static int session_next(Session *session, char *line);
+
+static void session_generate(size_t index, char *line);
+
+static int terminal_start(Terminal *terminal, char const *shell);
+
+static int terminal_send(Terminal *terminal, char const *line);
+
+static int terminal_wait_prompt(Terminal *terminal, int timeout_ms);
+
+static int terminal_wait_foreground(Terminal *terminal, int timeout_ms);
+
+static void terminal_stop(Terminal *terminal);
+
+static void samples_add(Samples *samples, double value);
+
+static double samples_percentile(Samples *samples, double percentile);
+
+static int compare_doubles(void const *lhs, void const *rhs);
+
+static double now_ms();
+
+static void print_usage(char const *name);
+
+
+/*
+ * Replays a session on a pseudo-terminal and measures the time from sending
+ * a line (Enter) to the next prompt. Lines are commands; "^Z" and "^C" send
+ * the control character; "- command" is sent without waiting for a prompt,
+ * for commands like "fg" that keep the terminal. Without a session file a
+ * mixed session of simple commands, conveyors, background jobs and
+ * ^Z/bg/fg/^C sequences is generated.
+ */
+int main(int argc, char *argv[]) {
+    Session session = {NULL, 0, DEFAULT_COMMANDS};
+    Terminal terminal = {BAD_RESULT, BAD_RESULT, DEFAULT_PROMPT, 0};
+    double percentile = DEFAULT_PERCENTILE;
+    double threshold = 0;
+    char const *json_path = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:n:p:q:t:o:")) != BAD_RESULT) {
+        switch (option) {
+            case 's':
+                session.file = fopen(optarg, "r");
+                if (!session.file) {
+                    perror("Couldn't open session");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                session.count = (size_t) atol(optarg);
+                break;
+            case 'p':
+                terminal.prompt = optarg;
+                break;
+            case 'q':
+                percentile = atof(optarg);
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            case 'o':
+                json_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind + 1 != argc || percentile <= 0 || percentile > 100) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (terminal_start(&terminal, argv[optind]) == BAD_RESULT
+        || terminal_wait_prompt(&terminal, DEFAULT_WAIT_MS) == BAD_RESULT) {
+        fprintf(stderr, "latency: %s: no prompt\n", argv[optind]);
+        terminal_stop(&terminal);
+        return EXIT_FAILURE;
+    }
+
+    Samples samples = {NULL, 0, 0};
+    size_t timeouts = 0;
+    char line[MAX_LINE];
+    while (session_next(&session, line)) {
+        char wait = strncmp(line, NO_WAIT_PREFIX, strlen(NO_WAIT_PREFIX)) != 0;
+        char const *input = wait ? line : line + strlen(NO_WAIT_PREFIX);
+
+        double started = now_ms();
+        if (terminal_send(&terminal, input) == BAD_RESULT) {
+            break;
+        }
+
+        if (!wait) {
+            if (terminal_wait_foreground(&terminal, DEFAULT_WAIT_MS)
+                == BAD_RESULT) {
+                fprintf(stderr, "latency: '%s' didn't take the terminal\n",
+                        input);
+                ++timeouts;
+            }
+
+            continue;
+        }
+
+        if (terminal_wait_prompt(&terminal, DEFAULT_WAIT_MS) == BAD_RESULT) {
+            fprintf(stderr, "latency: no prompt after '%s'\n", input);
+            ++timeouts;
+            continue;
+        }
+
+        samples_add(&samples, now_ms() - started);
+    }
+
+    terminal_stop(&terminal);
+    if (session.file) {
+        fclose(session.file);
+    }
+
+    if (!samples.count) {
+        fprintf(stderr, "latency: no samples\n");
+        return EXIT_FAILURE;
+    }
+
+    double sum = 0;
+    size_t index;
+    for (index = 0; index < samples.count; ++index) {
+        sum += samples.values[index];
+    }
+
+    double mean = sum / (double) samples.count;
+    double p50 = samples_percentile(&samples, 50);
+    double p90 = samples_percentile(&samples, 90);
+    double p99 = samples_percentile(&samples, 99);
+    double max = samples_percentile(&samples, 100);
+    double gate = samples_percentile(&samples, percentile);
+
+    printf("samples %zu timeouts %zu\n", samples.count, timeouts);
+    printf("mean %.3f ms  p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+           mean, p50, p90, p99, max);
+
+    if (json_path) {
+        FILE *json = fopen(json_path, "w");
+        if (!json) {
+            perror("Couldn't open JSON output");
+            return EXIT_FAILURE;
+        }
+
+        fprintf(json, "{\"samples\":%zu,\"timeouts\":%zu,\"mean_ms\":%.3f,"
+                      "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,"
+                      "\"max_ms\":%.3f}\n",
+                samples.count, timeouts, mean, p50, p90, p99, max);
+        fclose(json);
+    }
+
+    free(samples.values);
+    if (threshold > 0 && gate > threshold) {
+        printf("FAIL: p%g %.3f ms exceeds %.3f ms\n", percentile, gate,
+               threshold);
+        return EXIT_FAILURE;
+    }
+
+    return timeouts ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int session_next(Session *session, char *line) {
+    if (!session->file) {
+        if (session->generated >= session->count) {
+            return FALSE;
+        }
+
+        session_generate(session->generated++, line);
+        return TRUE;
+    }
+
+    while (fgets(line, MAX_LINE, session->file)) {
+        line[strcspn(line, "\n")] = END;
+        if (*line != END && *line != COMMENT) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Every 50 lines the session stops a foreground job, resumes it in the
+ * background, brings it back and interrupts it.
+ */
+static void session_generate(size_t index, char *line) {
+    static char const *commands[] = {
+            "true",
+            "echo latency",
+            "ls /",
+            "cat /etc/hostname | wc -c",
+            "true &",
+            "jobs",
+            "cd /tmp",
+            "cd /",
+            "false || true",
+            "stats -r",
+    };
+
+    static char const *job_control[] = {
+            "- sleep 30",
+            "^Z",
+            "jobs",
+            "bg",
+            "- fg",
+            "^C",
+    };
+
+    size_t const period = 50;
+    size_t const job_control_count = sizeof(job_control) / sizeof(char *);
+    size_t position = index % period;
+    if (position < job_control_count) {
+        strcpy(line, job_control[position]);
+        return;
+    }
+
+    strcpy(line, commands[index % (sizeof(commands) / sizeof(char *))]);
+}
+
+static int terminal_start(Terminal *terminal, char const *shell) {
+    terminal->pid = forkpty(&terminal->master, NULL, NULL, NULL);
+    if (terminal->pid == BAD_RESULT) {
+        perror("Couldn't start pseudo-terminal");
+        return BAD_RESULT;
+    }
+
+    if (terminal->pid == 0) {
+        setenv("TERM", "dumb", TRUE);
+        execl(shell, shell, (char *) NULL);
+        perror("Couldn't execute shell");
+        _exit(127);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int terminal_send(Terminal *terminal, char const *line) {
+    char buffer[MAX_LINE + 1];
+    size_t len;
+    if (line[0] == CONTROL_PREFIX && line[1] != END && line[2] == END) {
+        buffer[0] = (char) CONTROL(line[1]);
+        len = 1;
+    } else {
+        len = (size_t) snprintf(buffer, sizeof(buffer), "%s\n", line);
+    }
+
+    if (write(terminal->master, buffer, len) != (ssize_t) len) {
+        perror("Couldn't write to pseudo-terminal");
+        return BAD_RESULT;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Reads the output until the prompt is seen. The match is kept across
+ * reads, so a prompt split between two reads is still found.
+ */
+static int terminal_wait_prompt(Terminal *terminal, int timeout_ms) {
+    size_t prompt_len = strlen(terminal->prompt);
+    double deadline = now_ms() + timeout_ms;
+    while (TRUE) {
+        int left = (int) (deadline - now_ms());
+        struct pollfd fds = {terminal->master, POLLIN, 0};
+        if (left <= 0 || poll(&fds, 1, left) <= 0) {
+            return BAD_RESULT;
+        }
+
+        char buffer[OUTPUT_BUFFER];
+        ssize_t number_of_read = read(terminal->master, buffer, sizeof(buffer));
+        if (number_of_read <= 0) {
+            return BAD_RESULT;
+        }
+
+        ssize_t index;
+        for (index = 0; index < number_of_read; ++index) {
+            if (buffer[index] == terminal->prompt[terminal->matched]) {
+                ++terminal->matched;
+            } else {
+                terminal->matched = buffer[index] == terminal->prompt[0];
+            }
+
+            if (terminal->matched == prompt_len) {
+                terminal->matched = 0;
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+}
+
+/*
+ * Waits until a job other than the shell owns the terminal, so control
+ * characters sent next reach the job and not the shell. Output is drained
+ * meanwhile, the prompt can't appear before the job is done.
+ */
+static int terminal_wait_foreground(Terminal *terminal, int timeout_ms) {
+    double deadline = now_ms() + timeout_ms;
+    while (tcgetpgrp(terminal->master) == terminal->pid) {
+        if (now_ms() > deadline) {
+            return BAD_RESULT;
+        }
+
+        struct pollfd fds = {terminal->master, POLLIN, 0};
+        if (poll(&fds, 1, 1) > 0) {
+            char buffer[OUTPUT_BUFFER];
+            if (read(terminal->master, buffer, sizeof(buffer)) <= 0) {
+                return BAD_RESULT;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void terminal_stop(Terminal *terminal) {
+    if (terminal->pid == BAD_RESULT) {
+        return;
+    }
+
+    terminal_send(terminal, "exit");
+    terminal_wait_prompt(terminal, 100);
+    kill(terminal->pid, SIGHUP);
+    close(terminal->master);
+    waitpid(terminal->pid, NULL, 0);
+}
+
+static void samples_add(Samples *samples, double value) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->values = realloc(samples->values,
+                                  samples->capacity * sizeof(double));
+        if (!samples->values) {
+            fprintf(stderr, "Couldn't allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    samples->values[samples->count++] = value;
+}
+
+static double samples_percentile(Samples *samples, double percentile) {
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    size_t rank = (size_t) (percentile / 100 * (double) samples->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    return samples->values[(rank > samples->count ? samples->count : rank) - 1];
+}
+
+static int compare_doubles(void const *lhs, void const *rhs) {
+    double left = *(double const *) lhs;
+    double right = *(double const *) rhs;
+    return (left > right) - (left < right);
+}
+
+static double now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1e3 + (double) now.tv_nsec / 1e6;
+}
+
+static void print_usage(char const *name) {
+    fprintf(stderr, "usage: %s [-s session] [-n commands] [-p prompt]"
+                    " [-q percentile] [-t threshold_ms] [-o file.json] shell\n",
+            name);
+}
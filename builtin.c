@@ -6,12 +6,31 @@
 #include "builtin.h"
 #include "execute.h"
 #include "terminal.h"
+#include "stats.h"
+#include "event.h"
+#include "watch.h"
+#include "stream.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 
 #define EQUALS 0
 
+#define STATUS_LEN 12
+#define MAX_VARIABLE_NAME 64
+
+#define COPROC_IN_SUFFIX "_IN"
+#define COPROC_OUT_SUFFIX "_OUT"
+#define COPROC_PID_SUFFIX "_PID"
+
+#define MICROSECONDS_IN_MILLISECOND 1000ULL
+#define JOUT_FILE_MODE 0644
+#define NICE_ADJUSTMENT "--adjustment="
+
 
 static int builtin_cd(Command *command);
 
@@ -21,14 +40,85 @@ static int builtin_fg(JobController *controller, Command *command);
 
 static int builtin_bg(JobController *controller, Command *command);
 
-static int builtin_exit(JobController *controller);
+static int builtin_exit(JobController *controller, Command *command);
+
+static int builtin_replace(JobController *controller, Command *command);
+
+static int builtin_coproc(JobController *controller, Command *command);
+
+static void coproc_close(char const *name);
+
+static int builtin_read(Command *command);
+
+static int builtin_after(JobController *controller, Command *command);
+
+static int builtin_queue(JobController *controller, Command *command);
+
+static int builtin_cache(JobController *controller, Command *command);
+
+static int builtin_watch_run(JobController *controller, Command *command);
+
+static int watch_loop(JobController *controller,
+                      Command const *command,
+                      Watch *watch,
+                      int debounce,
+                      char restart);
+
+static int is_variable_name(char const *str);
 
 static int builtin_jkill(JobController *controller, Command *command);
 
+static int builtin_stats(Command *command);
+
+static int builtin_limit(JobController *controller, Command *command);
+
+static int builtin_pin(JobController *controller, Command *command);
+
+static int builtin_nice(Command *command);
+
+static int builtin_ionice(JobController *controller, Command *command);
+
+static int builtin_renice(JobController *controller, Command *command);
+
+static int builtin_timeout(Command *command);
+
+static int builtin_wait(JobController *controller, Command *command);
+
+static int builtin_merge_prefix(Command *command);
+
+static int builtin_merge(JobController *controller, Command *command);
+
+static int merge_options(char **arguments, MergeOptions *options);
+
+static int builtin_jout(JobController *controller, Command *command);
+
+static int jout_write(JobController *controller, int jid, char follow);
+
+static int jout_save(int jid, char const *file);
+
+static void jout_skipped(int jid, unsigned long long skipped);
+
+static int wait_collect(JobController *controller,
+                        jid_t *jids,
+                        size_t count,
+                        char any,
+                        int *status);
+
+static Job *job_get(JobController *controller, char *str, char const *name);
+
+static int builtin_ulimit(Command *command);
+
 static size_t job_get_index(JobController *controller, char *str);
 
+static int job_get_result(JobController const *controller, char const *str);
+
 
 int builtin_exec(JobController *controller, Command *command) {
+    int exit_code = builtin_prefix_exec(controller, command);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
     char *command_name = command_get_name(command);
 
     if (strcmp(command_name, "cd") == EQUALS) {
@@ -42,7 +132,33 @@ int builtin_exec(JobController *controller, Command *command) {
     } else if (strcmp(command_name, "jkill") == EQUALS) {
         return builtin_jkill(controller, command);
     } else if (strcmp(command_name, "exit") == EQUALS) {
-        return builtin_exit(controller);
+        return builtin_exit(controller, command);
+    } else if (strcmp(command_name, "exec") == EQUALS) {
+        return builtin_replace(controller, command);
+    } else if (strcmp(command_name, "coproc") == EQUALS) {
+        return builtin_coproc(controller, command);
+    } else if (strcmp(command_name, "read") == EQUALS) {
+        return builtin_read(command);
+    } else if (strcmp(command_name, "after") == EQUALS) {
+        return builtin_after(controller, command);
+    } else if (strcmp(command_name, "queue") == EQUALS) {
+        return builtin_queue(controller, command);
+    } else if (strcmp(command_name, "cache") == EQUALS) {
+        return builtin_cache(controller, command);
+    } else if (strcmp(command_name, "watch-run") == EQUALS) {
+        return builtin_watch_run(controller, command);
+    } else if (strcmp(command_name, "stats") == EQUALS) {
+        return builtin_stats(command);
+    } else if (strcmp(command_name, "ulimit") == EQUALS) {
+        return builtin_ulimit(command);
+    } else if (strcmp(command_name, "renice") == EQUALS) {
+        return builtin_renice(controller, command);
+    } else if (strcmp(command_name, "wait") == EQUALS) {
+        return builtin_wait(controller, command);
+    } else if (strcmp(command_name, "merge") == EQUALS) {
+        return builtin_merge(controller, command);
+    } else if (strcmp(command_name, "jout") == EQUALS) {
+        return builtin_jout(controller, command);
     }
 
     return CONTINUE;
@@ -64,20 +180,547 @@ static int builtin_cd(Command *command) {
 }
 
 static int builtin_jobs(JobController *controller, Command *command) {
-    if (command->arguments[1] != NULL) {
+    char format = JOBS_SHORT;
+    char *option = command->arguments[1];
+    if (option != NULL && strcmp(option, "-l") == EQUALS) {
+        format = JOBS_LONG;
+    } else if (option != NULL && strcmp(option, "--json") == EQUALS) {
+        format = JOBS_JSON;
+    }
+
+    if (command->arguments[format == JOBS_SHORT ? 1 : 2] != NULL) {
         fprintf(stderr, "shell: jobs: too many arguments\n");
         return CRASH;
     }
 
-    job_controller_print_all_jobs(controller);
+    job_controller_print_all_jobs(controller, format);
     return STOP;
 }
 
-static int builtin_exit(JobController *controller) {
+static int builtin_exit(JobController *controller, Command *command) {
+    char *status = command->arguments[1];
+    if (status) {
+        char *end = NULL;
+        long code = strtol(status, &end, 10);
+        if (end == status || *end != END) {
+            fprintf(stderr, "shell: exit: %s: numeric argument required\n",
+                    status);
+            code = EXIT_USAGE_STATUS;
+        }
+
+        controller->last_status = (int) (code & 0xFF);
+    }
+
     job_controller_release(controller);
     return EXIT;
 }
 
+static int builtin_replace(JobController *controller, Command *command) {
+    command_shift_arguments(command, 1);
+    return execute_replace(controller, command);
+}
+
+/*
+ * "coproc NAME command" starts the command as a job talking to the shell
+ * through NAME_IN (its input) and NAME_OUT (its output), used with ">&" and
+ * "<&" or "read -u". Starting another coprocess under the same name closes
+ * the descriptors of the previous one.
+ */
+static int builtin_coproc(JobController *controller, Command *command) {
+    char *name = command->arguments[1];
+    if (!name || !command->arguments[2]) {
+        fprintf(stderr, "shell: coproc: usage: coproc NAME command\n");
+        return CRASH;
+    }
+
+    if (!is_variable_name(name) || strlen(name) > MAX_VARIABLE_NAME) {
+        fprintf(stderr, "shell: coproc: %s: invalid name\n", name);
+        return CRASH;
+    }
+
+    coproc_close(name);
+    command_shift_arguments(command, 2);
+
+    int fds[2];
+    pid_t pid = execute_coprocess(controller, command, fds);
+    if (pid == BAD_PID) {
+        return CRASH;
+    }
+
+    char variable[MAX_VARIABLE_NAME + sizeof(COPROC_PID_SUFFIX)];
+    char value[STATUS_LEN];
+    snprintf(variable, sizeof(variable), "%s%s", name, COPROC_IN_SUFFIX);
+    snprintf(value, sizeof(value), "%d", fds[COPROC_WRITE]);
+    setenv(variable, value, TRUE);
+
+    snprintf(variable, sizeof(variable), "%s%s", name, COPROC_OUT_SUFFIX);
+    snprintf(value, sizeof(value), "%d", fds[COPROC_READ]);
+    setenv(variable, value, TRUE);
+
+    snprintf(variable, sizeof(variable), "%s%s", name, COPROC_PID_SUFFIX);
+    snprintf(value, sizeof(value), "%d", (int) pid);
+    setenv(variable, value, TRUE);
+
+    controller->last_status = EXIT_SUCCESS;
+    return STOP;
+}
+
+static void coproc_close(char const *name) {
+    char const *suffixes[] = {COPROC_IN_SUFFIX, COPROC_OUT_SUFFIX};
+    size_t index;
+    for (index = 0; index < sizeof(suffixes) / sizeof(char *); ++index) {
+        char variable[MAX_VARIABLE_NAME + sizeof(COPROC_PID_SUFFIX)];
+        snprintf(variable, sizeof(variable), "%s%s", name, suffixes[index]);
+        char *value = getenv(variable);
+        if (value && isdigit(*value)) {
+            execute_coprocess_close(atoi(value));
+        }
+
+        unsetenv(variable);
+    }
+}
+
+/*
+ * Reads one line into a variable. The line is read byte by byte, so nothing
+ * after it is taken from a pipe shared with other readers.
+ */
+static int builtin_read(Command *command) {
+    char **arguments = command->arguments;
+    int fd = STDIN_FILENO;
+    size_t index = 1;
+    if (arguments[1] && strcmp(arguments[1], "-u") == EQUALS) {
+        char *end = NULL;
+        long number = arguments[2] ? strtol(arguments[2], &end, 10) : BAD_RESULT;
+        if (!arguments[2] || !isdigit(*arguments[2]) || *end != END
+            || number > INT_MAX) {
+            fprintf(stderr, "shell: read: %s: invalid file descriptor\n",
+                    arguments[2] ? arguments[2] : "-u");
+            return CRASH;
+        }
+
+        fd = (int) number;
+        index = 3;
+    }
+
+    char *name = arguments[index];
+    if (!name || arguments[index + 1] || !is_variable_name(name)) {
+        fprintf(stderr, "shell: read: usage: read [-u fd] name\n");
+        return CRASH;
+    }
+
+    size_t len = 0;
+    size_t capacity = MAX_COMMAND_LINE;
+    char *line = malloc(capacity);
+    check_memory(line);
+
+    ssize_t number_of_read;
+    char symbol;
+    while ((number_of_read = read(fd, &symbol, 1)) > 0 && symbol != '\n') {
+        if (len + 1 == capacity) {
+            capacity *= 2;
+            line = realloc(line, capacity);
+            check_memory(line);
+        }
+
+        line[len++] = symbol;
+    }
+
+    line[len] = END;
+    if (number_of_read == BAD_RESULT) {
+        perror("shell: read");
+    } else if (number_of_read || len) {
+        setenv(name, line, TRUE);
+    }
+
+    free(line);
+    return number_of_read > 0 || (!number_of_read && len) ? STOP : CRASH;
+}
+
+/*
+ * "after %1 %3 [--on-success | --on-failure] -- command" registers the
+ * command as a deferred job. It is started in the background as soon as all
+ * the jobs are finished, or skipped when the condition does not hold: with
+ * --on-success every job has to succeed, with --on-failure one has to fail.
+ */
+static int builtin_after(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    char condition = AFTER_ANY;
+    jid_t depends[MAX_DEPENDENCIES];
+    size_t depends_count = 0;
+    char depends_failed = FALSE;
+
+    size_t index;
+    for (index = 1; arguments[index]; ++index) {
+        char *argument = arguments[index];
+        if (strcmp(argument, "--") == EQUALS) {
+            break;
+        }
+
+        if (strcmp(argument, "--on-success") == EQUALS) {
+            condition = AFTER_SUCCESS;
+        } else if (strcmp(argument, "--on-failure") == EQUALS) {
+            condition = AFTER_FAILURE;
+        } else if (*argument == '%' && argument[1] != END) {
+            size_t job_index = job_get_index(controller, argument);
+            jid_t jid = 0;
+            if (job_index < controller->number_of_jobs) {
+                jid = controller->jobs[job_index]->jid;
+            } else {
+                /* A finished job is resolved now, its jid may be reused */
+                int failed = job_get_result(controller, argument);
+                if (failed == BAD_RESULT) {
+                    fprintf(stderr, "shell: after: %s: no such job\n",
+                            argument);
+                    return CRASH;
+                }
+
+                depends_failed |= (char) failed;
+            }
+
+            if (depends_count == MAX_DEPENDENCIES) {
+                fprintf(stderr, "shell: after: too many jobs\n");
+                return CRASH;
+            }
+
+            depends[depends_count++] = jid;
+        } else {
+            fprintf(stderr, "shell: after: %s: invalid argument\n", argument);
+            return CRASH;
+        }
+    }
+
+    if (!depends_count || !arguments[index] || !arguments[index + 1]) {
+        fprintf(stderr, "shell: after: usage: after %%job... [--on-success | --on-failure] -- command\n");
+        return CRASH;
+    }
+
+    if (command->flag & (IN_PIPE | OUT_PIPE)) {
+        fprintf(stderr, "shell: after: cannot be part of a conveyor\n");
+        return CRASH;
+    }
+
+    command_shift_arguments(command, index + 1);
+    int exit_code = builtin_prefix_exec(controller, command);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
+    if (command->timeout.duration) {
+        fprintf(stderr, "shell: timeout: background jobs are not supported\n");
+        return CRASH;
+    }
+
+    if (command->merge.capture) {
+        fprintf(stderr, "shell: merge: deferred jobs are not supported\n");
+        return CRASH;
+    }
+
+    jid_t jid = job_controller_add_deferred(controller, command, depends,
+                                            depends_count, condition);
+    if (jid == BAD_RESULT) {
+        return CRASH;
+    }
+
+    size_t job_index = job_controller_search_job_by_jid(controller, jid);
+    controller->jobs[job_index]->depends_failed = depends_failed;
+
+    if (controller->job_control) {
+        fprintf(stderr, "[%d] %s\n", jid, job_get_status(JOB_DEFERRED));
+    }
+
+    execute_deferred(controller);
+    controller->last_status = EXIT_SUCCESS;
+    return STOP;
+}
+
+/*
+ * "queue" shows the limit on running background jobs, "queue N|cpus|off"
+ * changes it. Jobs over the limit wait as Queued.
+ */
+static int builtin_queue(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    if (!arguments[1]) {
+        job_controller_print_queue(controller, stdout);
+        return STOP;
+    }
+
+    if (arguments[2]) {
+        fprintf(stderr, "shell: queue: usage: queue [N | %s | %s]\n",
+                QUEUE_CPUS_VALUE, QUEUE_OFF_VALUE);
+        return CRASH;
+    }
+
+    if (job_controller_set_queue(controller, arguments[1]) == BAD_RESULT) {
+        fprintf(stderr, "shell: queue: %s: invalid limit\n", arguments[1]);
+        return CRASH;
+    }
+
+    execute_deferred(controller);
+    return STOP;
+}
+
+/*
+ * "cache [--inputs file...] [--env name...] [--mtime] -- command" replays
+ * the stored output and status of an earlier run with the same key, or
+ * runs the command and stores them. "cache stats" and "cache clear" manage
+ * the store.
+ */
+static int builtin_cache(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    if (arguments[1] && !arguments[2]
+        && strcmp(arguments[1], "stats") == EQUALS) {
+        cache_print_stats(stdout);
+        return STOP;
+    }
+
+    if (arguments[1] && !arguments[2]
+        && strcmp(arguments[1], "clear") == EQUALS) {
+        return cache_clear() == BAD_RESULT ? CRASH : STOP;
+    }
+
+    char *inputs[MAX_ARGS];
+    char *variables[MAX_ARGS];
+    CacheRequest request;
+    memset(&request, 0, sizeof(request));
+    request.inputs = inputs;
+    request.variables = variables;
+
+    char **list = NULL;
+    size_t *count = NULL;
+    size_t index;
+    for (index = 1; arguments[index]; ++index) {
+        char *argument = arguments[index];
+        if (strcmp(argument, "--") == EQUALS) {
+            break;
+        }
+
+        if (strcmp(argument, "--inputs") == EQUALS) {
+            list = inputs;
+            count = &request.inputs_count;
+        } else if (strcmp(argument, "--env") == EQUALS) {
+            list = variables;
+            count = &request.variables_count;
+        } else if (strcmp(argument, "--mtime") == EQUALS) {
+            request.by_mtime = TRUE;
+        } else if (list && *argument != '-') {
+            list[(*count)++] = argument;
+        } else {
+            fprintf(stderr, "shell: cache: %s: invalid argument\n", argument);
+            return CRASH;
+        }
+    }
+
+    if (!arguments[index] || !arguments[index + 1]) {
+        fprintf(stderr, "shell: cache: usage: cache [--inputs file...] [--env name...] [--mtime] -- command | stats | clear\n");
+        return CRASH;
+    }
+
+    command_shift_arguments(command, index + 1);
+    int exit_code = builtin_prefix_exec(controller, command);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
+    request.arguments = command->arguments;
+    if (command->flag & IN_FILE && command->infile
+        && *command->infile != REDIRECT_DUPLICATE) {
+        request.infile = command->infile;
+    }
+
+    CacheKey key;
+    if (cache_key(&request, &key) == BAD_RESULT) {
+        return CRASH;
+    }
+
+    return execute_cached(controller, command, &key);
+}
+
+/*
+ * "watch-run [--debounce ms] [--restart] path... -- command" runs the
+ * command as a background job, then again whenever something under the
+ * paths changes, until ^C. A burst of changes gives one run once the paths
+ * have been quiet for the debounce time. A change during a run queues one
+ * more run after it, or with --restart terminates the run first.
+ */
+static int builtin_watch_run(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    char *paths[MAX_ARGS];
+    size_t paths_count = 0;
+    long debounce = WATCH_DEFAULT_DEBOUNCE;
+    char restart = FALSE;
+
+    size_t index;
+    for (index = 1; arguments[index]; ++index) {
+        char *argument = arguments[index];
+        if (strcmp(argument, "--") == EQUALS) {
+            break;
+        }
+
+        if (strcmp(argument, "--debounce") == EQUALS) {
+            char *end = NULL;
+            if (arguments[index + 1]) {
+                debounce = strtol(arguments[++index], &end, 10);
+            }
+
+            if (!end || *end != END || debounce < 0 || debounce > INT_MAX) {
+                fprintf(stderr, "shell: watch-run: %s: invalid debounce\n",
+                        arguments[index]);
+                return CRASH;
+            }
+        } else if (strcmp(argument, "--restart") == EQUALS) {
+            restart = TRUE;
+        } else if (*argument != '-') {
+            paths[paths_count++] = argument;
+        } else {
+            fprintf(stderr, "shell: watch-run: %s: invalid argument\n",
+                    argument);
+            return CRASH;
+        }
+    }
+
+    if (!paths_count || !arguments[index] || !arguments[index + 1]) {
+        fprintf(stderr, "shell: watch-run: usage: watch-run [--debounce ms] [--restart] path... -- command\n");
+        return CRASH;
+    }
+
+    if (command->flag & (IN_PIPE | OUT_PIPE | BACKGROUND)) {
+        fprintf(stderr, "shell: watch-run: cannot be part of a conveyor or in the background\n");
+        return CRASH;
+    }
+
+    command_shift_arguments(command, index + 1);
+    int exit_code = builtin_prefix_exec(controller, command);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
+    if (command->timeout.duration) {
+        fprintf(stderr, "shell: timeout: background jobs are not supported\n");
+        return CRASH;
+    }
+
+    if (command->merge.capture) {
+        fprintf(stderr, "shell: merge: deferred jobs are not supported\n");
+        return CRASH;
+    }
+
+    Watch watch;
+    if (watch_open(&watch) == BAD_RESULT) {
+        return CRASH;
+    }
+
+    for (index = 0; index < paths_count; ++index) {
+        if (watch_add(&watch, paths[index]) == BAD_RESULT) {
+            watch_close(&watch);
+            return CRASH;
+        }
+    }
+
+    event_catch_interrupt(TRUE);
+    exit_code = watch_loop(controller, command, &watch, (int) debounce,
+                           restart);
+    event_catch_interrupt(FALSE);
+
+    watch_close(&watch);
+    return exit_code;
+}
+
+/*
+ * Each run is a deferred job without dependencies, so it is started and
+ * queued like any other background job. The loop sleeps in poll on the
+ * inotify descriptor and the SIGCHLD signalfd, with a timeout only while a
+ * burst is being debounced.
+ */
+static int watch_loop(JobController *controller,
+                      Command const *command,
+                      Watch *watch,
+                      int debounce,
+                      char restart) {
+    char changed[PATH_MAX] = "";
+    char pending = TRUE;
+    jid_t run = 0;
+    stats_time_t deadline = stats_now();
+
+    while (TRUE) {
+        execute_deferred(controller);
+
+        Job *job = NULL;
+        size_t job_index = job_controller_search_job_by_jid(controller, run);
+        if (run && job_index < controller->number_of_jobs) {
+            job = controller->jobs[job_index];
+            job_reap(job);
+        }
+
+        if (job && job_is_finished(job)) {
+            controller->last_status = job_status_code(job->exit_status);
+            fprintf(stderr, "watch-run: exit status %d\n",
+                    controller->last_status);
+            job_controller_remove_job_by_index(controller, job_index);
+            job = NULL;
+        }
+
+        if (!job) {
+            run = 0;
+        }
+
+        stats_time_t now = stats_now();
+        if (!run && pending && now >= deadline) {
+            if (*changed != END) {
+                fprintf(stderr, "watch-run: %s changed\n", changed);
+            }
+
+            run = job_controller_add_deferred(controller, command, NULL, 0,
+                                              AFTER_ANY);
+            if (run == BAD_RESULT) {
+                return CRASH;
+            }
+
+            pending = FALSE;
+            continue;
+        }
+
+        int timeout = BAD_RESULT;
+        if (pending && now < deadline) {
+            timeout = (int) ((deadline - now + MICROSECONDS_IN_MILLISECOND - 1)
+                             / MICROSECONDS_IN_MILLISECOND);
+        }
+
+        int events = event_wait_for(watch->fd, timeout);
+        if (events & EVENT_INTERRUPT) {
+            if (job) {
+                job_killpg(job, SIGTERM);
+            }
+
+            printf("\n");
+            controller->last_status = 128 + SIGINT;
+            return STOP;
+        }
+
+        if (events & EVENT_FD
+            && watch_read(watch, changed, sizeof(changed))) {
+            if (job && restart && !pending) {
+                job_killpg(job, SIGTERM);
+            }
+
+            pending = TRUE;
+            deadline = stats_now()
+                       + (stats_time_t) debounce * MICROSECONDS_IN_MILLISECOND;
+        }
+    }
+}
+
+static int is_variable_name(char const *str) {
+    if (!isalpha(*str) && *str != '_') {
+        return FALSE;
+    }
+
+    while (isalnum(*str) || *str == '_') {
+        ++str;
+    }
+
+    return *str == END;
+}
+
 static int builtin_fg(JobController *controller, Command *command) {
     if (!controller->number_of_jobs) {
         fprintf(stderr, "shell: fg: current: no such job\n");
@@ -96,13 +739,20 @@ static int builtin_fg(JobController *controller, Command *command) {
     }
 
     Job *job = controller->jobs[job_index];
+    if (job->status & JOB_DEFERRED) {
+        fprintf(stderr, "shell: fg: %%%d: job has not started\n", job->jid);
+        return CRASH;
+    }
+
     int exit_code = terminal_set_stdin(job->pid);
     if (exit_code == BAD_RESULT) {
         return CRASH;
     }
 
+    job_release(job);
     job_killpg(job, SIGCONT);
     job_wait(job);
+    job->notify = FALSE;
 
     pid_t pgrp = getpgrp();
     exit_code = terminal_set_stdin(pgrp);
@@ -110,9 +760,13 @@ static int builtin_fg(JobController *controller, Command *command) {
         return CRASH;
     }
 
-    if (job->status & JOB_DONE) {
-        printf("%s\n", command_get_name(job->command));
+    if (job_is_finished(job)) {
+        controller->last_status = job_status_code(job->exit_status);
+        job_print_command(job, stdout);
+        printf("\n");
         job_controller_remove_job_by_index(controller, job_index);
+    } else {
+        controller->last_status = 128 + SIGTSTP;
     }
 
     return STOP;
@@ -136,8 +790,15 @@ static int builtin_bg(JobController *controller, Command *command) {
     }
 
     Job *job = controller->jobs[job_index];
+    if (job->status & JOB_DEFERRED) {
+        fprintf(stderr, "shell: bg: %%%d: job has not started\n", job->jid);
+        return CRASH;
+    }
+
+    job_release(job);
     job_killpg(job, SIGCONT);
     job->status = JOB_RUNNING;
+    job->notify = FALSE;
     job_print(job, stdout, "");
     return STOP;
 }
@@ -167,8 +828,770 @@ static int builtin_jkill(JobController *controller, Command *command) {
     return STOP;
 }
 
-static size_t job_get_index(JobController *controller, char *str) {
-    size_t job_index = (size_t) (controller->number_of_jobs - 1);
+static int builtin_stats(Command *command) {
+    char **arguments = command->arguments;
+    if (!arguments[1]) {
+        stats_print(stdout);
+        return STOP;
+    }
+
+    if (strcmp(arguments[1], "-p") == EQUALS && !arguments[2]) {
+        stats_print_prometheus(stdout);
+    } else if (strcmp(arguments[1], "-r") == EQUALS && !arguments[2]) {
+        stats_reset();
+    } else if (strcmp(arguments[1], "-e") == EQUALS && arguments[2]
+               && (!arguments[3] || !arguments[4])) {
+        if (strcmp(arguments[2], "off") == EQUALS) {
+            stats_set_export(NULL, 0);
+            return STOP;
+        }
+
+        int interval = arguments[3] ? atoi(arguments[3])
+                                    : STATS_DEFAULT_INTERVAL;
+        if (interval <= 0) {
+            fprintf(stderr, "shell: stats: %s: invalid interval\n",
+                    arguments[3]);
+            return CRASH;
+        }
+
+        stats_set_export(arguments[2], (unsigned int) interval);
+    } else {
+        fprintf(stderr, "shell: stats: usage: stats [-p | -r | -e file|off [seconds]]\n");
+        return CRASH;
+    }
+
+    return STOP;
+}
+
+/*
+ * Launch prefixes like "limit -n 64 cmd" record their settings in the
+ * command and strip themselves, so the rest is executed as usual.
+ */
+int builtin_prefix_exec(JobController *controller, Command *command) {
+    while (TRUE) {
+        char *command_name = command_get_name(command);
+
+        int exit_code;
+        if (strcmp(command_name, "limit") == EQUALS) {
+            exit_code = builtin_limit(controller, command);
+        } else if (strcmp(command_name, "pin") == EQUALS) {
+            exit_code = builtin_pin(controller, command);
+        } else if (strcmp(command_name, "nice") == EQUALS) {
+            exit_code = builtin_nice(command);
+        } else if (strcmp(command_name, "ionice") == EQUALS) {
+            exit_code = builtin_ionice(controller, command);
+        } else if (strcmp(command_name, "timeout") == EQUALS) {
+            exit_code = builtin_timeout(command);
+        } else if (strcmp(command_name, "merge") == EQUALS) {
+            exit_code = builtin_merge_prefix(command);
+        } else {
+            return CONTINUE;
+        }
+
+        if (exit_code != CONTINUE || command->arguments[0] == command_name) {
+            return exit_code;
+        }
+    }
+}
+
+static int builtin_limit(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    char is_job = (char) (arguments[1] && arguments[1][0] == '%');
+
+    ResourceLimits limits;
+    memset(&limits, 0, sizeof(limits));
+    int consumed = resource_limits_parse(arguments + (is_job ? 2 : 1),
+                                         &limits, "limit");
+    if (consumed == BAD_RESULT) {
+        return CRASH;
+    }
+
+    if (!is_job) {
+        if (!arguments[consumed + 1]) {
+            fprintf(stderr, "shell: limit: usage: limit [-cdflmnstuv value]... command | %%job\n");
+            return CRASH;
+        }
+
+        resource_limits_merge(&command->limits, &limits);
+        command_shift_arguments(command, (size_t) consumed + 1);
+        return CONTINUE;
+    }
+
+    if (arguments[consumed + 2]) {
+        fprintf(stderr, "shell: limit: too many arguments\n");
+        return CRASH;
+    }
+
+    Job *job = job_get(controller, arguments[1], "limit");
+    if (!job) {
+        return CRASH;
+    }
+
+    size_t index;
+    for (index = 0; index < job->pids_count; ++index) {
+        int exit_code = resource_limits_apply(&limits, job->pids[index]);
+        if (exit_code == BAD_RESULT) {
+            return CRASH;
+        }
+    }
+
+    resource_limits_merge(&job->command->limits, &limits);
+    return STOP;
+}
+
+static int builtin_pin(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    char spread = (char) (arguments[1]
+                          && strcmp(arguments[1], "-p") == EQUALS);
+    char *cpus = arguments[spread ? 2 : 1];
+    char *target = cpus ? arguments[spread ? 3 : 2] : NULL;
+    if (!target) {
+        fprintf(stderr, "shell: pin: usage: pin [-p] cpus command | pin cpus %%job\n");
+        return CRASH;
+    }
+
+    Scheduling scheduling;
+    memset(&scheduling, 0, sizeof(scheduling));
+    if (scheduling_parse_cpus(cpus, &scheduling.cpus) == BAD_RESULT) {
+        fprintf(stderr, "shell: pin: %s: invalid CPU list\n", cpus);
+        return CRASH;
+    }
+
+    scheduling.mask = SCHEDULING_AFFINITY;
+    if (*target != '%') {
+        if (spread) {
+            scheduling.mask |= SCHEDULING_SPREAD;
+        }
+
+        scheduling_merge(&command->scheduling, &scheduling);
+        command_shift_arguments(command, spread ? 3 : 2);
+        return CONTINUE;
+    }
+
+    if (spread || arguments[3]) {
+        fprintf(stderr, "shell: pin: too many arguments\n");
+        return CRASH;
+    }
+
+    Job *job = job_get(controller, target, "pin");
+    if (!job) {
+        return CRASH;
+    }
+
+    if (scheduling_apply_group(&scheduling, job->pid, job->pids,
+                               job->pids_count) == BAD_RESULT) {
+        return CRASH;
+    }
+
+    job->command->scheduling.mask &= ~SCHEDULING_AFFINITY;
+    scheduling_merge(&job->command->scheduling, &scheduling);
+    return STOP;
+}
+
+/*
+ * "nice [-n N | -N | --adjustment=N] command": "-N" is the traditional
+ * form, so "nice -5" adds 5 and "nice --5" subtracts it.
+ */
+static int builtin_nice(Command *command) {
+    char **arguments = command->arguments;
+    int increment = DEFAULT_NICE_INCREMENT;
+    char *option = arguments[1];
+    char *value = NULL;
+    size_t consumed = 1;
+    if (option && (strcmp(option, "-n") == EQUALS
+                   || strcmp(option, "--adjustment") == EQUALS)) {
+        value = arguments[2] ? arguments[2] : option;
+        consumed = 3;
+    } else if (option && strncmp(option, NICE_ADJUSTMENT,
+                                 strlen(NICE_ADJUSTMENT)) == EQUALS) {
+        value = option + strlen(NICE_ADJUSTMENT);
+        consumed = 2;
+    } else if (option && option[0] == '-'
+               && (isdigit(option[1])
+                   || (option[1] == '-' && isdigit(option[2])))) {
+        value = option + 1;
+        consumed = 2;
+    } else if (option && strcmp(option, "--") == EQUALS) {
+        consumed = 2;
+    } else if (option && option[0] == '-') {
+        consumed = 0;
+    }
+
+    if (value) {
+        char *end = NULL;
+        increment = (int) strtol(value, &end, 10);
+        if (end == value || *end != END) {
+            fprintf(stderr, "shell: nice: %s: invalid increment\n", value);
+            return CRASH;
+        }
+    }
+
+    if (!consumed || !arguments[consumed]) {
+        fprintf(stderr, "shell: nice: usage: nice [-n increment | -increment] command\n");
+        return CRASH;
+    }
+
+    int nice = getpriority(PRIO_PROCESS, 0) + increment;
+    command->scheduling.nice = nice < -20 ? -20 : nice > 19 ? 19 : nice;
+    command->scheduling.mask |= SCHEDULING_NICE;
+    command_shift_arguments(command, consumed);
+    return CONTINUE;
+}
+
+static int builtin_ionice(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    int ioprio;
+    int consumed = scheduling_parse_ioprio(arguments + 1, &ioprio, "ionice");
+    if (consumed == BAD_RESULT) {
+        return CRASH;
+    }
+
+    char *target = arguments[consumed + 1];
+    if (!target || *target == '-') {
+        return CONTINUE;
+    }
+
+    Scheduling scheduling;
+    memset(&scheduling, 0, sizeof(scheduling));
+    scheduling.ioprio = ioprio;
+    scheduling.mask = SCHEDULING_IOPRIO;
+    if (*target != '%') {
+        scheduling_merge(&command->scheduling, &scheduling);
+        command_shift_arguments(command, (size_t) consumed + 1);
+        return CONTINUE;
+    }
+
+    Job *job = job_get(controller, target, "ionice");
+    if (!job || arguments[consumed + 2]) {
+        return CRASH;
+    }
+
+    if (scheduling_apply_group(&scheduling, job->pid, job->pids,
+                               job->pids_count) == BAD_RESULT) {
+        return CRASH;
+    }
+
+    scheduling_merge(&job->command->scheduling, &scheduling);
+    return STOP;
+}
+
+/*
+ * Only "renice value %job" is handled here, other forms are left to the
+ * external renice.
+ */
+static int builtin_renice(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    if (!arguments[1] || !arguments[2] || arguments[3]
+        || arguments[2][0] != '%') {
+        return CONTINUE;
+    }
+
+    char *end = NULL;
+    Scheduling scheduling;
+    memset(&scheduling, 0, sizeof(scheduling));
+    scheduling.nice = (int) strtol(arguments[1], &end, 10);
+    scheduling.mask = SCHEDULING_NICE;
+    if (end == arguments[1] || *end != END) {
+        fprintf(stderr, "shell: renice: %s: invalid priority\n", arguments[1]);
+        return CRASH;
+    }
+
+    Job *job = job_get(controller, arguments[2], "renice");
+    if (!job) {
+        return CRASH;
+    }
+
+    if (scheduling_apply_group(&scheduling, job->pid, job->pids,
+                               job->pids_count) == BAD_RESULT) {
+        return CRASH;
+    }
+
+    scheduling_merge(&job->command->scheduling, &scheduling);
+    return STOP;
+}
+
+static int builtin_timeout(Command *command) {
+    Timeout timeout;
+    int consumed = timeout_parse(command->arguments + 1, &timeout);
+    if (consumed == BAD_RESULT) {
+        return CRASH;
+    }
+
+    if (!command->arguments[consumed + 1]) {
+        fprintf(stderr, "shell: timeout: usage: timeout [-s signal] [-k duration] duration command\n");
+        return CRASH;
+    }
+
+    command->timeout = timeout;
+    command_shift_arguments(command, (size_t) consumed + 1);
+    return CONTINUE;
+}
+
+/*
+ * Blocks on the SIGCHLD signalfd until the given jobs (or any of them with
+ * -n) finish. The status of the last collected job becomes the last status.
+ */
+static int builtin_wait(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    char any = (char) (arguments[1] && strcmp(arguments[1], "-n") == EQUALS);
+
+    size_t capacity = (size_t) controller->number_of_jobs + 1;
+    jid_t *jids = malloc(capacity * sizeof(jid_t));
+    check_memory(jids);
+    size_t count = 0;
+    size_t index;
+    for (index = any ? 2 : 1; arguments[index]; ++index) {
+        char *spec = arguments[index];
+        size_t job_index = controller->number_of_jobs;
+        if (*spec == '%') {
+            job_index = job_get_index(controller, spec);
+        } else if (isdigit(*spec)) {
+            job_index = job_controller_search_job_by_pid(controller,
+                                                         atoi(spec));
+        }
+
+        if (job_index >= controller->number_of_jobs) {
+            fprintf(stderr, "shell: wait: %s: no such job\n", spec);
+            controller->last_status = 127;
+            free(jids);
+            return CRASH;
+        }
+
+        if (count < capacity) {
+            jids[count++] = controller->jobs[job_index]->jid;
+        }
+    }
+
+    if (index == (any ? 2 : 1)) {
+        for (index = 0; index < controller->number_of_jobs; ++index) {
+            Job *current_job = controller->jobs[index];
+            if (!(current_job->status & JOB_STOPPED)) {
+                jids[count++] = current_job->jid;
+            }
+        }
+    }
+
+    /* Like bash, so "while wait -n" loops end */
+    if (any && !count) {
+        controller->last_status = 127;
+        free(jids);
+        return CRASH;
+    }
+
+    int status = EXIT_SUCCESS;
+    event_catch_interrupt(TRUE);
+    int exit_code = wait_collect(controller, jids, count, any, &status);
+    event_catch_interrupt(FALSE);
+    free(jids);
+
+    controller->last_status = status;
+    return exit_code;
+}
+
+static int wait_collect(JobController *controller,
+                        jid_t *jids,
+                        size_t count,
+                        char any,
+                        int *status) {
+    size_t remaining = count;
+    while (remaining) {
+        execute_deferred(controller);
+
+        size_t index;
+        for (index = 0; index < count; ++index) {
+            if (!jids[index]) {
+                continue;
+            }
+
+            size_t job_index = job_controller_search_job_by_jid(controller,
+                                                                jids[index]);
+            if (job_index >= controller->number_of_jobs) {
+                jids[index] = 0;
+                --remaining;
+                continue;
+            }
+
+            Job *job = controller->jobs[job_index];
+            job_reap(job);
+            merge_drain();
+            if (job->status & JOB_STOPPED) {
+                job_print(job, stdout, "");
+                job->notify = FALSE;
+                *status = 128 + SIGTSTP;
+            } else if (job_is_finished(job)) {
+                *status = job_status_code(job->exit_status);
+                job_controller_remove_job_by_index(controller, job_index);
+            } else {
+                continue;
+            }
+
+            jids[index] = 0;
+            --remaining;
+            if (any) {
+                return STOP;
+            }
+        }
+
+        if (remaining && event_wait(BAD_RESULT) & EVENT_INTERRUPT) {
+            *status = 128 + SIGINT;
+            printf("\n");
+            return CRASH;
+        }
+    }
+
+    return STOP;
+}
+
+/*
+ * "merge [--prefix] [--time] [-o file] [--ring size] command &" starts a job
+ * whose output and errors go through a pipe to the shell, which writes them
+ * out line by line, or keeps the last size bytes of them for jout. Before a
+ * job spec it is the merge builtin instead.
+ */
+static int builtin_merge_prefix(Command *command) {
+    MergeOptions options;
+    int index = merge_options(command->arguments, &options);
+    if (index == BAD_RESULT) {
+        return CRASH;
+    }
+
+    char *next = command->arguments[index];
+    char separated = (char) (strcmp(command->arguments[index - 1],
+                                    "--") == EQUALS);
+    if (!separated && (!next || *next == '%')) {
+        return CONTINUE;
+    }
+
+    if (!next) {
+        fprintf(stderr, "shell: merge: usage: merge [--prefix] [--time] [-o file] [--ring size] [--] command &\n");
+        return CRASH;
+    }
+
+    options.capture = TRUE;
+    command->merge = options;
+    command_shift_arguments(command, (size_t) index);
+    return CONTINUE;
+}
+
+/*
+ * "merge [--prefix] [--time] [-o file] [--ring size] [%job...]" gives the
+ * captured jobs, all of them by default, the options and waits for them like
+ * wait.
+ */
+static int builtin_merge(JobController *controller, Command *command) {
+    MergeOptions options;
+    int index = merge_options(command->arguments, &options);
+    if (index == BAD_RESULT) {
+        return CRASH;
+    }
+
+    char **arguments = command->arguments;
+    char all = (char) !arguments[index];
+    size_t capacity = (size_t) controller->number_of_jobs + 1;
+    jid_t *jids = malloc(capacity * sizeof(jid_t));
+    check_memory(jids);
+    size_t count = 0;
+    for (; arguments[index]; ++index) {
+        Job *job = job_get(controller, arguments[index], "merge");
+        if (!job) {
+            free(jids);
+            return CRASH;
+        }
+
+        if (!merge_is_open(job->jid)) {
+            fprintf(stderr, "shell: merge: %s: output is not captured\n",
+                    arguments[index]);
+            free(jids);
+            return CRASH;
+        }
+
+        if (count < capacity) {
+            jids[count++] = job->jid;
+        }
+    }
+
+    size_t job_index;
+    for (job_index = 0; all && job_index < controller->number_of_jobs;
+         ++job_index) {
+        Job *current_job = controller->jobs[job_index];
+        if (merge_is_open(current_job->jid)
+            && !(current_job->status & JOB_STOPPED)) {
+            jids[count++] = current_job->jid;
+        }
+    }
+
+    size_t jid_index;
+    for (jid_index = 0; jid_index < count; ++jid_index) {
+        if ((options.flags || options.file || options.ring)
+            && merge_update(jids[jid_index], &options) == BAD_RESULT) {
+            free(jids);
+            return CRASH;
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+    event_catch_interrupt(TRUE);
+    int exit_code = wait_collect(controller, jids, count, FALSE, &status);
+    event_catch_interrupt(FALSE);
+    free(jids);
+
+    controller->last_status = status;
+    return exit_code;
+}
+
+/*
+ * "jout [%job] [-f] [--save file]" writes what a job started with
+ * "merge --ring" has kept, the job last started so by default, also after
+ * the job is gone. "-f" then follows the output until the job closes it or
+ * ^C; "--save" writes it to the file instead.
+ */
+static int builtin_jout(JobController *controller, Command *command) {
+    char **arguments = command->arguments;
+    char *spec = NULL;
+    char *file = NULL;
+    char follow = FALSE;
+    size_t index;
+    for (index = 1; arguments[index]; ++index) {
+        char *argument = arguments[index];
+        if (strcmp(argument, "-f") == EQUALS) {
+            follow = TRUE;
+        } else if (strcmp(argument, "--save") == EQUALS
+                   && arguments[index + 1]) {
+            file = arguments[++index];
+        } else if (*argument != '-' && !spec) {
+            spec = argument;
+        } else {
+            fprintf(stderr, "shell: jout: usage: jout [%%job] [-f | --save file]\n");
+            return CRASH;
+        }
+    }
+
+    if (follow && file) {
+        fprintf(stderr, "shell: jout: usage: jout [%%job] [-f | --save file]\n");
+        return CRASH;
+    }
+
+    int jid = merge_ring_last();
+    if (spec) {
+        char *digits = *spec == '%' ? spec + 1 : spec;
+        jid = *digits && strspn(digits, "0123456789") == strlen(digits)
+              ? atoi(digits)
+              : BAD_RESULT;
+    }
+
+    if (merge_ring_total(jid) == BAD_RESULT) {
+        fprintf(stderr, "shell: jout: %s: output is not kept\n",
+                spec ? spec : "%");
+        return CRASH;
+    }
+
+    if (file) {
+        return jout_save(jid, file);
+    }
+
+    fflush(stdout);
+    return jout_write(controller, jid, follow);
+}
+
+/*
+ * Writes the ring in parts and reads the captured jobs between them, so a
+ * slow terminal delays only jout and not the jobs. Without follow it stops
+ * at what was kept when it started.
+ */
+static int jout_write(JobController *controller, int jid, char follow) {
+    unsigned long long end = (unsigned long long) merge_ring_total(jid);
+    unsigned long long offset = 0;
+    unsigned long long skipped;
+    int exit_code = STOP;
+    event_catch_interrupt(TRUE);
+    while (follow || offset < end) {
+        size_t limit = STREAM_CHUNK;
+        if (!follow && end - offset < limit) {
+            limit = (size_t) (end - offset);
+        }
+
+        ssize_t copied = merge_ring_copy(jid, STDOUT_FILENO, &offset, limit,
+                                         &skipped);
+        jout_skipped(jid, skipped);
+        if (copied == BAD_RESULT) {
+            exit_code = merge_ring_total(jid) == BAD_RESULT ? STOP : CRASH;
+            break;
+        }
+
+        if (!copied && !merge_is_open(jid)) {
+            break;
+        }
+
+        if (event_wait_for(BAD_RESULT, copied ? 0 : BAD_RESULT)
+            & EVENT_INTERRUPT) {
+            controller->last_status = 128 + SIGINT;
+            printf("\n");
+            exit_code = CRASH;
+            break;
+        }
+    }
+
+    event_catch_interrupt(FALSE);
+    return exit_code;
+}
+
+static int jout_save(int jid, char const *file) {
+    int output = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      (mode_t) JOUT_FILE_MODE);
+    if (output == BAD_RESULT) {
+        fprintf(stderr, "shell: jout: %s: %s\n", file, strerror(errno));
+        return CRASH;
+    }
+
+    unsigned long long offset = 0;
+    unsigned long long skipped;
+    ssize_t copied = merge_ring_copy(jid, output, &offset, 0, &skipped);
+    if (copied == BAD_RESULT || close(output) == BAD_RESULT) {
+        fprintf(stderr, "shell: jout: %s: %s\n", file, strerror(errno));
+        return CRASH;
+    }
+
+    jout_skipped(jid, skipped);
+    return STOP;
+}
+
+static void jout_skipped(int jid, unsigned long long skipped) {
+    if (skipped) {
+        fprintf(stderr, "shell: jout: [%d]: %llu bytes overwritten\n", jid,
+                skipped);
+    }
+}
+
+/*
+ * Returns the index of the first word after the options, or BAD_RESULT.
+ */
+static int merge_options(char **arguments, MergeOptions *options) {
+    memset(options, 0, sizeof(MergeOptions));
+
+    int index;
+    for (index = 1; arguments[index]; ++index) {
+        char *argument = arguments[index];
+        if (strcmp(argument, "--prefix") == EQUALS) {
+            options->flags |= MERGE_PREFIX;
+        } else if (strcmp(argument, "--time") == EQUALS) {
+            options->flags |= MERGE_TIME;
+        } else if (strcmp(argument, "-o") == EQUALS && arguments[index + 1]) {
+            options->file = arguments[++index];
+        } else if (strcmp(argument, "--ring") == EQUALS && arguments[index + 1]) {
+            if (merge_parse_size(arguments[++index],
+                                 &options->ring) == BAD_RESULT) {
+                fprintf(stderr, "shell: merge: %s: invalid ring size\n",
+                        arguments[index]);
+                return BAD_RESULT;
+            }
+        } else if (strcmp(argument, "--") == EQUALS) {
+            return index + 1;
+        } else if (*argument == '-') {
+            fprintf(stderr, "shell: merge: %s: invalid option\n", argument);
+            return BAD_RESULT;
+        } else {
+            break;
+        }
+    }
+
+    return index;
+}
+
+static int builtin_ulimit(Command *command) {
+    char **arguments = command->arguments;
+    char which = 0;
+    int resource = BAD_RESULT;
+    char *value = NULL;
+
+    size_t index;
+    for (index = 1; arguments[index]; ++index) {
+        char *argument = arguments[index];
+        if (argument[0] != '-' || argument[1] == END || argument[2] != END) {
+            if (resource == BAD_RESULT || value) {
+                fprintf(stderr, "shell: ulimit: %s: invalid argument\n",
+                        argument);
+                return CRASH;
+            }
+
+            value = argument;
+        } else if (argument[1] == 'H') {
+            which |= LIMIT_HARD;
+        } else if (argument[1] == 'S') {
+            which |= LIMIT_SOFT;
+        } else if (argument[1] == 'a') {
+            resource_limit_print_all(which ? which : LIMIT_SOFT, stdout);
+            return STOP;
+        } else {
+            resource = resource_limit_by_option(argument[1]);
+            if (resource == BAD_RESULT || value) {
+                fprintf(stderr, "shell: ulimit: %s: invalid option\n",
+                        argument);
+                return CRASH;
+            }
+        }
+    }
+
+    if (resource == BAD_RESULT) {
+        resource = RLIMIT_FSIZE;
+    }
+
+    if (!value) {
+        int exit_code = resource_limit_print_current(resource,
+                                                     which ? which : LIMIT_SOFT,
+                                                     stdout);
+        return exit_code == BAD_RESULT ? CRASH : STOP;
+    }
+
+    rlim_t limit;
+    if (resource_limit_parse_value(value, resource, &limit) == BAD_RESULT) {
+        fprintf(stderr, "shell: ulimit: %s: invalid limit\n", value);
+        return CRASH;
+    }
+
+    int exit_code = resource_limit_set_current(resource,
+                                               which ? which : LIMIT_BOTH,
+                                               limit);
+    return exit_code == BAD_RESULT ? CRASH : STOP;
+}
+
+static Job *job_get(JobController *controller, char *str, char const *name) {
+    size_t job_index = job_get_index(controller, str);
+    if (job_index >= controller->number_of_jobs) {
+        fprintf(stderr, "shell: %s: %s: no such job\n", name, str);
+        return NULL;
+    }
+
+    Job *job = controller->jobs[job_index];
+    if (job->status & JOB_DEFERRED) {
+        fprintf(stderr, "shell: %s: %s: job has not started\n", name, str);
+        return NULL;
+    }
+
+    return job;
+}
+
+/*
+ * Whether the job "%N" failed when it is no longer in the table, or
+ * BAD_RESULT if nothing is kept for it.
+ */
+static int job_get_result(JobController const *controller, char const *str) {
+    if (*str == '%') {
+        ++str;
+    }
+
+    if (!*str || strspn(str, "0123456789") != strlen(str)) {
+        return BAD_RESULT;
+    }
+
+    return job_controller_result(controller, atoi(str));
+}
+
+static size_t job_get_index(JobController *controller, char *str) {
+    size_t job_index = (size_t) (controller->number_of_jobs - 1);
+    if (str && *str == '%') {
+        ++str;
+    }
+
     if (str) {
         size_t curr_index = 0;
         for (curr_index = 0; curr_index < strlen(str); ++curr_index) {
@@ -12,5 +12,7 @@
 
 int builtin_exec(JobController *controller, Command *command);
 
+int builtin_prefix_exec(JobController *controller, Command *command);
+
 
 #endif //BUILTIN_H
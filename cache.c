@@ -0,0 +1,661 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "cache.h"
+#include "stream.h"
+#include "event.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define CACHE_MAGIC "SHCACHE1"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_TEMP_PREFIX '.'
+#define CACHE_CHUNK (1 << 16)
+#define CACHE_DIR_MODE 0755
+#define CACHE_FILE_MODE 0644
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+#define FIELD_WORD 'w'
+#define FIELD_DIRECTORY 'd'
+#define FIELD_PROGRAM 'p'
+#define FIELD_VARIABLE 'v'
+#define FIELD_UNSET 'u'
+#define FIELD_INPUT 'i'
+#define FIELD_CONTENT 'c'
+#define FIELD_STAMP 's'
+
+
+struct CacheHeader_St {
+    char magic[CACHE_MAGIC_LEN];
+    int32_t status;
+    uint32_t reserved;
+    uint64_t output_len;
+    uint64_t errors_len;
+    uint64_t duration;
+};
+
+typedef struct CacheHeader_St CacheHeader;
+
+/*
+ * Two 64-bit FNV hashes, FNV-1a and FNV-1, make a 128-bit key. They are not
+ * cryptographic: the store is local and trusts its user.
+ */
+struct CacheHash_St {
+    uint64_t first;
+    uint64_t second;
+};
+
+typedef struct CacheHash_St CacheHash;
+
+struct CacheFile_St {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec used;
+};
+
+typedef struct CacheFile_St CacheFile;
+
+
+static unsigned long long cache_hits = 0;
+static unsigned long long cache_misses = 0;
+static unsigned long long cache_stored = 0;
+static stats_time_t cache_saved = 0;
+
+static char chunk[CACHE_CHUNK];
+
+
+static int cache_directory(char *path, size_t size);
+
+static long long cache_limit();
+
+static void hash_bytes(CacheHash *hash, void const *data, size_t size);
+
+static void hash_field(CacheHash *hash, char tag, void const *data, size_t size);
+
+static void hash_stamp(CacheHash *hash, struct stat const *info);
+
+static int hash_input(CacheHash *hash, char const *name, char by_mtime);
+
+static void hash_program(CacheHash *hash, char const *name);
+
+static int cache_scan(char const *directory,
+                      CacheFile **files,
+                      size_t *count,
+                      long long *total);
+
+static void cache_evict(char const *directory);
+
+static int compare_used(void const *lhs, void const *rhs);
+
+static void cache_keep_errors(CacheEntry *entry, char const *data, size_t size);
+
+
+/*
+ * The key covers everything the command is declared to depend on: its
+ * words, the working directory, the program file, PATH and the chosen
+ * variables, and the content (or size and modification time) of the input
+ * files, including an input redirect.
+ */
+int cache_key(CacheRequest const *request, CacheKey *key) {
+    CacheHash hash = {FNV_OFFSET, FNV_OFFSET};
+    hash_field(&hash, FIELD_WORD, CACHE_MAGIC, CACHE_MAGIC_LEN);
+
+    char *const *word;
+    for (word = request->arguments; *word; ++word) {
+        hash_field(&hash, FIELD_WORD, *word, strlen(*word));
+    }
+
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory))) {
+        hash_field(&hash, FIELD_DIRECTORY, directory, strlen(directory));
+    }
+
+    hash_program(&hash, request->arguments[0]);
+
+    char const *path = getenv("PATH");
+    hash_field(&hash, FIELD_VARIABLE, path ? path : "", path ? strlen(path) : 0);
+
+    size_t index;
+    for (index = 0; index < request->variables_count; ++index) {
+        char const *name = request->variables[index];
+        char const *value = getenv(name);
+        hash_field(&hash, value ? FIELD_VARIABLE : FIELD_UNSET,
+                   name, strlen(name));
+        if (value) {
+            hash_field(&hash, FIELD_VARIABLE, value, strlen(value));
+        }
+    }
+
+    for (index = 0; index < request->inputs_count; ++index) {
+        if (hash_input(&hash, request->inputs[index],
+                       request->by_mtime) == BAD_RESULT) {
+            return BAD_RESULT;
+        }
+    }
+
+    if (request->infile
+        && hash_input(&hash, request->infile, request->by_mtime) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    snprintf(key->name, sizeof(key->name), "%016llx%016llx",
+             (unsigned long long) hash.first,
+             (unsigned long long) hash.second);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Writes the stored output of a hit to the shell's own descriptors and
+ * marks the entry as used. Returns FALSE on a miss; a damaged entry is a
+ * miss and is removed.
+ */
+int cache_replay(CacheKey const *key, int *status) {
+    char path[PATH_MAX];
+    if (cache_directory(path, sizeof(path)) == BAD_RESULT) {
+        ++cache_misses;
+        return FALSE;
+    }
+
+    size_t len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/%s", key->name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == BAD_RESULT) {
+        ++cache_misses;
+        return FALSE;
+    }
+
+    CacheHeader header;
+    struct stat info;
+    if (read(fd, &header, sizeof(header)) != sizeof(header)
+        || memcmp(header.magic, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0
+        || fstat(fd, &info) == BAD_RESULT
+        || (uint64_t) info.st_size
+           != sizeof(header) + header.output_len + header.errors_len) {
+        close(fd);
+        unlink(path);
+        ++cache_misses;
+        return FALSE;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    if (stream_copy(fd, STDOUT_FILENO, (long long) header.output_len)
+        == BAD_RESULT && errno != EPIPE) {
+        perror("shell: cache");
+    }
+
+    lseek(fd, (off_t) (sizeof(header) + header.output_len), SEEK_SET);
+    stream_copy(fd, STDERR_FILENO, (long long) header.errors_len);
+    futimens(fd, NULL);
+    close(fd);
+
+    ++cache_hits;
+    cache_saved += header.duration;
+    *status = header.status;
+    return TRUE;
+}
+
+/*
+ * Opens a temporary entry next to the store. If it can't be created the
+ * command still runs, its output is just not stored.
+ */
+void cache_begin(CacheEntry *entry, CacheKey const *key) {
+    memset(entry, 0, sizeof(CacheEntry));
+    entry->fd = BAD_RESULT;
+    entry->started = stats_now();
+
+    char directory[PATH_MAX];
+    if (cache_directory(directory, sizeof(directory)) == BAD_RESULT) {
+        return;
+    }
+
+    if (snprintf(entry->path, sizeof(entry->path), "%s/%s", directory,
+                 key->name) >= (int) sizeof(entry->path)
+        || snprintf(entry->temp, sizeof(entry->temp), "%s/%c%s.%d", directory,
+                    CACHE_TEMP_PREFIX, key->name, (int) getpid())
+           >= (int) sizeof(entry->temp)) {
+        return;
+    }
+
+    entry->fd = open(entry->temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     (mode_t) CACHE_FILE_MODE);
+    if (entry->fd == BAD_RESULT) {
+        return;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    if (stream_write_all(entry->fd, (char const *) &header,
+                         sizeof(header)) == BAD_RESULT) {
+        cache_discard(entry);
+    }
+}
+
+/*
+ * Passes the command's output and errors through to the shell's own
+ * descriptors while keeping a copy, until both pipes are closed. The
+ * command can't be stopped meanwhile: the shell is busy reading it, so a
+ * stopped command is continued.
+ */
+int cache_pump(CacheEntry *entry,
+               int output,
+               int errors,
+               pid_t pid,
+               char job_control) {
+    long long limit = cache_limit();
+    struct pollfd fds[3];
+    fds[0].fd = output;
+    fds[0].events = POLLIN;
+    fds[1].fd = errors;
+    fds[1].events = POLLIN;
+    fds[2].fd = event_child_fd();
+    fds[2].events = POLLIN;
+
+    while (fds[0].fd != BAD_RESULT || fds[1].fd != BAD_RESULT) {
+        if (poll(fds, 3, BAD_RESULT) == BAD_RESULT) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Couldn't wait for command output");
+            return BAD_RESULT;
+        }
+
+        if (fds[2].revents) {
+            event_child_drain();
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (waitid(P_PID, (id_t) pid, &info, WSTOPPED | WNOHANG)
+                == EXIT_SUCCESS && info.si_pid == pid) {
+                if (job_control) {
+                    killpg(pid, SIGCONT);
+                } else {
+                    kill(pid, SIGCONT);
+                }
+            }
+        }
+
+        size_t index;
+        for (index = 0; index < 2; ++index) {
+            if (!fds[index].revents) {
+                continue;
+            }
+
+            ssize_t number_of_read = read(fds[index].fd, chunk, sizeof(chunk));
+            if (number_of_read <= 0) {
+                if (number_of_read == 0 || errno != EINTR) {
+                    close(fds[index].fd);
+                    fds[index].fd = BAD_RESULT;
+                }
+
+                continue;
+            }
+
+            size_t size = (size_t) number_of_read;
+            if (index == 0) {
+                stream_write_all(STDOUT_FILENO, chunk, size);
+                entry->output_len += size;
+                if (entry->fd != BAD_RESULT
+                    && stream_write_all(entry->fd, chunk, size) == BAD_RESULT) {
+                    cache_discard(entry);
+                }
+            } else {
+                stream_write_all(STDERR_FILENO, chunk, size);
+                cache_keep_errors(entry, chunk, size);
+            }
+
+            if (entry->output_len + entry->errors_len > (size_t) limit) {
+                cache_discard(entry);
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stores the entry if the command exited by itself. Killed or timed out
+ * commands are not stored.
+ */
+void cache_commit(CacheEntry *entry, int status) {
+    if (entry->fd == BAD_RESULT || !WIFEXITED(status)) {
+        cache_discard(entry);
+        return;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    header.status = WEXITSTATUS(status);
+    header.output_len = entry->output_len;
+    header.errors_len = entry->errors_len;
+    header.duration = stats_now() - entry->started;
+
+    if ((entry->errors_len
+         && stream_write_all(entry->fd, entry->errors,
+                             entry->errors_len) == BAD_RESULT)
+        || pwrite(entry->fd, &header, sizeof(header), 0) != sizeof(header)
+        || close(entry->fd) == BAD_RESULT) {
+        entry->fd = BAD_RESULT;
+        cache_discard(entry);
+        return;
+    }
+
+    entry->fd = BAD_RESULT;
+    if (rename(entry->temp, entry->path) == BAD_RESULT) {
+        cache_discard(entry);
+        return;
+    }
+
+    free(entry->errors);
+    entry->errors = NULL;
+    ++cache_stored;
+
+    char directory[PATH_MAX];
+    if (cache_directory(directory, sizeof(directory)) == EXIT_SUCCESS) {
+        cache_evict(directory);
+    }
+}
+
+void cache_print_stats(FILE *file) {
+    char directory[PATH_MAX];
+    CacheFile *files = NULL;
+    size_t count = 0;
+    long long total = 0;
+    if (cache_directory(directory, sizeof(directory)) == EXIT_SUCCESS) {
+        cache_scan(directory, &files, &count, &total);
+        fprintf(file, "directory %s\n", directory);
+    }
+
+    free(files);
+    fprintf(file, "entries   %zu\n", count);
+    fprintf(file, "bytes     %lld of %lld\n", total, cache_limit());
+    fprintf(file, "hits      %llu\n", cache_hits);
+    fprintf(file, "misses    %llu\n", cache_misses);
+    fprintf(file, "stored    %llu\n", cache_stored);
+    fprintf(file, "saved     %.3f s\n", (double) cache_saved / 1e6);
+}
+
+int cache_clear() {
+    char directory[PATH_MAX];
+    if (cache_directory(directory, sizeof(directory)) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    CacheFile *files = NULL;
+    size_t count = 0;
+    long long total = 0;
+    if (cache_scan(directory, &files, &count, &total) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    size_t index;
+    for (index = 0; index < count; ++index) {
+        char path[PATH_MAX + NAME_MAX + 1];
+        snprintf(path, sizeof(path), "%s/%s", directory, files[index].name);
+        unlink(path);
+    }
+
+    free(files);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * SHELL_CACHE_DIR, or ~/.cache/shell. The directory is created on demand.
+ */
+static int cache_directory(char *path, size_t size) {
+    char const *directory = getenv(CACHE_DIR_ENV);
+    if (directory && *directory) {
+        snprintf(path, size, "%s", directory);
+    } else {
+        char const *home = getenv("HOME");
+        if (!home || !*home) {
+            return BAD_RESULT;
+        }
+
+        snprintf(path, size, "%s/%s", home, CACHE_DEFAULT_DIR);
+    }
+
+    char *slash;
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = END;
+        mkdir(path, (mode_t) CACHE_DIR_MODE);
+        *slash = '/';
+    }
+
+    if (mkdir(path, (mode_t) CACHE_DIR_MODE) == BAD_RESULT && errno != EEXIST) {
+        return BAD_RESULT;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static long long cache_limit() {
+    char const *value = getenv(CACHE_SIZE_ENV);
+    long long limit = value ? atoll(value) : 0;
+    return limit > 0 ? limit : CACHE_DEFAULT_SIZE;
+}
+
+static void hash_bytes(CacheHash *hash, void const *data, size_t size) {
+    unsigned char const *bytes = data;
+    size_t index;
+    for (index = 0; index < size; ++index) {
+        hash->first = (hash->first ^ bytes[index]) * FNV_PRIME;
+        hash->second = (hash->second * FNV_PRIME) ^ bytes[index];
+    }
+}
+
+/*
+ * Every field is tagged and prefixed with its length, so the words
+ * "a b" and "ab" never hash the same.
+ */
+static void hash_field(CacheHash *hash, char tag, void const *data, size_t size) {
+    uint64_t len = size;
+    hash_bytes(hash, &tag, sizeof(tag));
+    hash_bytes(hash, &len, sizeof(len));
+    hash_bytes(hash, data, size);
+}
+
+static void hash_stamp(CacheHash *hash, struct stat const *info) {
+    int64_t stamp[4];
+    stamp[0] = (int64_t) info->st_size;
+    stamp[1] = (int64_t) info->st_mtim.tv_sec;
+    stamp[2] = (int64_t) info->st_mtim.tv_nsec;
+    stamp[3] = (int64_t) info->st_ino;
+    hash_field(hash, FIELD_STAMP, stamp, sizeof(stamp));
+}
+
+static int hash_input(CacheHash *hash, char const *name, char by_mtime) {
+    hash_field(hash, FIELD_INPUT, name, strlen(name));
+
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == BAD_RESULT || fstat(fd, &info) == BAD_RESULT) {
+        fprintf(stderr, "shell: cache: %s: %s\n", name, strerror(errno));
+        if (fd != BAD_RESULT) {
+            close(fd);
+        }
+
+        return BAD_RESULT;
+    }
+
+    if (by_mtime || !S_ISREG(info.st_mode)) {
+        hash_stamp(hash, &info);
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+
+    void *data = NULL;
+    if (info.st_size) {
+        data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "shell: cache: %s: %s\n", name, strerror(errno));
+        return BAD_RESULT;
+    }
+
+    hash_field(hash, FIELD_CONTENT, data ? data : "", (size_t) info.st_size);
+    if (data) {
+        munmap(data, (size_t) info.st_size);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * The program file is found like execvp finds it; a new build of the tool
+ * gives new keys.
+ */
+static void hash_program(CacheHash *hash, char const *name) {
+    struct stat info;
+    if (strchr(name, '/')) {
+        if (stat(name, &info) == EXIT_SUCCESS) {
+            hash_field(hash, FIELD_PROGRAM, name, strlen(name));
+            hash_stamp(hash, &info);
+        }
+
+        return;
+    }
+
+    char const *path = getenv("PATH");
+    while (path && *path) {
+        size_t len = strcspn(path, ":");
+        char program[PATH_MAX];
+        snprintf(program, sizeof(program), "%.*s/%s", (int) len, path, name);
+        if (stat(program, &info) == EXIT_SUCCESS && S_ISREG(info.st_mode)
+            && access(program, X_OK) == EXIT_SUCCESS) {
+            hash_field(hash, FIELD_PROGRAM, program, strlen(program));
+            hash_stamp(hash, &info);
+            return;
+        }
+
+        path += len + (path[len] == ':');
+    }
+}
+
+static int cache_scan(char const *directory,
+                      CacheFile **files,
+                      size_t *count,
+                      long long *total) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        return BAD_RESULT;
+    }
+
+    size_t capacity = 0;
+    struct dirent *item;
+    while ((item = readdir(dir))) {
+        struct stat info;
+        if (*item->d_name == CACHE_TEMP_PREFIX
+            || fstatat(dirfd(dir), item->d_name, &info, 0) == BAD_RESULT
+            || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : CACHE_CHUNK / sizeof(CacheFile);
+            *files = realloc(*files, capacity * sizeof(CacheFile));
+            check_memory(*files);
+        }
+
+        CacheFile *file = &(*files)[(*count)++];
+        snprintf(file->name, sizeof(file->name), "%s", item->d_name);
+        file->size = info.st_size;
+        file->used = info.st_mtim;
+        *total += info.st_size;
+    }
+
+    closedir(dir);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Removes the least recently used entries until the store fits its size.
+ * A hit touches the entry, so the modification time is the last use.
+ */
+static void cache_evict(char const *directory) {
+    CacheFile *files = NULL;
+    size_t count = 0;
+    long long total = 0;
+    long long limit = cache_limit();
+    if (cache_scan(directory, &files, &count, &total) == BAD_RESULT
+        || total <= limit) {
+        free(files);
+        return;
+    }
+
+    qsort(files, count, sizeof(CacheFile), compare_used);
+    size_t index;
+    for (index = 0; index < count && total > limit; ++index) {
+        char path[PATH_MAX + NAME_MAX + 1];
+        snprintf(path, sizeof(path), "%s/%s", directory, files[index].name);
+        if (unlink(path) == EXIT_SUCCESS) {
+            total -= files[index].size;
+        }
+    }
+
+    free(files);
+}
+
+static int compare_used(void const *lhs, void const *rhs) {
+    struct timespec const *left = &((CacheFile const *) lhs)->used;
+    struct timespec const *right = &((CacheFile const *) rhs)->used;
+    if (left->tv_sec != right->tv_sec) {
+        return left->tv_sec < right->tv_sec ? -1 : 1;
+    }
+
+    return left->tv_nsec < right->tv_nsec ? -1 : left->tv_nsec > right->tv_nsec;
+}
+
+void cache_discard(CacheEntry *entry) {
+    if (entry->fd != BAD_RESULT) {
+        close(entry->fd);
+        entry->fd = BAD_RESULT;
+    }
+
+    if (*entry->temp != END) {
+        unlink(entry->temp);
+        *entry->temp = END;
+    }
+
+    free(entry->errors);
+    entry->errors = NULL;
+    entry->errors_capacity = 0;
+}
+
+static void cache_keep_errors(CacheEntry *entry, char const *data, size_t size) {
+    if (entry->fd == BAD_RESULT) {
+        entry->errors_len += size;
+        return;
+    }
+
+    if (entry->errors_len + size > entry->errors_capacity) {
+        size_t capacity = entry->errors_capacity ? entry->errors_capacity
+                                                 : CACHE_CHUNK;
+        while (capacity < entry->errors_len + size) {
+            capacity *= 2;
+        }
+
+        entry->errors = realloc(entry->errors, capacity);
+        check_memory(entry->errors);
+        entry->errors_capacity = capacity;
+    }
+
+    memcpy(entry->errors + entry->errors_len, data, size);
+    entry->errors_len += size;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef CACHE_H
+#define CACHE_H
+
+
+#include "shell.h"
+#include "stats.h"
+
+#include <limits.h>
+
+
+#define CACHE_DIR_ENV "SHELL_CACHE_DIR"
+#define CACHE_SIZE_ENV "SHELL_CACHE_SIZE"
+#define CACHE_DEFAULT_DIR ".cache/shell"
+#define CACHE_DEFAULT_SIZE (64LL << 20)
+
+#define CACHE_KEY_LEN 32
+
+
+struct CacheRequest_St {
+    char *const *arguments;
+    char *const *inputs;
+    size_t inputs_count;
+    char *const *variables;
+    size_t variables_count;
+    char const *infile;
+    char by_mtime;
+};
+
+typedef struct CacheRequest_St CacheRequest;
+
+struct CacheKey_St {
+    char name[CACHE_KEY_LEN + 1];
+};
+
+typedef struct CacheKey_St CacheKey;
+
+struct CacheEntry_St {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    int fd;
+    char *errors;
+    size_t errors_len;
+    size_t errors_capacity;
+    unsigned long long output_len;
+    stats_time_t started;
+};
+
+typedef struct CacheEntry_St CacheEntry;
+
+
+int cache_key(CacheRequest const *request, CacheKey *key);
+
+int cache_replay(CacheKey const *key, int *status);
+
+void cache_begin(CacheEntry *entry, CacheKey const *key);
+
+int cache_pump(CacheEntry *entry,
+               int output,
+               int errors,
+               pid_t pid,
+               char job_control);
+
+void cache_commit(CacheEntry *entry, int status);
+
+void cache_discard(CacheEntry *entry);
+
+void cache_print_stats(FILE *file);
+
+int cache_clear();
+
+
+#endif //CACHE_H
@@ -4,158 +4,200 @@
 
 
 #include "command.h"
+#include "pool.h"
 
-static char *string_copy(char const *str);
 
-static char *string_create(size_t len, size_t capacity);
+#define STAGE_SEPARATOR " | "
 
-static char *string_concat(char *dst,
-                           char const *src,
-                           size_t *dst_capacity,
-                           size_t *dst_len);
 
-static char *command_copy_arguments(Command const *command,
-                                    size_t offset,
-                                    char *dst,
-                                    size_t *dst_capacity,
-                                    size_t *dst_len);
+static Pool command_pool = POOL_INITIALIZER(Command);
 
-static Command *command_base_copy(Command const *command);
 
-Command *command_copy_for_job(Command const *command) {
-    Command *new_command = command_base_copy(command);
-    new_command->arguments[0] = string_copy(command->arguments[0]);
+static size_t print_words(char *const *arguments, FILE *file);
 
-    size_t arguments_len = 0;
-    size_t arguments_capacity = 10;
-    char *arguments = string_create(arguments_len, arguments_capacity);
-    arguments = command_copy_arguments(command, 1, arguments,
-                                       &arguments_capacity,
-                                       &arguments_len);
 
-    new_command->arguments[1] = arguments;
-    new_command->arguments[2] = NULL;
+/*
+ * A job keeps only the settings of its conveyor: the flags of the last
+ * stage and the limits, scheduling and timeout of all stages. Its words are
+ * kept separately by command_copy_arguments.
+ */
+Command *command_copy_for_job(Command const *commands, size_t count) {
+    Command const *last_command = &commands[count - 1];
+    Command *new_command = pool_alloc(&command_pool);
+    memset(new_command, 0, sizeof(Command));
+
+    new_command->flag = last_command->flag;
+    new_command->appfile = last_command->appfile;
+    new_command->limits = last_command->limits;
+    new_command->scheduling = last_command->scheduling;
+    new_command->timeout = *command_timeout(commands, count);
+
+    size_t command_index;
+    for (command_index = 0; command_index + 1 < count; ++command_index) {
+        resource_limits_merge(&new_command->limits,
+                              &commands[command_index].limits);
+        scheduling_merge(&new_command->scheduling,
+                         &commands[command_index].scheduling);
+    }
 
     return new_command;
 }
 
 void command_free(Command *command) {
-    if (!command) {
-        return;
-    }
-
     free(command->infile);
     free(command->outfile);
-
-    int index;
-    for (index = 0; command->arguments[index]; ++index) {
-        free(command->arguments[index]);
-    }
-
-    free(command);
+    pool_free(&command_pool, command);
 }
 
 char *command_get_name(const Command *command) {
     return command->arguments[0] ? command->arguments[0] : "";
 }
 
-char *command_get_args(const Command *command) {
-    return command->arguments[1] ? command->arguments[1] : "";
-}
+/*
+ * Copies the words of all stages into one block: the argument vectors of
+ * the stages, each terminated by NULL, followed by the strings. Lengths are
+ * known before copying, so every word is copied once.
+ */
+char **command_copy_arguments(Command const *commands, size_t count) {
+    size_t number_of_words = 0;
+    size_t text_len = 0;
+    size_t command_index;
+    for (command_index = 0; command_index < count; ++command_index) {
+        char *const *arguments = commands[command_index].arguments;
+        size_t index;
+        for (index = 0; arguments[index]; ++index) {
+            text_len += strlen(arguments[index]) + 1;
+        }
 
-Command *command_concat(const Command *commands, size_t count) {
-    if (count == 0) {
-        return NULL;
+        number_of_words += index + 1;
     }
 
-    size_t last_index = count - 1;
-    Command *new_command = command_base_copy(&commands[last_index]);
+    size_t vector_size = number_of_words * sizeof(char *);
+    char **block = malloc(vector_size + text_len);
+    check_memory(block);
 
-    size_t command_name_len = 0;
-    size_t command_name_capacity = 10;
-    char *command_name = string_create(command_name_len, command_name_capacity);
-
-    size_t command_index;
+    char **vector = block;
+    char *text = (char *) block + vector_size;
     for (command_index = 0; command_index < count; ++command_index) {
-        Command const *current_command = &commands[command_index];
-        command_name = command_copy_arguments(current_command, 0, command_name,
-                                              &command_name_capacity,
-                                              &command_name_len);
-
-        if (command_index != last_index) {
-            command_name = string_concat(command_name, " | ",
-                                         &command_name_capacity,
-                                         &command_name_len);
+        char *const *arguments = commands[command_index].arguments;
+        size_t index;
+        for (index = 0; arguments[index]; ++index) {
+            *vector++ = text;
+            text = stpcpy(text, arguments[index]) + 1;
         }
+
+        *vector++ = NULL;
     }
 
-    new_command->arguments[0] = command_name;
-    new_command->arguments[1] = NULL;
+    return block;
+}
 
-    return new_command;
+void command_print_arguments(char *const *arguments,
+                             size_t stages,
+                             FILE *file) {
+    size_t stage;
+    for (stage = 0; stage < stages; ++stage) {
+        if (stage) {
+            fputs(STAGE_SEPARATOR, file);
+        }
+
+        arguments += print_words(arguments, file) + 1;
+    }
+}
+
+void command_print(Command const *commands, size_t count, FILE *file) {
+    size_t command_index;
+    for (command_index = 0; command_index < count; ++command_index) {
+        if (command_index) {
+            fputs(STAGE_SEPARATOR, file);
+        }
+
+        print_words(commands[command_index].arguments, file);
+    }
 }
 
-static char *string_copy(char const *str) {
-    if (!str) {
-        return NULL;
+/*
+ * The timeout of the last stage wins, otherwise the first one set earlier.
+ */
+Timeout const *command_timeout(Command const *commands, size_t count) {
+    Timeout const *timeout = &commands[count - 1].timeout;
+    size_t command_index;
+    for (command_index = 0;
+         !timeout->duration && command_index + 1 < count;
+         ++command_index) {
+        timeout = &commands[command_index].timeout;
     }
 
-    return strdup(str);
+    return timeout;
 }
 
-static char *string_create(size_t len, size_t capacity) {
-    char *new_string = malloc(capacity * sizeof(char));
-    check_memory(new_string);
-    new_string[len] = END;
+/*
+ * The options of the stage started under merge, if any.
+ */
+MergeOptions const *command_merge(Command const *commands, size_t count) {
+    size_t command_index;
+    for (command_index = 0; command_index < count; ++command_index) {
+        if (commands[command_index].merge.capture) {
+            return &commands[command_index].merge;
+        }
+    }
 
-    return new_string;
+    return NULL;
 }
 
-static char *string_concat(char *dst,
-                           char const *src,
-                           size_t *dst_capacity,
-                           size_t *dst_len) {
-    size_t src_len = strlen(src);
-    size_t result_len = *dst_len + src_len + 1;
-    if (result_len >= *dst_capacity) {
-        *dst_capacity = *dst_capacity * 2 > result_len
-                        ? *dst_capacity * 2
-                        : result_len;
-        dst = realloc(dst, *dst_capacity * sizeof(char));
+void command_shift_arguments(Command *command, size_t count) {
+    size_t index = 0;
+    while (command->arguments[index + count]) {
+        command->arguments[index] = command->arguments[index + count];
+        ++index;
     }
 
-    dst = strcat(dst, src);
-    *dst_len += src_len;
+    command->arguments[index] = NULL;
+}
 
-    return dst;
+void command_line_init(CommandLine *command_line) {
+    memset(command_line, 0, sizeof(CommandLine));
 }
 
-static char *command_copy_arguments(Command const *command,
-                                    size_t offset,
-                                    char *dst,
-                                    size_t *dst_capacity,
-                                    size_t *dst_len) {
-    size_t argument_index = offset;
-    while (command->arguments[argument_index] != NULL) {
-        char *current_argument = command->arguments[argument_index];
-        if (argument_index != offset) {
-            dst = string_concat(dst, " ", dst_capacity, dst_len);
-        }
+/*
+ * Frees the strings produced while the previous line was expanded.
+ */
+void command_line_release(CommandLine *command_line) {
+    size_t index;
+    for (index = 0; index < command_line->allocated_count; ++index) {
+        free(command_line->allocated[index]);
+    }
 
-        dst = string_concat(dst, current_argument, dst_capacity, dst_len);
-        ++argument_index;
+    free(command_line->allocated);
+    command_line->allocated = NULL;
+    command_line->allocated_count = 0;
+    command_line->allocated_capacity = 0;
+}
+
+char *command_line_keep(CommandLine *command_line, char *str) {
+    if (command_line->allocated_count == command_line->allocated_capacity) {
+        command_line->allocated_capacity = command_line->allocated_capacity
+                                           ? command_line->allocated_capacity * 2
+                                           : MAX_ARGS;
+        command_line->allocated = realloc(command_line->allocated,
+                                          command_line->allocated_capacity
+                                          * sizeof(char *));
+        check_memory(command_line->allocated);
     }
 
-    return dst;
+    command_line->allocated[command_line->allocated_count++] = str;
+    return str;
 }
 
-static Command *command_base_copy(Command const *command) {
-    Command *new_command = malloc(sizeof(Command));
-    check_memory(new_command);
+static size_t print_words(char *const *arguments, FILE *file) {
+    size_t index;
+    for (index = 0; arguments[index]; ++index) {
+        if (index) {
+            fputc(' ', file);
+        }
+
+        fputs(arguments[index], file);
+    }
 
-    new_command->flag = command->flag;
-    new_command->appfile = command->appfile;
-    new_command->outfile = string_copy(command->outfile);
-    new_command->infile = string_copy(command->infile);
-    return new_command;
+    return index;
 }
@@ -8,6 +8,10 @@
 
 
 #include "shell.h"
+#include "resource_limit.h"
+#include "scheduling.h"
+#include "timeout.h"
+#include "merge.h"
 
 
 #define MAX_ARGS 256
@@ -21,6 +25,17 @@
 #define IN_FILE 8
 #define OUT_FILE 16
 
+#define CONNECT_NONE 0
+#define CONNECT_AND 1
+#define CONNECT_OR 2
+
+#define GROUP_NONE 0
+#define GROUP_BRACE 1
+#define GROUP_SUBSHELL 2
+#define GROUP_FANOUT 3
+
+#define REDIRECT_DUPLICATE '&'
+
 
 struct Command_St {
     char *arguments[MAX_ARGS];
@@ -28,6 +43,12 @@ struct Command_St {
     char *infile;
     char *outfile;
     char appfile;
+    char connector;
+    char group;
+    ResourceLimits limits;
+    Scheduling scheduling;
+    Timeout timeout;
+    MergeOptions merge;
 };
 
 typedef struct Command_St Command;
@@ -39,20 +60,40 @@ struct CommandLine_St {
     size_t current_index_of_command;
     size_t last_command_in_pipeline;
     pid_t main_process;
+    pid_t pids[MAX_COMMANDS];
+    int previous_status;
+    char tail_exec;
+    char **allocated;
+    size_t allocated_count;
+    size_t allocated_capacity;
 };
 
 typedef struct CommandLine_St CommandLine;
 
 
-Command *command_copy_for_job(const Command *command);
+Command *command_copy_for_job(Command const *commands, size_t count);
 
 void command_free(Command *command);
 
-char *command_get_args(const Command *command);
-
 char *command_get_name(const Command *command);
 
-Command *command_concat(const Command *commands, size_t count);
+char **command_copy_arguments(Command const *commands, size_t count);
+
+void command_print_arguments(char *const *arguments, size_t stages, FILE *file);
+
+void command_print(Command const *commands, size_t count, FILE *file);
+
+Timeout const *command_timeout(Command const *commands, size_t count);
+
+MergeOptions const *command_merge(Command const *commands, size_t count);
+
+void command_shift_arguments(Command *command, size_t count);
+
+void command_line_init(CommandLine *command_line);
+
+void command_line_release(CommandLine *command_line);
+
+char *command_line_keep(CommandLine *command_line, char *str);
 
 
 #endif //COMMAND_H
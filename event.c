@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "event.h"
+#include "merge.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+
+
+#define CHILD_EVENTS 16
+
+
+/*
+ * SIGCHLD stays blocked in the shell and is read from a signalfd, so waiting
+ * for a child can be combined with other descriptors in one poll.
+ */
+static int child_fd = BAD_RESULT;
+static sigset_t child_mask;
+
+static char interrupted = FALSE;
+
+/*
+ * What SIGINT did before event_catch_interrupt took it over: ignored in an
+ * interactive shell, the default action in a script or "-c".
+ */
+static void (*saved_interrupt)(int) = SIG_IGN;
+static char interrupt_blocked = FALSE;
+static char catching = FALSE;
+
+
+static void event_read(int fd);
+
+
+int event_init() {
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+
+    int exit_code = sigprocmask(SIG_BLOCK, &child_mask, NULL);
+    if (exit_code == BAD_RESULT) {
+        perror("Couldn't block SIGCHLD");
+        return BAD_RESULT;
+    }
+
+    if (child_fd != BAD_RESULT) {
+        close(child_fd);
+    }
+
+    child_fd = signalfd(BAD_RESULT, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (child_fd == BAD_RESULT) {
+        perror("Couldn't create signalfd");
+        return BAD_RESULT;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int event_child_fd() {
+    return child_fd;
+}
+
+void event_child_drain() {
+    event_read(child_fd);
+}
+
+void event_reset_signals() {
+    sigset_t mask = child_mask;
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+/*
+ * Blocks until some child changes its state, fd becomes readable or, while
+ * interrupts are caught, SIGINT arrives. Returns a mask of EVENT_* flags.
+ * Output of captured jobs is merged meanwhile and wakes the wait up with no
+ * flags.
+ */
+int event_wait(int fd) {
+    return event_wait_for(fd, BAD_RESULT);
+}
+
+/*
+ * Like event_wait, but gives up after timeout milliseconds and returns 0;
+ * a negative timeout waits forever.
+ */
+int event_wait_for(int fd, int timeout) {
+    struct pollfd fds[3];
+    fds[0].fd = child_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = merge_fd();
+    fds[2].events = POLLIN;
+
+    int exit_code = poll(fds, 3, timeout);
+    if (exit_code == BAD_RESULT) {
+        if (errno != EINTR) {
+            perror("Couldn't wait for events");
+        }
+
+        return 0;
+    }
+
+    int events = 0;
+    if (fds[0].revents & POLLIN) {
+        event_read(child_fd);
+        events |= EVENT_CHILD;
+    }
+
+    if (interrupted) {
+        interrupted = FALSE;
+        events |= EVENT_INTERRUPT;
+    }
+
+    if (fd != BAD_RESULT && (fds[1].revents & POLLIN)) {
+        events |= EVENT_FD;
+    }
+
+    if (fds[2].revents & POLLIN) {
+        merge_drain();
+    }
+
+    return events;
+}
+
+/*
+ * Blocking builtins turn SIGINT into an event: while blocked with the
+ * default action the signal stays pending and is read from the signalfd,
+ * so it never terminates the shell. Disabling puts back the action and the
+ * mask SIGINT had before.
+ */
+void event_catch_interrupt(char enable) {
+    sigset_t mask = child_mask;
+    sigaddset(&mask, SIGINT);
+
+    if (enable) {
+        if (catching) {
+            return;
+        }
+
+        sigset_t previous;
+        sigprocmask(SIG_BLOCK, &mask, &previous);
+        interrupt_blocked = sigismember(&previous, SIGINT) == TRUE;
+
+        saved_interrupt = signal(SIGINT, SIG_DFL);
+
+        signalfd(child_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        interrupted = FALSE;
+        catching = TRUE;
+        return;
+    }
+
+    if (!catching) {
+        return;
+    }
+
+    signalfd(child_fd, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    signal(SIGINT, saved_interrupt);
+
+    if (!interrupt_blocked) {
+        sigset_t interrupt;
+        sigemptyset(&interrupt);
+        sigaddset(&interrupt, SIGINT);
+        sigprocmask(SIG_UNBLOCK, &interrupt, NULL);
+    }
+
+    interrupted = FALSE;
+    catching = FALSE;
+}
+
+/*
+ * A SIGINT blocked by event_catch_interrupt stays pending until the catching
+ * ends, so long work without events can look for it.
+ */
+int event_interrupt_pending() {
+    sigset_t pending;
+    return sigpending(&pending) == EXIT_SUCCESS
+           && sigismember(&pending, SIGINT) == TRUE;
+}
+
+static void event_read(int fd) {
+    struct signalfd_siginfo info[CHILD_EVENTS];
+    ssize_t number_of_read;
+    while ((number_of_read = read(fd, info, sizeof(info))) > 0) {
+        size_t index;
+        for (index = 0; index < number_of_read / sizeof(info[0]); ++index) {
+            if (info[index].ssi_signo == SIGINT) {
+                interrupted = TRUE;
+            }
+        }
+    }
+}
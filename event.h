@@ -0,0 +1,35 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef EVENT_H
+#define EVENT_H
+
+
+#include "shell.h"
+
+
+#define EVENT_CHILD 1
+#define EVENT_FD 2
+#define EVENT_INTERRUPT 4
+
+
+int event_init();
+
+int event_child_fd();
+
+void event_child_drain();
+
+void event_reset_signals();
+
+int event_wait(int fd);
+
+int event_wait_for(int fd, int timeout);
+
+void event_catch_interrupt(char enable);
+
+int event_interrupt_pending();
+
+
+#endif //EVENT_H
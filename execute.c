@@ -6,27 +6,101 @@
 #include "execute.h"
 #include "builtin.h"
 #include "terminal.h"
-
+#include "stats.h"
+#include "event.h"
+#include "expand.h"
+#include "parse_line.h"
+#include "stream.h"
+#include "shard.h"
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <wait.h>
 #include <signal.h>
+#include <sys/mman.h>
 
 
 #define CHECK_ON_ERROR(expected, actual, message) if ((expected) == (actual)) { perror(message); return CRASH; }
 
+#define SAVED_FD_MIN 10
+
+
+/*
+ * The gate of the background job being started, when it has to wait in the
+ * queue: its processes block on gate[0] before exec, see job_release.
+ */
+static int gate[2] = {BAD_RESULT, BAD_RESULT};
+
+/*
+ * The pipe of the background job being started under merge: its processes
+ * write their output and errors to capture[1], the shell reads capture[0].
+ */
+static int capture[2] = {BAD_RESULT, BAD_RESULT};
+
+/*
+ * The shell's ends of the coprocess pipes. They are closed on exec; a
+ * forked process that runs shell code instead closes them itself, so it
+ * can't keep a coprocess from seeing the end of its input.
+ */
+static int coprocess_fds[JOB_LIMIT * 2];
+static size_t coprocess_fds_count = 0;
+
 
 static int execute_parent(JobController *controller,
                           pid_t descendant_pid,
                           Command *command);
 
-static int execute_descendant(CommandLine *command_line, Command *command);
+static int execute_descendant(JobController *controller,
+                              CommandLine *command_line,
+                              Command *command);
+
+static int execute_group(JobController *controller,
+                         CommandLine *command_line,
+                         Command const *command);
+
+static int execute_brace_group(JobController *controller,
+                               CommandLine *command_line,
+                               Command *command);
+
+static int execute_subshell(CommandLine *command_line, Command const *command);
+
+static int execute_fanout(CommandLine *command_line, Command const *command);
+
+static void group_body(Command const *command, char *body);
+
+static void execute_exit(int status);
+
+static int is_tail_command(JobController *controller,
+                           CommandLine *command_line,
+                           size_t index,
+                           size_t number_of_commands);
+
+static int is_stream_command(JobController *controller,
+                             Command const *command,
+                             Stream *stream);
+
+static int execute_stream(JobController *controller,
+                          CommandLine *command_line,
+                          Command *command,
+                          Stream const *stream);
+
+static int execute_conveyor_stream(JobController *controller,
+                                   CommandLine *command_line,
+                                   Stream const *stream);
+
+static int save_descriptors(int *saved);
+
+static int restore_descriptors(int const *saved);
 
 static int execute_conveyor(JobController *controller,
                             CommandLine *command_line);
 
-static void prepare_conveyor(CommandLine *command_line);
+static int prepare_conveyor(JobController *controller,
+                            CommandLine *command_line);
 
-static int processing_conveyor_command(CommandLine *command_line,
+static int processing_conveyor_command(JobController *controller,
+                                       CommandLine *command_line,
                                        size_t current_index);
 
 static int execute_conveyor_parent(JobController *controller,
@@ -34,27 +108,99 @@ static int execute_conveyor_parent(JobController *controller,
 
 static void execute_conveyor_wait(JobController *controller,
                                   CommandLine *command_line,
-                                  Command *command);
+                                  Command const *commands);
 
 static void processing_conveyor_parent(CommandLine *command_line,
                                        Command *command);
 
+static int execute_wait(JobController *controller,
+                        Command const *commands,
+                        pid_t const *pids,
+                        size_t count);
+
+static int execute_timeout_expired(JobController *controller,
+                                   Timeout const *timeout,
+                                   pid_t const *pids,
+                                   size_t count,
+                                   int timer,
+                                   char *killed);
+
+static void execute_signal(JobController *controller,
+                           pid_t const *pids,
+                           size_t count,
+                           int signal);
+
+static int execute_deferred_job(JobController *controller, Job *job);
+
+static int execute_cache_miss(JobController *controller,
+                              Command *command,
+                              CacheKey const *key);
+
+static int execute_gate_open(JobController *controller,
+                             Command const *command);
+
+static int execute_gate_wait(JobController const *controller);
+
+static void coprocess_close_all();
+
+static jid_t execute_add_background(JobController *controller,
+                                    pid_t const *pids,
+                                    Command const *commands,
+                                    size_t count);
+
+static void execute_gate_attach(Job *job);
+
+static int execute_capture_open(Command const *commands, size_t count);
+
+static void execute_capture_attach(jid_t jid,
+                                   Command const *commands,
+                                   size_t count);
+
+static int set_capture();
+
+static int is_substitution_in_process(CommandLine const *line,
+                                      ssize_t number_of_commands);
+
+static char *substitution_in_process(JobController *controller,
+                                     CommandLine *line,
+                                     ssize_t number_of_commands,
+                                     size_t *len,
+                                     char *interrupted);
+
+static char *substitution_fork(JobController *controller,
+                               CommandLine *line,
+                               ssize_t number_of_commands,
+                               size_t *len,
+                               char *interrupted);
+
+static int substitution_child(CommandLine *line, ssize_t number_of_commands);
+
+static char *substitution_read(int fd, size_t *len);
+
 static int set_infile(char *infile);
 
 static int set_outfile(char *outfile, char addfile);
 
+static int set_duplicate(char const *target, int fd2);
+
 static int use_dup2(int fd, int fd2, char *error);
 
 static int set_redirects(CommandLine *command_line, Command *command);
 
 static void command_set_background_signal(const Command *command);
 
-static int set_input_terminal();
+static int set_input_terminal(JobController *controller);
 
 static int exec_command(JobController *controller,
                         CommandLine *command_line,
                         Command *command);
 
+static int is_skipped(JobController *controller,
+                      CommandLine *command_line,
+                      size_t index);
+
+static size_t conveyor_end(CommandLine *command_line, size_t index);
+
 
 int execute_command_line(JobController *controller,
                          CommandLine *command_line,
@@ -70,7 +216,46 @@ int execute_command_line(JobController *controller,
         Command *current_command = &command_line->commands[index_of_command];
         command_line->current_index_of_command = index_of_command;
 
+        char in_pipe = (char) (current_command->flag & IN_PIPE);
+        if (!in_pipe) {
+            if (is_skipped(controller, command_line, index_of_command)) {
+                index_of_command = conveyor_end(command_line,
+                                                index_of_command);
+                continue;
+            }
+
+            size_t last_index = conveyor_end(command_line, index_of_command);
+            int expanded = EXIT_SUCCESS;
+            size_t index;
+            for (index = index_of_command;
+                 expanded == EXIT_SUCCESS && index <= last_index; ++index) {
+                expanded = expand_command(controller, command_line,
+                                          &command_line->commands[index]);
+            }
+
+            if (expanded != EXIT_SUCCESS) {
+                if (expanded == BAD_RESULT
+                    || (expanded == EXPAND_EMPTY
+                        && last_index > index_of_command)) {
+                    controller->last_status = EXIT_FAILURE;
+                }
+
+                index_of_command = last_index;
+                continue;
+            }
+
+            command_line->previous_status = controller->last_status;
+            controller->last_status = STATUS_UNSET;
+        }
+
         int exit_code = builtin_exec(controller, current_command);
+        if (!in_pipe && exit_code != CONTINUE
+            && controller->last_status == STATUS_UNSET) {
+            controller->last_status = exit_code == STOP || exit_code == EXIT
+                                      ? EXIT_SUCCESS
+                                      : EXIT_FAILURE;
+        }
+
         switch (exit_code) {
             case EXIT:
                 return exit_code;
@@ -81,52 +266,876 @@ int execute_command_line(JobController *controller,
                 continue;
         }
 
-        if (current_command->flag & IN_PIPE) {
+        if (in_pipe) {
+            continue;
+        }
+
+        if (is_tail_command(controller, command_line, index_of_command,
+                            (size_t) number_of_commands)) {
+            fflush(stdout);
+            return execute_descendant(controller, command_line,
+                                      current_command);
+        }
+
+        exit_code = exec_command(controller, command_line, current_command);
+        if (controller->last_status == STATUS_UNSET) {
+            controller->last_status = EXIT_FAILURE;
+        }
+
+        switch (exit_code) {
+            case EXIT:
+            case CRASH:
+                return exit_code;
+            default:
+                break;
+        }
+    }
+
+    return CONTINUE;
+}
+
+/*
+ * A conveyor after "&&" runs only if the previous one succeeded, after "||"
+ * only if it failed. Skipped conveyors keep the last status.
+ */
+static int is_skipped(JobController *controller,
+                      CommandLine *command_line,
+                      size_t index) {
+    if (index == 0) {
+        return FALSE;
+    }
+
+    switch (command_line->commands[index - 1].connector) {
+        case CONNECT_AND:
+            return controller->last_status != EXIT_SUCCESS;
+        case CONNECT_OR:
+            return controller->last_status == EXIT_SUCCESS;
+        default:
+            return FALSE;
+    }
+}
+
+static size_t conveyor_end(CommandLine *command_line, size_t index) {
+    while (command_line->commands[index].flag & OUT_PIPE) {
+        ++index;
+    }
+
+    return index;
+}
+
+/*
+ * Replaces the shell with the command. Without a command only the redirects
+ * are applied, to the shell's own descriptors. If exec fails, the shell's
+ * descriptors and signal state are restored.
+ */
+int execute_replace(JobController *controller, Command *command) {
+    if (command->flag & (IN_PIPE | OUT_PIPE | BACKGROUND)) {
+        fprintf(stderr, "shell: exec: cannot replace the shell from a job\n");
+        return CRASH;
+    }
+
+    if (!command->arguments[0]) {
+        return set_redirects(NULL, command) == CRASH ? CRASH : STOP;
+    }
+
+    int saved[2];
+    int exit_code = save_descriptors(saved);
+    if (exit_code == CRASH) {
+        return exit_code;
+    }
+
+    sigset_t mask;
+    struct sigaction interrupt;
+    struct sigaction stop;
+    sigprocmask(SIG_SETMASK, NULL, &mask);
+    sigaction(SIGINT, NULL, &interrupt);
+    sigaction(SIGTSTP, NULL, &stop);
+
+    exit_code = set_redirects(NULL, command);
+    if (exit_code != CRASH) {
+        command_set_background_signal(command);
+        stats_count(STATS_EXEC);
+        execvp(command->arguments[0], command->arguments);
+
+        stats_count(STATS_EXEC_FAILED);
+        fprintf(stderr, "shell: exec: %s: %s\n", command->arguments[0],
+                strerror(errno));
+        controller->last_status = errno == ENOENT
+                                  ? EXEC_NOT_FOUND_STATUS
+                                  : EXEC_FAILED_STATUS;
+    }
+
+    sigaction(SIGINT, &interrupt, NULL);
+    sigaction(SIGTSTP, &stop, NULL);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    restore_descriptors(saved);
+    return controller->job_control ? CRASH : EXIT;
+}
+
+/*
+ * Starts the command as a background job reading from one pipe and writing
+ * to another. The shell keeps the other ends, closed on exec: fds[COPROC_WRITE]
+ * feeds the command's input and fds[COPROC_READ] carries its output.
+ */
+pid_t execute_coprocess(JobController *controller, Command *command, int *fds) {
+    if (command->flag & (IN_PIPE | OUT_PIPE)) {
+        fprintf(stderr, "shell: coproc: cannot be part of a conveyor\n");
+        return BAD_PID;
+    }
+
+    if (job_controller_is_full(controller)) {
+        return BAD_PID;
+    }
+
+    int input[2];
+    int output[2];
+    if (pipe2(input, O_CLOEXEC) == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        return BAD_PID;
+    }
+
+    if (pipe2(output, O_CLOEXEC) == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        close(input[0]);
+        close(input[1]);
+        return BAD_PID;
+    }
+
+    stats_count(STATS_PIPE);
+    stats_count(STATS_PIPE);
+
+    command->flag |= BACKGROUND;
+    fflush(stdout);
+    stats_count(STATS_FORK);
+    pid_t pid = fork();
+    if (pid == DESCENDANT_PID) {
+        if (use_dup2(input[0], STDIN_FILENO, "Couldn't redirect input") == CONTINUE
+            && use_dup2(output[1], STDOUT_FILENO,
+                        "Couldn't redirect output") == CONTINUE) {
+            execute_descendant(controller, NULL, command);
+        }
+
+        _exit(EXIT_FAILURE);
+    }
+
+    close(input[0]);
+    close(output[1]);
+    if (pid == BAD_PID) {
+        perror("Couldn't create process");
+        close(input[1]);
+        close(output[0]);
+        return BAD_PID;
+    }
+
+    if (controller->job_control) {
+        setpgid(pid, pid);
+    }
+
+    job_controller_add_job(controller, pid, command, JOB_RUNNING);
+    fds[COPROC_READ] = output[0];
+    fds[COPROC_WRITE] = input[1];
+    if (coprocess_fds_count + 2 <= sizeof(coprocess_fds) / sizeof(int)) {
+        coprocess_fds[coprocess_fds_count++] = output[0];
+        coprocess_fds[coprocess_fds_count++] = input[1];
+    }
+
+    return pid;
+}
+
+void execute_coprocess_close(int fd) {
+    size_t index;
+    for (index = 0; index < coprocess_fds_count; ++index) {
+        if (coprocess_fds[index] == fd) {
+            coprocess_fds[index] = coprocess_fds[--coprocess_fds_count];
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+static void coprocess_close_all() {
+    size_t index;
+    for (index = 0; index < coprocess_fds_count; ++index) {
+        close(coprocess_fds[index]);
+    }
+
+    coprocess_fds_count = 0;
+}
+
+/*
+ * Starts the deferred jobs whose dependencies have finished, or skips them
+ * when their condition does not hold. A skipped job finishes at once, so the
+ * table is scanned again for the jobs waiting for it. Then queued jobs take
+ * the slots freed by finished ones.
+ */
+void execute_deferred(JobController *controller) {
+    if (!job_controller_has_pending(controller)) {
+        return;
+    }
+
+    job_controller_update(controller);
+
+    char changed = TRUE;
+    while (changed) {
+        changed = FALSE;
+        size_t index;
+        for (index = 0; index < controller->number_of_jobs; ++index) {
+            Job *job = controller->jobs[index];
+            if (!(job->status & JOB_DEFERRED)) {
+                continue;
+            }
+
+            int state = job_controller_dependencies(controller, job);
+            if (state == DEPENDENCIES_PENDING) {
+                continue;
+            }
+
+            if ((job->condition == AFTER_SUCCESS
+                 && state != DEPENDENCIES_SUCCEEDED)
+                || (job->condition == AFTER_FAILURE
+                    && state != DEPENDENCIES_FAILED)) {
+                job->status = JOB_SKIPPED;
+                job->exit_status = W_EXITCODE(EXIT_FAILURE, 0);
+                job->notify = TRUE;
+                changed = TRUE;
+                continue;
+            }
+
+            if (execute_deferred_job(controller, job) == BAD_RESULT) {
+                changed = TRUE;
+            }
+        }
+    }
+
+    job_controller_schedule(controller);
+}
+
+/*
+ * Forks the stored command as a background job under the deferred job's
+ * number, queued if there is no free slot. If the fork fails the job fails.
+ */
+static int execute_deferred_job(JobController *controller, Job *job) {
+    Command *command = job->command;
+    command->flag |= BACKGROUND;
+
+    pid_t pid = BAD_PID;
+    if (execute_gate_open(controller, command) == CONTINUE) {
+        fflush(stdout);
+        stats_count(STATS_FORK);
+        pid = fork();
+        if (pid == DESCENDANT_PID) {
+            execute_descendant(controller, NULL, command);
+        }
+
+        if (pid == BAD_PID) {
+            perror("Couldn't create process");
+        }
+    }
+
+    if (pid == BAD_PID) {
+        execute_gate_attach(NULL);
+        job->status = JOB_FAILED;
+        job->exit_status = W_EXITCODE(EXEC_FAILED_STATUS, 0);
+        job->notify = TRUE;
+        return BAD_RESULT;
+    }
+
+    if (controller->job_control) {
+        setpgid(pid, pid);
+    }
+
+    job_start(job, pid);
+    execute_gate_attach(job);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A background job that can't start because of the limit on running jobs
+ * gets a gate before it is forked.
+ */
+static int execute_gate_open(JobController *controller,
+                             Command const *command) {
+    if (!(command->flag & BACKGROUND) || job_controller_admits(controller)) {
+        return CONTINUE;
+    }
+
+    int exit_code = pipe2(gate, O_CLOEXEC);
+    if (exit_code == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        gate[0] = gate[1] = BAD_RESULT;
+        return CRASH;
+    }
+
+    stats_count(STATS_PIPE);
+    return CONTINUE;
+}
+
+/*
+ * Blocks a process of a queued job until the shell releases it. If the
+ * shell goes away first, the process exits without running the command;
+ * for that no waiting process may hold the shell's end of any gate.
+ */
+static int execute_gate_wait(JobController const *controller) {
+    close(gate[1]);
+
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        if (controller->jobs[index]->gate != BAD_RESULT) {
+            close(controller->jobs[index]->gate);
+        }
+    }
+
+    char token;
+    ssize_t number_of_read;
+    do {
+        number_of_read = read(gate[0], &token, 1);
+    } while (number_of_read == BAD_RESULT && errno == EINTR);
+
+    close(gate[0]);
+    gate[0] = gate[1] = BAD_RESULT;
+    if (number_of_read != 1) {
+        _exit(EXIT_FAILURE);
+    }
+
+    return CONTINUE;
+}
+
+/*
+ * Adds a started background job, queued if it has a gate.
+ */
+static jid_t execute_add_background(JobController *controller,
+                                    pid_t const *pids,
+                                    Command const *commands,
+                                    size_t count) {
+    jid_t jid = job_controller_add_conveyor(controller, pids, commands,
+                                            JOB_RUNNING, count);
+    size_t index = job_controller_search_job_by_jid(controller, jid);
+    execute_gate_attach(index < controller->number_of_jobs
+                        ? controller->jobs[index]
+                        : NULL);
+    execute_capture_attach(jid, commands, count);
+    return jid;
+}
+
+/*
+ * The job keeps the shell's end of the gate. Without a job the gate is
+ * closed and the processes exit.
+ */
+static void execute_gate_attach(Job *job) {
+    if (gate[1] == BAD_RESULT) {
+        return;
+    }
+
+    close(gate[0]);
+    if (job) {
+        job->gate = gate[1];
+        job->status = JOB_QUEUED;
+    } else {
+        close(gate[1]);
+    }
+
+    gate[0] = gate[1] = BAD_RESULT;
+}
+
+/*
+ * A background job started under merge gets a pipe for its output before
+ * it is forked.
+ */
+static int execute_capture_open(Command const *commands, size_t count) {
+    if (!command_merge(commands, count)) {
+        return CONTINUE;
+    }
+
+    if (!(commands[count - 1].flag & BACKGROUND)) {
+        fprintf(stderr, "shell: merge: foreground jobs are not supported\n");
+        return STOP;
+    }
+
+    int exit_code = pipe2(capture, O_CLOEXEC);
+    if (exit_code == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        capture[0] = capture[1] = BAD_RESULT;
+        return CRASH;
+    }
+
+    stats_count(STATS_PIPE);
+    return CONTINUE;
+}
+
+/*
+ * Hands the shell's end of the capture pipe to the merge. Without a job the
+ * pipe is closed and the processes get SIGPIPE.
+ */
+static void execute_capture_attach(jid_t jid,
+                                   Command const *commands,
+                                   size_t count) {
+    if (capture[0] == BAD_RESULT) {
+        return;
+    }
+
+    close(capture[1]);
+    if (jid == BAD_RESULT) {
+        close(capture[0]);
+    } else {
+        merge_attach(jid, capture[0], command_merge(commands, count));
+    }
+
+    capture[0] = capture[1] = BAD_RESULT;
+}
+
+/*
+ * Runs the text of a command substitution and returns what it wrote, or
+ * NULL if it wrote nothing. The status of the substitution becomes the last
+ * status; interrupted tells whether ^C ended it, which a status of 130 from
+ * the command itself does not.
+ */
+char *execute_substitution(JobController *controller,
+                           char *text,
+                           size_t *len,
+                           char *interrupted) {
+    CommandLine *line = malloc(sizeof(CommandLine));
+    check_memory(line);
+    command_line_init(line);
+
+    char *output = NULL;
+    *len = 0;
+    *interrupted = FALSE;
+    ssize_t number_of_commands = parse_input_line(text, line);
+    if (number_of_commands <= 0) {
+        controller->last_status = number_of_commands == BAD_SYNTAX
+                                  ? EXIT_USAGE_STATUS
+                                  : EXIT_SUCCESS;
+    } else if (is_substitution_in_process(line, number_of_commands)) {
+        output = substitution_in_process(controller, line, number_of_commands,
+                                         len, interrupted);
+    } else {
+        output = substitution_fork(controller, line, number_of_commands, len,
+                                   interrupted);
+    }
+
+    command_line_release(line);
+    free(line);
+    return output;
+}
+
+/*
+ * In-process utilities and jobs write to a memfd, so they run in the shell
+ * without a fork and without a limit on their output. Should one of them
+ * need a process after all, the process writes to the memfd just as well.
+ */
+static int is_substitution_in_process(CommandLine const *line,
+                                      ssize_t number_of_commands) {
+    Command const *command = &line->commands[0];
+    Stream stream;
+    return number_of_commands == 1
+           && command->group == GROUP_NONE
+           && !(command->flag & (BACKGROUND | OUT_FILE | OUT_PIPE))
+           && !strchr(command->arguments[0], EXPAND_PREFIX)
+           && (strcmp(command->arguments[0], "jobs") == 0
+               || stream_parse(command, &stream));
+}
+
+static char *substitution_in_process(JobController *controller,
+                                     CommandLine *line,
+                                     ssize_t number_of_commands,
+                                     size_t *len,
+                                     char *interrupted) {
+    int memfd = memfd_create(SUBSTITUTION_MEMFD, MFD_CLOEXEC);
+    if (memfd == BAD_RESULT) {
+        perror("Couldn't create memfd");
+        return NULL;
+    }
+
+    int saved[2];
+    if (save_descriptors(saved) == CRASH) {
+        close(memfd);
+        return NULL;
+    }
+
+    if (dup2(memfd, STDOUT_FILENO) == BAD_RESULT) {
+        perror("Couldn't redirect output");
+    } else {
+        controller->interrupted = FALSE;
+        execute_command_line(controller, line, number_of_commands);
+        *interrupted = controller->interrupted;
+        fflush(stdout);
+    }
+
+    char *output = NULL;
+    if (restore_descriptors(saved) != CRASH
+        && lseek(memfd, 0, SEEK_SET) != BAD_RESULT) {
+        output = substitution_read(memfd, len);
+    }
+
+    close(memfd);
+    return output;
+}
+
+/*
+ * Anything else runs in a forked subshell, like "( ... )", that writes to a
+ * pipe. A simple command replaces the subshell, so it takes one fork.
+ */
+static char *substitution_fork(JobController *controller,
+                               CommandLine *line,
+                               ssize_t number_of_commands,
+                               size_t *len,
+                               char *interrupted) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        return NULL;
+    }
+
+    stats_count(STATS_PIPE);
+    fflush(stdout);
+    stats_count(STATS_FORK);
+    pid_t pid = fork();
+    if (pid == DESCENDANT_PID) {
+        close(fds[0]);
+        if (dup2(fds[1], STDOUT_FILENO) == BAD_RESULT) {
+            perror("Couldn't redirect output");
+            execute_exit(EXIT_FAILURE);
+        }
+
+        close(fds[1]);
+        execute_exit(substitution_child(line, number_of_commands));
+    }
+
+    close(fds[1]);
+    if (pid == BAD_PID) {
+        perror("Couldn't create process");
+        close(fds[0]);
+        return NULL;
+    }
+
+    char *output = substitution_read(fds[0], len);
+    close(fds[0]);
+
+    int status = 0;
+    stats_count(STATS_WAITPID);
+    while (waitpid(pid, &status, 0) == BAD_RESULT && errno == EINTR) {
+    }
+
+    controller->last_status = job_status_code(status);
+    *interrupted = (char) (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT);
+    return output;
+}
+
+/*
+ * The subshell stays in the shell's process group, so it takes ^C itself
+ * instead of running the rest of the substitution.
+ */
+static int substitution_child(CommandLine *line, ssize_t number_of_commands) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    coprocess_close_all();
+    JobController *controller = job_controller_create();
+    controller->job_control = FALSE;
+    if (event_init() == BAD_RESULT) {
+        return EXIT_FAILURE;
+    }
+
+    line->tail_exec = TRUE;
+    int exit_code = execute_command_line(controller, line, number_of_commands);
+    return exit_code == CRASH ? EXIT_FAILURE : controller->last_status;
+}
+
+/*
+ * Reads the output whole, with reads as large as the free space of a buffer
+ * that doubles when it fills up.
+ */
+static char *substitution_read(int fd, size_t *len) {
+    size_t capacity = STREAM_CHUNK;
+    char *output = malloc(capacity);
+    check_memory(output);
+
+    *len = 0;
+    while (TRUE) {
+        if (*len == capacity) {
+            capacity *= 2;
+            output = realloc(output, capacity);
+            check_memory(output);
+        }
+
+        ssize_t number_of_read = read(fd, output + *len, capacity - *len);
+        if (number_of_read == BAD_RESULT && errno == EINTR) {
+            continue;
+        }
+
+        if (number_of_read <= 0) {
+            if (number_of_read == BAD_RESULT) {
+                perror("Couldn't read command output");
+            }
+
+            return output;
+        }
+
+        *len += (size_t) number_of_read;
+    }
+}
+
+/*
+ * Runs a command through the cache. The redirects are applied to the
+ * shell's own descriptors first, so a hit is replayed to the same place
+ * the command would have written to, without a fork.
+ */
+int execute_cached(JobController *controller,
+                   Command *command,
+                   CacheKey const *key) {
+    if (command->flag & (IN_PIPE | OUT_PIPE | BACKGROUND)
+        || command->group != GROUP_NONE) {
+        fprintf(stderr, "shell: cache: only a simple foreground command can be cached\n");
+        return CRASH;
+    }
+
+    if (command->timeout.duration) {
+        fprintf(stderr, "shell: cache: timeout is not supported\n");
+        return CRASH;
+    }
+
+    int saved[2];
+    int exit_code = save_descriptors(saved);
+    if (exit_code == CRASH) {
+        return exit_code;
+    }
+
+    exit_code = set_redirects(NULL, command);
+    if (exit_code == CRASH) {
+        controller->last_status = EXIT_FAILURE;
+    } else if (!cache_replay(key, &controller->last_status)) {
+        command->flag &= ~(IN_FILE | OUT_FILE);
+        exit_code = execute_cache_miss(controller, command, key);
+    }
+
+    if (restore_descriptors(saved) == CRASH) {
+        return CRASH;
+    }
+
+    return exit_code == CRASH ? CRASH : STOP;
+}
+
+/*
+ * The command writes to two pipes that the shell copies to its own output
+ * and errors and into a new entry.
+ */
+static int execute_cache_miss(JobController *controller,
+                              Command *command,
+                              CacheKey const *key) {
+    int output[2];
+    int errors[2];
+    if (pipe2(output, O_CLOEXEC) == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        return CRASH;
+    }
+
+    if (pipe2(errors, O_CLOEXEC) == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        close(output[0]);
+        close(output[1]);
+        return CRASH;
+    }
+
+    stats_count(STATS_PIPE);
+    stats_count(STATS_PIPE);
+
+    fflush(stdout);
+    fflush(stderr);
+    stats_count(STATS_FORK);
+    pid_t pid = fork();
+    if (pid == DESCENDANT_PID) {
+        if (use_dup2(output[1], STDOUT_FILENO,
+                     "Couldn't redirect output") == CONTINUE
+            && use_dup2(errors[1], STDERR_FILENO,
+                        "Couldn't redirect errors") == CONTINUE) {
+            execute_descendant(controller, NULL, command);
+        }
+
+        _exit(EXIT_FAILURE);
+    }
+
+    close(output[1]);
+    close(errors[1]);
+    if (pid == BAD_PID) {
+        perror("Couldn't create process");
+        close(output[0]);
+        close(errors[0]);
+        return CRASH;
+    }
+
+    if (controller->job_control) {
+        setpgid(pid, pid);
+    }
+
+    CacheEntry entry;
+    cache_begin(&entry, key);
+    cache_pump(&entry, output[0], errors[0], pid, controller->job_control);
+
+    int status = execute_wait(controller, command, &pid, 1);
+    controller->last_status = job_status_code(status);
+    if (controller->last_status == EXEC_NOT_FOUND_STATUS
+        || controller->last_status == EXEC_FAILED_STATUS) {
+        cache_discard(&entry);
+    } else {
+        cache_commit(&entry, status);
+    }
+
+    return set_input_terminal(controller) == BAD_RESULT ? CRASH : CONTINUE;
+}
+
+static void execute_conveyor_wait(JobController *controller,
+                                  CommandLine *command_line,
+                                  Command const *commands) {
+    size_t number_of_children = command_line->last_command_in_pipeline -
+                                command_line->current_index_of_command + 1;
+
+    pid_t *pids = &command_line->pids[command_line->current_index_of_command];
+    if (commands[number_of_children - 1].flag & BACKGROUND) {
+        execute_add_background(controller, pids, commands, number_of_children);
+        controller->last_status = EXIT_SUCCESS;
+        return;
+    }
+
+    int status = execute_wait(controller, commands, pids, number_of_children);
+    controller->last_status = job_status_code(status);
+}
+
+/*
+ * Waits for all processes of a foreground job and returns the wait status of
+ * its last process. With a timeout the wait also watches a timerfd and
+ * signals the whole process group when it expires. While deferred jobs are
+ * waiting, other children wake the wait up too, so they start on time, and
+ * the output of captured jobs is merged meanwhile.
+ * Without job control the processes share the shell's group, so they are
+ * waited for one by one and stops are left to the parent shell.
+ */
+static int execute_wait(JobController *controller,
+                        Command const *commands,
+                        pid_t const *pids,
+                        size_t count) {
+    pid_t pgid = pids[0];
+    Timeout const *timeout = command_timeout(commands, count);
+    int timer = BAD_RESULT;
+    char unbounded = FALSE;
+    if (timeout->duration) {
+        timer = timeout_create(timeout->duration);
+        unbounded = timer == BAD_RESULT;
+    }
+
+    if (unbounded) {
+        fprintf(stderr, "shell: timeout: no timer, the command is killed\n");
+        execute_signal(controller, pids, count, SIGKILL);
+    }
+
+    int options = controller->job_control ? WUNTRACED : 0;
+    char deferred = (char) job_controller_has_pending(controller);
+    if (timer != BAD_RESULT || deferred || merge_fd() != BAD_RESULT) {
+        options |= WNOHANG;
+    }
+
+    int result = 0;
+    char killed = FALSE;
+    size_t completed = 0;
+    while (completed < count) {
+        int status = 0;
+        stats_count(STATS_WAITPID);
+        pid_t wait_result = waitpid(controller->job_control
+                                    ? -pgid
+                                    : pids[completed], &status, options);
+        if (wait_result == 0) {
+            int events = event_wait(timer);
+            if (events & EVENT_FD
+                && execute_timeout_expired(controller, timeout, pids, count,
+                                           timer, &killed) == BAD_RESULT) {
+                close(timer);
+                timer = BAD_RESULT;
+            }
+
+            if (deferred && events & EVENT_CHILD) {
+                execute_deferred(controller);
+            }
+
             continue;
         }
 
-        exit_code = exec_command(controller, command_line, current_command);
-        switch (exit_code) {
-            case EXIT:
-            case CRASH:
-                return exit_code;
-            default:
-                break;
+        if (wait_result == BAD_RESULT) {
+            perror("Couldn't wait for child process termination");
+            break;
+        }
+
+        if (WIFSTOPPED(status)) {
+            jid_t jid = job_controller_add_conveyor(controller, pids, commands,
+                                                    JOB_STOPPED, count);
+            size_t index = job_controller_search_job_by_jid(controller, jid);
+            if (index < controller->number_of_jobs) {
+                controller->jobs[index]->count -= completed;
+            }
+
+            result = status;
+            break;
+        }
+
+        ++completed;
+        if (wait_result == pids[count - 1]) {
+            result = status;
         }
     }
 
-    return CONTINUE;
+    if (timer != BAD_RESULT) {
+        close(timer);
+    }
+
+    if (killed) {
+        fprintf(stderr, "shell: timeout: ");
+        command_print(commands, count, stderr);
+        fprintf(stderr, ": timed out\n");
+        result = W_EXITCODE(TIMEOUT_STATUS, 0);
+    }
+
+    if (unbounded && !WIFSTOPPED(result)) {
+        result = W_EXITCODE(TIMEOUT_FAILED_STATUS, 0);
+    }
+
+    controller->interrupted = (char) (WIFSIGNALED(result)
+                                      && WTERMSIG(result) == SIGINT);
+    return result;
 }
 
-static void execute_conveyor_wait(JobController *controller,
-                                  CommandLine *command_line,
-                                  Command *command) {
-    size_t number_of_children = command_line->last_command_in_pipeline -
-                                command_line->current_index_of_command + 1;
+static int execute_timeout_expired(JobController *controller,
+                                   Timeout const *timeout,
+                                   pid_t const *pids,
+                                   size_t count,
+                                   int timer,
+                                   char *killed) {
+    if (!timeout_expired(timer)) {
+        return EXIT_SUCCESS;
+    }
 
-    pid_t main_pid = command_line->main_process;
-    if (command->flag & BACKGROUND) {
-        job_controller_add_conveyor(controller, main_pid,
-                                    command, JOB_RUNNING, number_of_children);
+    execute_signal(controller, pids, count,
+                   *killed ? SIGKILL : timeout->signal);
+    execute_signal(controller, pids, count, SIGCONT);
+
+    if (*killed || !timeout->kill_after) {
+        *killed = TRUE;
+        return BAD_RESULT;
+    }
+
+    *killed = TRUE;
+    return timeout_rearm(timer, timeout->kill_after);
+}
+
+static void execute_signal(JobController *controller,
+                           pid_t const *pids,
+                           size_t count,
+                           int signal) {
+    if (controller->job_control) {
+        killpg(pids[0], signal);
         return;
     }
 
-    size_t number_of_children_completed = 0;
-    while (number_of_children_completed < number_of_children) {
-        int status = 0;
-        pid_t wait_result = waitpid(-main_pid, &status, WUNTRACED);
-        if (wait_result != BAD_RESULT) {
-            if (WIFSTOPPED(status)) {
-                number_of_children -= number_of_children_completed;
-                job_controller_add_conveyor(controller, main_pid, command,
-                                            JOB_STOPPED, number_of_children);
-                return;
-            } else {
-                ++number_of_children_completed;
-            }
-        } else {
-            perror("Couldn't wait for child process termination");
-        }
+    size_t index;
+    for (index = 0; index < count; ++index) {
+        kill(pids[index], signal);
     }
 }
 
@@ -134,16 +1143,10 @@ static int execute_conveyor_parent(JobController *controller,
                                    CommandLine *command_line) {
     size_t index_of_begin_pipeline = command_line->current_index_of_command;
     Command *commands = command_line->commands;
-    size_t pipeline_len = command_line->last_command_in_pipeline
-                          - index_of_begin_pipeline + 1;
-
-    Command *result_command = command_concat(&commands[index_of_begin_pipeline],
-                                             pipeline_len);
+    execute_conveyor_wait(controller, command_line,
+                          &commands[index_of_begin_pipeline]);
 
-    execute_conveyor_wait(controller, command_line, result_command);
-    command_free(result_command);
-
-    int exit_code = set_input_terminal();
+    int exit_code = set_input_terminal(controller);
     if (exit_code == BAD_RESULT) {
         return CRASH;
     }
@@ -157,16 +1160,24 @@ static void processing_conveyor_parent(CommandLine *command_line,
         close(command_line->prev_out_pipe);
     }
 
-    close(command_line->pipe_des[1]);
-    command_line->prev_out_pipe = command_line->pipe_des[0];
+    if (command->flag & OUT_PIPE) {
+        close(command_line->pipe_des[1]);
+        command_line->prev_out_pipe = command_line->pipe_des[0];
+    }
 }
 
-static int processing_conveyor_command(CommandLine *command_line,
+static int processing_conveyor_command(JobController *controller,
+                                       CommandLine *command_line,
                                        size_t current_index) {
     Command *current_command = &command_line->commands[current_index];
-    int exit_code = pipe(command_line->pipe_des);
-    CHECK_ON_ERROR(exit_code, BAD_RESULT, "Couldn't create pipe")
+    if (current_command->flag & OUT_PIPE) {
+        int exit_code = pipe(command_line->pipe_des);
+        CHECK_ON_ERROR(exit_code, BAD_RESULT, "Couldn't create pipe")
+        stats_count(STATS_PIPE);
+    }
 
+    fflush(stdout);
+    stats_count(STATS_FORK);
     pid_t pid = fork();
     if (command_line->current_index_of_command == current_index) {
         command_line->main_process = pid;
@@ -177,17 +1188,23 @@ static int processing_conveyor_command(CommandLine *command_line,
             perror("Couldn't create process");
             return CRASH;
         case DESCENDANT_PID:
-            return execute_descendant(command_line, current_command);
+            return execute_descendant(controller, command_line,
+                                      current_command);
         default:
             break;
     }
 
-    setpgid(pid, command_line->main_process);
+    command_line->pids[current_index] = pid;
+    if (controller->job_control) {
+        setpgid(pid, command_line->main_process);
+    }
+
     processing_conveyor_parent(command_line, current_command);
     return CONTINUE;
 }
 
-static void prepare_conveyor(CommandLine *command_line) {
+static int prepare_conveyor(JobController *controller,
+                            CommandLine *command_line) {
     Command *commands = command_line->commands;
     size_t index_of_begin_pipeline = command_line->current_index_of_command;
 
@@ -203,9 +1220,42 @@ static void prepare_conveyor(CommandLine *command_line) {
     for (index = index_of_begin_pipeline; index < last_index; ++index) {
         commands[index].flag |= background_flag;
     }
+
+    for (index = index_of_begin_pipeline + 1; index <= last_index; ++index) {
+        int exit_code = builtin_prefix_exec(controller, &commands[index]);
+        if (exit_code != CONTINUE) {
+            return STOP;
+        }
+    }
+
+    for (index = index_of_begin_pipeline; index <= last_index; ++index) {
+        if (background_flag && commands[index].timeout.duration) {
+            fprintf(stderr, "shell: timeout: background jobs are not supported\n");
+            return STOP;
+        }
+    }
+
+    if (background_flag && job_controller_is_full(controller)) {
+        return STOP;
+    }
+
+    Scheduling base = commands[index_of_begin_pipeline].scheduling;
+    if (base.mask & SCHEDULING_SPREAD) {
+        for (index = index_of_begin_pipeline; index <= last_index; ++index) {
+            Scheduling *current = &commands[index].scheduling;
+            if (index == index_of_begin_pipeline
+                || !(current->mask & SCHEDULING_AFFINITY)) {
+                scheduling_spread(current, &base,
+                                  index - index_of_begin_pipeline);
+            }
+        }
+    }
+
+    return CONTINUE;
 }
 
 static void command_set_background_signal(const Command *command) {
+    event_reset_signals();
     if (command->flag & BACKGROUND) {
         signal(SIGINT, SIG_IGN);
         signal(SIGQUIT, SIG_IGN);
@@ -218,14 +1268,39 @@ static void command_set_background_signal(const Command *command) {
 
 static int execute_conveyor(JobController *controller,
                             CommandLine *command_line) {
-    prepare_conveyor(command_line);
+    int exit_code = prepare_conveyor(controller, command_line);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
 
     Command *commands = command_line->commands;
     size_t first_index = command_line->current_index_of_command;
+    size_t last_index = command_line->last_command_in_pipeline;
+    exit_code = execute_capture_open(&commands[first_index],
+                                     last_index - first_index + 1);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
+    exit_code = execute_gate_open(controller, &commands[last_index]);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
+    /* A timeout is only watched while the shell waits for the stages */
+    char timed = command_timeout(&commands[first_index],
+                                 last_index - first_index + 1)->duration != 0;
     size_t current_index = first_index;
     while (commands[current_index].flag & (IN_PIPE | OUT_PIPE)) {
-        int exit_code = processing_conveyor_command(command_line,
-                                                    current_index);
+        Stream stream;
+        if (current_index == command_line->last_command_in_pipeline && !timed
+            && is_stream_command(controller, &commands[current_index],
+                                 &stream)) {
+            return execute_conveyor_stream(controller, command_line, &stream);
+        }
+
+        exit_code = processing_conveyor_command(controller, command_line,
+                                                current_index);
         if (exit_code != CONTINUE) {
             return exit_code;
         }
@@ -243,10 +1318,40 @@ static int exec_command(JobController *controller,
         return execute_conveyor(controller, command_line);
     }
 
+    if (command->group == GROUP_BRACE && !(command->flag & BACKGROUND)) {
+        return execute_brace_group(controller, command_line, command);
+    }
+
+    if (command->flag & BACKGROUND && command->timeout.duration) {
+        fprintf(stderr, "shell: timeout: background jobs are not supported\n");
+        return STOP;
+    }
+
+    if (command->flag & BACKGROUND && job_controller_is_full(controller)) {
+        return STOP;
+    }
+
+    int exit_code = execute_capture_open(command, 1);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
+    Stream stream;
+    if (is_stream_command(controller, command, &stream)) {
+        return execute_stream(controller, command_line, command, &stream);
+    }
+
+    exit_code = execute_gate_open(controller, command);
+    if (exit_code != CONTINUE) {
+        return exit_code;
+    }
+
+    fflush(stdout);
+    stats_count(STATS_FORK);
     pid_t pid = fork();
     switch (pid) {
         case DESCENDANT_PID:
-            return execute_descendant(command_line, command);
+            return execute_descendant(controller, command_line, command);
         case BAD_PID:
             perror("Couldn't create process");
             return CRASH;
@@ -258,24 +1363,20 @@ static int exec_command(JobController *controller,
 static int execute_parent(JobController *controller,
                           pid_t descendant_pid,
                           Command *command) {
+    if (controller->job_control) {
+        setpgid(descendant_pid, descendant_pid);
+    }
+
     if (command->flag & BACKGROUND) {
-        job_controller_add_job(controller, descendant_pid, command,
-                               JOB_RUNNING);
+        execute_add_background(controller, &descendant_pid, command, 1);
+        controller->last_status = EXIT_SUCCESS;
         return CONTINUE;
     }
 
-    int status = 0;
-    pid_t wait_result = waitpid(descendant_pid, &status, WUNTRACED);
-    if (wait_result != BAD_RESULT) {
-        if (WIFSTOPPED(status)) {
-            job_controller_add_job(controller, descendant_pid, command,
-                                   JOB_STOPPED);
-        }
-    } else {
-        perror("Couldn't wait for child process termination");
-    }
+    int status = execute_wait(controller, command, &descendant_pid, 1);
+    controller->last_status = job_status_code(status);
 
-    int exit_code = set_input_terminal();
+    int exit_code = set_input_terminal(controller);
     if (exit_code == BAD_RESULT) {
         return CRASH;
     }
@@ -283,7 +1384,11 @@ static int execute_parent(JobController *controller,
     return CONTINUE;
 }
 
-static int set_input_terminal() {
+static int set_input_terminal(JobController *controller) {
+    if (!controller->job_control) {
+        return EXIT_SUCCESS;
+    }
+
     pid_t pgrp = getpgrp();
     int exit_code = terminal_set_stdin(pgrp);
     if (exit_code == BAD_RESULT) {
@@ -293,42 +1398,406 @@ static int set_input_terminal() {
     return EXIT_SUCCESS;
 }
 
-static int execute_descendant(CommandLine *command_line, Command *command) {
+/*
+ * Turns a forked process into the command. It does not return: a failure
+ * ends the process with the status a missing or unrunnable program gets.
+ */
+static int execute_descendant(JobController *controller,
+                              CommandLine *command_line,
+                              Command *command) {
     command_set_background_signal(command);
 
-    int exit_code = setpgid(0, (command->flag & (IN_PIPE | OUT_PIPE))
+    int exit_code;
+    if (controller->job_control) {
+        exit_code = setpgid(0, (command->flag & (IN_PIPE | OUT_PIPE))
                                ? command_line->main_process
                                : 0);
-    CHECK_ON_ERROR(exit_code, BAD_RESULT, "Couldn't set process group ID")
+        if (exit_code == BAD_RESULT) {
+            perror("Couldn't set process group ID");
+            execute_exit(EXIT_FAILURE);
+        }
+    }
+
+    if (gate[0] != BAD_RESULT) {
+        execute_gate_wait(controller);
+    }
 
     if (!(command->flag & (BACKGROUND | IN_PIPE))) {
-        exit_code = set_input_terminal();
+        exit_code = set_input_terminal(controller);
         if (exit_code == BAD_RESULT) {
-            return CRASH;
+            execute_exit(EXIT_FAILURE);
         }
     }
 
-    exit_code = set_redirects(command_line, command);
-    if (exit_code == CRASH) {
-        return exit_code;
+    if (capture[1] != BAD_RESULT && set_capture() == CRASH) {
+        execute_exit(EXIT_FAILURE);
+    }
+
+    if (set_redirects(command_line, command) == CRASH
+        || resource_limits_apply(&command->limits, 0) == BAD_RESULT
+        || scheduling_apply(&command->scheduling, 0) == BAD_RESULT) {
+        execute_exit(EXIT_FAILURE);
+    }
+
+    if (command->group != GROUP_NONE
+        || strcmp(command->arguments[0], SHARD_NAME) == 0) {
+        coprocess_close_all();
+    }
+
+    if (command->group == GROUP_FANOUT) {
+        execute_exit(execute_fanout(command_line, command));
+    }
+
+    if (command->group != GROUP_NONE) {
+        execute_exit(execute_subshell(command_line, command));
+    }
+
+    if (strcmp(command->arguments[0], SHARD_NAME) == 0) {
+        execute_exit(shard_run(command->arguments));
     }
 
+    stats_count(STATS_EXEC);
     execvp(command->arguments[0], command->arguments);
 
+    int error = errno;
+    stats_count(STATS_EXEC_FAILED);
     perror("Couldn't execute command");
+    execute_exit(error == ENOENT ? EXEC_NOT_FOUND_STATUS : EXEC_FAILED_STATUS);
     return CRASH;
 }
 
+/*
+ * Runs the commands of a group with the given controller. The group sees
+ * the status of the command before it in "$?".
+ */
+static int execute_group(JobController *controller,
+                         CommandLine *command_line,
+                         Command const *command) {
+    char body[MAX_COMMAND_LINE];
+    group_body(command, body);
+
+    CommandLine *group_line = malloc(sizeof(CommandLine));
+    check_memory(group_line);
+    command_line_init(group_line);
+
+    controller->last_status = command_line->previous_status;
+    ssize_t number_of_commands = parse_input_line(body, group_line);
+    int exit_code = execute_command_line(controller, group_line,
+                                         number_of_commands);
+    if (number_of_commands == BAD_SYNTAX) {
+        controller->last_status = EXIT_FAILURE;
+    }
+
+    command_line_release(group_line);
+    free(group_line);
+    return exit_code;
+}
+
+/*
+ * A brace group runs in the shell itself. Its redirects are applied once to
+ * the shell's own descriptors and undone when the group finishes.
+ */
+static int execute_brace_group(JobController *controller,
+                               CommandLine *command_line,
+                               Command *command) {
+    int saved[2];
+    int exit_code = save_descriptors(saved);
+    if (exit_code == CRASH) {
+        return exit_code;
+    }
+
+    exit_code = set_redirects(command_line, command);
+    if (exit_code == CRASH) {
+        controller->last_status = EXIT_FAILURE;
+        exit_code = CONTINUE;
+    } else {
+        exit_code = execute_group(controller, command_line, command);
+    }
+
+    if (restore_descriptors(saved) == CRASH) {
+        return CRASH;
+    }
+
+    return exit_code;
+}
+
+/*
+ * Simple cat, head, tail, wc and tee run in the shell when they can't hold
+ * it up: with job control only on regular files, since the shell can't be
+ * stopped or interrupted like a job. In a conveyor only the last stage can
+ * run in the shell, and only without job control. Launch prefixes need a
+ * process of their own.
+ */
+static int is_stream_command(JobController *controller,
+                             Command const *command,
+                             Stream *stream) {
+    char in_pipe = (char) (command->flag & IN_PIPE);
+    if (command->flag & (BACKGROUND | OUT_PIPE)
+        || (in_pipe && controller->job_control)
+        || command->group != GROUP_NONE
+        || command->limits.mask || command->scheduling.mask
+        || command->timeout.duration
+        || !stream_parse(command, stream)) {
+        return FALSE;
+    }
+
+    if (!controller->job_control && stream->tool != STREAM_TAIL) {
+        return TRUE;
+    }
+
+    if (in_pipe && (stream->tool == STREAM_TEE || !stream->files[0])) {
+        return FALSE;
+    }
+
+    return stream_inputs_regular(stream, command->flag & IN_FILE
+                                         ? command->infile
+                                         : NULL);
+}
+
+static int execute_stream(JobController *controller,
+                          CommandLine *command_line,
+                          Command *command,
+                          Stream const *stream) {
+    int saved[2];
+    int exit_code = save_descriptors(saved);
+    if (exit_code == CRASH) {
+        return exit_code;
+    }
+
+    stats_count(STATS_IN_PROCESS);
+    exit_code = set_redirects(command_line, command);
+    if (controller->job_control) {
+        event_catch_interrupt(TRUE);
+    }
+
+    controller->last_status = exit_code == CRASH
+                              ? EXIT_FAILURE
+                              : stream_run(stream);
+    if (controller->job_control) {
+        controller->interrupted = (char) event_interrupt_pending();
+        event_catch_interrupt(FALSE);
+    }
+
+    return restore_descriptors(saved) == CRASH ? CRASH : CONTINUE;
+}
+
+/*
+ * The other stages are already running; the shell reads the last pipe
+ * itself and then collects them. The conveyor's status is the status of
+ * the stage run in the shell.
+ */
+static int execute_conveyor_stream(JobController *controller,
+                                   CommandLine *command_line,
+                                   Stream const *stream) {
+    size_t first_index = command_line->current_index_of_command;
+    size_t last_index = command_line->last_command_in_pipeline;
+    Command *commands = command_line->commands;
+
+    int exit_code = execute_stream(controller, command_line,
+                                   &commands[last_index], stream);
+    int status = controller->last_status;
+    if (exit_code == CRASH) {
+        close(command_line->prev_out_pipe);
+        status = EXIT_FAILURE;
+    }
+
+    execute_wait(controller, &commands[first_index],
+                 &command_line->pids[first_index], last_index - first_index);
+    controller->last_status = status;
+    return exit_code;
+}
+
+static int save_descriptors(int *saved) {
+    fflush(stdout);
+    saved[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, SAVED_FD_MIN);
+    CHECK_ON_ERROR(saved[0], BAD_RESULT, "Couldn't save input")
+
+    saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SAVED_FD_MIN);
+    if (saved[1] == BAD_RESULT) {
+        perror("Couldn't save output");
+        close(saved[0]);
+        return CRASH;
+    }
+
+    return CONTINUE;
+}
+
+static int restore_descriptors(int const *saved) {
+    fflush(stdout);
+    int exit_code = use_dup2(saved[0], STDIN_FILENO, "Couldn't restore input");
+    if (use_dup2(saved[1], STDOUT_FILENO, "Couldn't restore output") == CRASH) {
+        return CRASH;
+    }
+
+    return exit_code;
+}
+
+/*
+ * The last command of a script is exec'ed in place of the shell when nothing
+ * would be left for the shell to do afterwards.
+ */
+static int is_tail_command(JobController *controller,
+                           CommandLine *command_line,
+                           size_t index,
+                           size_t number_of_commands) {
+    Command const *command = &command_line->commands[index];
+    return command_line->tail_exec
+           && !controller->job_control
+           && !controller->number_of_jobs
+           && index + 1 == number_of_commands
+           && !(command->flag & (IN_PIPE | OUT_PIPE | BACKGROUND))
+           && command->group == GROUP_NONE
+           && !command->timeout.duration;
+}
+
+/*
+ * A subshell runs the group with its own job table and without job control:
+ * its commands stay in the subshell's process group, so the whole group is
+ * a single job of the parent shell.
+ */
+static int execute_subshell(CommandLine *command_line, Command const *command) {
+    JobController *controller = job_controller_create();
+    controller->job_control = FALSE;
+    if (event_init() == BAD_RESULT) {
+        return EXIT_FAILURE;
+    }
+
+    int exit_code = execute_group(controller, command_line, command);
+    int status = exit_code == CRASH ? EXIT_FAILURE : controller->last_status;
+    job_controller_free(controller);
+    return status;
+}
+
+/*
+ * A fan-out stage runs every consumer as a subshell reading a pipe of its
+ * own and pumps the stage's input into all of them. The stage ends when the
+ * consumers do, with the status of the last one.
+ */
+static int execute_fanout(CommandLine *command_line, Command const *command) {
+    char body[MAX_COMMAND_LINE];
+    group_body(command, body);
+
+    char *consumers[MAX_COMMANDS];
+    ssize_t count = parse_fanout(body, consumers, MAX_COMMANDS);
+    if (count == BAD_SYNTAX) {
+        return EXIT_FAILURE;
+    }
+
+    int inputs[MAX_COMMANDS];
+    int outputs[MAX_COMMANDS];
+    ssize_t index;
+    for (index = 0; index < count; ++index) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == BAD_RESULT) {
+            perror("Couldn't create pipe");
+            return EXIT_FAILURE;
+        }
+
+        stats_count(STATS_PIPE);
+        inputs[index] = fds[0];
+        outputs[index] = fds[1];
+    }
+
+    pid_t pids[MAX_COMMANDS];
+    ssize_t created = count;
+    for (index = 0; index < count; ++index) {
+        stats_count(STATS_FORK);
+        pids[index] = fork();
+        if (pids[index] == BAD_PID) {
+            perror("Couldn't create process");
+            count = index;
+            break;
+        }
+
+        if (pids[index] != DESCENDANT_PID) {
+            continue;
+        }
+
+        dup2(inputs[index], STDIN_FILENO);
+        ssize_t other;
+        for (other = 0; other < count; ++other) {
+            close(inputs[other]);
+            close(outputs[other]);
+        }
+
+        Command consumer;
+        char text[MAX_COMMAND_LINE];
+        memset(&consumer, 0, sizeof(consumer));
+        snprintf(text, sizeof(text), "%c%s%c", TOKEN_SUBSHELL_OPEN,
+                 consumers[index], TOKEN_SUBSHELL_CLOSE);
+        consumer.arguments[0] = text;
+        consumer.group = GROUP_SUBSHELL;
+        execute_exit(execute_subshell(command_line, &consumer));
+    }
+
+    for (index = 0; index < created; ++index) {
+        close(inputs[index]);
+        if (index >= count) {
+            close(outputs[index]);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (stream_fanout(STDIN_FILENO, outputs, (size_t) count) == BAD_RESULT) {
+        perror("Couldn't send input to consumers");
+    }
+
+    close(STDIN_FILENO);
+    int status = EXIT_SUCCESS;
+    for (index = 0; index < count; ++index) {
+        if (outputs[index] != BAD_RESULT) {
+            close(outputs[index]);
+        }
+
+        stats_count(STATS_WAITPID);
+        while (waitpid(pids[index], &status, 0) == BAD_RESULT
+               && errno == EINTR) {
+        }
+    }
+
+    return job_status_code(status);
+}
+
+/*
+ * Ends a forked copy of the shell. Only the output streams are flushed:
+ * exit() would also move the offset of the script, which the parent shares,
+ * back to where the read buffer ends, and lines would be read again.
+ */
+static void execute_exit(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+static void group_body(Command const *command, char *body) {
+    char const *text = command->arguments[0];
+    size_t body_len = strlen(text) - 2;
+    memcpy(body, text + 1, body_len);
+    body[body_len] = END;
+}
+
 static int set_redirects(CommandLine *command_line, Command *command) {
     int exit_code;
-    if ((command->flag & IN_FILE) && command->infile) {
+    if ((command->flag & IN_FILE) && command->infile
+        && *command->infile == REDIRECT_DUPLICATE) {
+        exit_code = set_duplicate(command->infile + 1, STDIN_FILENO);
+        if (exit_code == CRASH) {
+            return exit_code;
+        }
+    } else if ((command->flag & IN_FILE) && command->infile) {
         exit_code = set_infile(command->infile);
         if (exit_code == CRASH) {
             return exit_code;
         }
     }
 
-    if ((command->flag & OUT_FILE) && command->outfile) {
+    if ((command->flag & OUT_FILE) && command->outfile
+        && *command->outfile == REDIRECT_DUPLICATE) {
+        exit_code = set_duplicate(command->outfile + 1, STDOUT_FILENO);
+        if (exit_code == CRASH) {
+            return exit_code;
+        }
+    } else if ((command->flag & OUT_FILE) && command->outfile) {
         exit_code = set_outfile(command->outfile, command->appfile);
         if (exit_code == CRASH) {
             return exit_code;
@@ -344,6 +1813,7 @@ static int set_redirects(CommandLine *command_line, Command *command) {
     }
 
     if (command->flag & OUT_PIPE) {
+        close(command_line->pipe_des[0]);
         exit_code = use_dup2(command_line->pipe_des[1], STDOUT_FILENO,
                              "Couldn't redirect output");
         if (exit_code == CRASH) {
@@ -354,6 +1824,23 @@ static int set_redirects(CommandLine *command_line, Command *command) {
     return EXIT_SUCCESS;
 }
 
+/*
+ * Points the output and errors of a process of a captured job to the
+ * capture pipe. Redirects and conveyor pipes still take the output after.
+ */
+static int set_capture() {
+    close(capture[0]);
+    if (dup2(capture[1], STDOUT_FILENO) == BAD_RESULT
+        || dup2(capture[1], STDERR_FILENO) == BAD_RESULT) {
+        perror("Couldn't redirect output");
+        return CRASH;
+    }
+
+    close(capture[1]);
+    capture[0] = capture[1] = BAD_RESULT;
+    return CONTINUE;
+}
+
 static int use_dup2(int fd, int fd2, char *error) {
     int exit_code = dup2(fd, fd2);
     if (exit_code == BAD_RESULT) {
@@ -387,3 +1874,23 @@ static int set_outfile(char *outfile, char addfile) {
 
     return use_dup2(output, STDOUT_FILENO, "Couldn't redirect output");
 }
+
+/*
+ * "<&N" and ">&N" copy a descriptor the shell already has, like the ends of
+ * a coprocess. The descriptor itself stays open.
+ */
+static int set_duplicate(char const *target, int fd2) {
+    char *end = NULL;
+    long fd = strtol(target, &end, 10);
+    if (!isdigit(*target) || *end != END || fd > INT_MAX) {
+        fprintf(stderr, "shell: %s: bad file descriptor\n", target);
+        return CRASH;
+    }
+
+    if (fd != fd2 && dup2((int) fd, fd2) == BAD_RESULT) {
+        fprintf(stderr, "shell: %s: %s\n", target, strerror(errno));
+        return CRASH;
+    }
+
+    return CONTINUE;
+}
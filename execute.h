@@ -9,6 +9,7 @@
 
 #include "command.h"
 #include "job_control.h"
+#include "cache.h"
 
 
 #define EXIT 1
@@ -19,10 +20,36 @@
 #define BAD_PID (-1)
 #define DESCENDANT_PID 0
 
+#define EXIT_USAGE_STATUS 2
+#define EXEC_FAILED_STATUS 126
+#define EXEC_NOT_FOUND_STATUS 127
+
+#define COPROC_READ 0
+#define COPROC_WRITE 1
+
+#define SUBSTITUTION_MEMFD "substitution"
+
 
 int execute_command_line(JobController *controller,
                          CommandLine *command_line,
                          ssize_t number_of_commands);
 
+int execute_replace(JobController *controller, Command *command);
+
+pid_t execute_coprocess(JobController *controller, Command *command, int *fds);
+
+void execute_coprocess_close(int fd);
+
+void execute_deferred(JobController *controller);
+
+int execute_cached(JobController *controller,
+                   Command *command,
+                   CacheKey const *key);
+
+char *execute_substitution(JobController *controller,
+                           char *text,
+                           size_t *len,
+                           char *interrupted);
+
 
 #endif //EXECUTE_H
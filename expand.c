@@ -0,0 +1,285 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "expand.h"
+#include "execute.h"
+#include "parse_line.h"
+
+
+#define STATUS_LEN 12
+
+
+struct Fields_St {
+    CommandLine *command_line;
+    char *words[MAX_ARGS];
+    size_t count;
+    char *current;
+    size_t len;
+    size_t capacity;
+    char open;
+};
+
+typedef struct Fields_St Fields;
+
+
+static int expand_word(JobController *controller, char *word, Fields *fields);
+
+static char *expand_substitution(JobController *controller,
+                                 Fields *fields,
+                                 char *position,
+                                 char *interrupted);
+
+static size_t variable_name_len(char const *name);
+
+static void fields_append(Fields *fields, char const *str, size_t str_len);
+
+static int fields_split(Fields *fields, char const *str, size_t str_len);
+
+static int fields_end(Fields *fields);
+
+static char *substitution_end(char *word);
+
+
+/*
+ * Words are expanded right before the command is run, so "$?" sees the
+ * status of the command that has just finished on the same line and "$NAME"
+ * sees variables set earlier on it by "coproc" or "read". Unset variables
+ * expand to nothing. The text of a group is expanded later, command by
+ * command, when the group runs. The output of a command substitution is
+ * split into words, so it may add words or leave none. Returns
+ * EXPAND_EMPTY if no word is left to run and EXPAND_INTERRUPTED if a
+ * substitution was interrupted.
+ */
+int expand_command(JobController *controller,
+                   CommandLine *command_line,
+                   Command *command) {
+    Fields *fields = calloc(1, sizeof(Fields));
+    check_memory(fields);
+    fields->command_line = command_line;
+
+    int exit_code = EXIT_SUCCESS;
+    size_t index;
+    for (index = 0; !command->group && command->arguments[index]; ++index) {
+        exit_code = expand_word(controller, command->arguments[index],
+                                fields);
+        if (exit_code != EXIT_SUCCESS) {
+            break;
+        }
+    }
+
+    if (!command->group && exit_code == EXIT_SUCCESS) {
+        memcpy(command->arguments, fields->words,
+               fields->count * sizeof(char *));
+        command->arguments[fields->count] = NULL;
+        exit_code = fields->count ? EXIT_SUCCESS : EXPAND_EMPTY;
+    }
+
+    char **targets[] = {&command->infile, &command->outfile};
+    for (index = 0;
+         (exit_code == EXIT_SUCCESS || exit_code == EXPAND_EMPTY) && index < 2;
+         ++index) {
+        if (!*targets[index]) {
+            continue;
+        }
+
+        fields->count = 0;
+        int expanded = expand_word(controller, *targets[index], fields);
+        if (expanded != EXIT_SUCCESS) {
+            exit_code = expanded;
+        } else if (fields->count != 1) {
+            fprintf(stderr, "shell: %s: ambiguous redirect\n",
+                    *targets[index]);
+            exit_code = BAD_RESULT;
+        } else {
+            *targets[index] = fields->words[0];
+        }
+    }
+
+    free(fields->current);
+    free(fields);
+    return exit_code;
+}
+
+static int expand_word(JobController *controller, char *word, Fields *fields) {
+    char *position = strpbrk(word, EXPAND_PREFIX_STR TOKEN_BACKQUOTE_STR);
+    if (!position) {
+        if (fields->count + 1 == MAX_ARGS) {
+            fprintf(stderr, "shell: number of arguments (%d) exceeded\n",
+                    MAX_ARGS);
+            return BAD_RESULT;
+        }
+
+        fields->words[fields->count++] = word;
+        return EXIT_SUCCESS;
+    }
+
+    char status[STATUS_LEN];
+    while (position) {
+        fields_append(fields, word, (size_t) (position - word));
+
+        if (substitution_end(position)) {
+            char interrupted = FALSE;
+            word = expand_substitution(controller, fields, position,
+                                       &interrupted);
+            if (!word) {
+                return interrupted ? EXPAND_INTERRUPTED : BAD_RESULT;
+            }
+
+            position = strpbrk(word, EXPAND_PREFIX_STR TOKEN_BACKQUOTE_STR);
+            continue;
+        }
+
+        char const *value = position[0] == EXPAND_PREFIX
+                            ? EXPAND_PREFIX_STR
+                            : TOKEN_BACKQUOTE_STR;
+        size_t name_len = variable_name_len(position + 1);
+        if (position[0] != EXPAND_PREFIX) {
+            name_len = 0;
+        } else if (position[1] == EXPAND_STATUS) {
+            snprintf(status, sizeof(status), "%d", controller->last_status);
+            value = status;
+            name_len = 1;
+        } else if (name_len) {
+            char *name = strndup(position + 1, name_len);
+            check_memory(name);
+            value = getenv(name);
+            free(name);
+        }
+
+        fields_append(fields, value ? value : "", value ? strlen(value) : 0);
+        fields->open = TRUE;
+        word = position + 1 + name_len;
+        position = strpbrk(word, EXPAND_PREFIX_STR TOKEN_BACKQUOTE_STR);
+    }
+
+    fields_append(fields, word, strlen(word));
+    return fields_end(fields);
+}
+
+/*
+ * Runs the substitution at position and splits its output into the fields,
+ * trailing newlines first trimmed. Returns the rest of the word, or NULL if
+ * the substitution was interrupted or there are too many words.
+ */
+static char *expand_substitution(JobController *controller,
+                                 Fields *fields,
+                                 char *position,
+                                 char *interrupted) {
+    char *end = substitution_end(position);
+    size_t skip = *position == TOKEN_BACKQUOTE
+                  ? 1
+                  : strlen(TOKEN_SUBSTITUTION_OPEN);
+    char *text = strndup(position + skip, (size_t) (end - position) - skip);
+    check_memory(text);
+
+    size_t len;
+    char *output = execute_substitution(controller, text, &len, interrupted);
+    free(text);
+    if (*interrupted) {
+        free(output);
+        return NULL;
+    }
+
+    while (len && output[len - 1] == '\n') {
+        --len;
+    }
+
+    int exit_code = fields_split(fields, output, len);
+    free(output);
+    return exit_code == BAD_RESULT ? NULL : end + 1;
+}
+
+static size_t variable_name_len(char const *name) {
+    if (!isalpha(*name) && *name != '_') {
+        return 0;
+    }
+
+    size_t len = 1;
+    while (isalnum(name[len]) || name[len] == '_') {
+        ++len;
+    }
+
+    return len;
+}
+
+/*
+ * Empty text does not start a word: a substitution with no output leaves
+ * none, while a variable, even an unset one, always gives one.
+ */
+static void fields_append(Fields *fields, char const *str, size_t str_len) {
+    if (fields->len + str_len + 1 > fields->capacity) {
+        fields->capacity = (fields->len + str_len + 1) * 2;
+        fields->current = realloc(fields->current, fields->capacity);
+        check_memory(fields->current);
+    }
+
+    memcpy(fields->current + fields->len, str, str_len);
+    fields->len += str_len;
+    fields->current[fields->len] = END;
+    fields->open |= str_len != 0;
+}
+
+/*
+ * Blanks end the current word; the first word of the output continues the
+ * text before the substitution and the last one the text after it.
+ */
+static int fields_split(Fields *fields, char const *str, size_t str_len) {
+    size_t index = 0;
+    while (index < str_len) {
+        if (isspace(str[index])) {
+            if (fields_end(fields) == BAD_RESULT) {
+                return BAD_RESULT;
+            }
+
+            ++index;
+            continue;
+        }
+
+        size_t begin = index;
+        while (index < str_len && !isspace(str[index])) {
+            ++index;
+        }
+
+        fields_append(fields, str + begin, index - begin);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Ends the current word, if there is one, and gives it to the command line.
+ */
+static int fields_end(Fields *fields) {
+    if (!fields->open) {
+        return EXIT_SUCCESS;
+    }
+
+    if (fields->count + 1 == MAX_ARGS) {
+        fprintf(stderr, "shell: number of arguments (%d) exceeded\n",
+                MAX_ARGS);
+        return BAD_RESULT;
+    }
+
+    fields->words[fields->count++] = command_line_keep(fields->command_line,
+                                                       fields->current);
+    fields->current = NULL;
+    fields->len = fields->capacity = 0;
+    fields->open = FALSE;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Returns the end of the command substitution starting at word, or NULL if
+ * there is none. An unclosed one stays as it is.
+ */
+static char *substitution_end(char *word) {
+    if (*word != TOKEN_BACKQUOTE
+        && strncmp(word, TOKEN_SUBSTITUTION_OPEN,
+                   strlen(TOKEN_SUBSTITUTION_OPEN)) != 0) {
+        return NULL;
+    }
+
+    return parse_substitution_end(word);
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef EXPAND_H
+#define EXPAND_H
+
+
+#include "command.h"
+#include "job_control.h"
+
+
+#define EXPAND_PREFIX '$'
+#define EXPAND_PREFIX_STR "$"
+#define EXPAND_STATUS '?'
+
+#define EXPAND_EMPTY 1
+#define EXPAND_INTERRUPTED 2
+
+
+int expand_command(JobController *controller,
+                   CommandLine *command_line,
+                   Command *command);
+
+
+#endif //EXPAND_H
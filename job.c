@@ -3,38 +3,136 @@
  */
 
 
+#include <errno.h>
 #include <signal.h>
 #include <wait.h>
 #include "job.h"
+#include "process.h"
+#include "pool.h"
+#include "event.h"
 
 
-Job *job_create(jid_t jid, pid_t pid, Command *command, char status) {
-    return job_create_conveyor(jid, pid, command, status, 1);
+static int job_reap_pids(Job *job);
+
+static void json_print_string(char const *str, FILE *file);
+
+static void json_print_chars(char const *str, FILE *file);
+
+static void json_print_pid(pid_t pid, FILE *file);
+
+
+static Pool job_pool = POOL_INITIALIZER(Job);
+
+
+Job *job_create(jid_t jid, pid_t pid, Command const *command, char status) {
+    return job_create_conveyor(jid, &pid, command, status, 1);
 }
 
+/*
+ * The job keeps the settings of its stages and a copy of their words, so
+ * the commands can be freed as soon as the conveyor is started.
+ */
 Job *job_create_conveyor(jid_t jid,
-                         pid_t pid,
-                         Command *command,
+                         pid_t const *pids,
+                         Command const *commands,
                          char status,
                          size_t jobs_count) {
-    Job *job = malloc(sizeof(Job));
-    check_memory(job);
+    Job *job = pool_alloc(&job_pool);
 
-    job->command = command;
+    job->command = command_copy_for_job(commands, jobs_count);
+    job->arguments = command_copy_arguments(commands, jobs_count);
     job->status = status;
     job->jid = jid;
-    job->pid = pid;
+    job->pid = pids[0];
     job->count = jobs_count;
+    job->pids_count = jobs_count;
+    job->exit_status = 0;
+    job->notify = FALSE;
+    job->depends_count = 0;
+    job->depends_failed = FALSE;
+    job->condition = AFTER_ANY;
+    job->gate = BAD_RESULT;
+    job->started = stats_now();
+    clock_gettime(CLOCK_REALTIME, &job->start_time);
+    memcpy(job->pids, pids, jobs_count * sizeof(pid_t));
+    return job;
+}
+
+/*
+ * A deferred job has no process yet. Its command keeps the words and the
+ * redirects, so it can be started after the line it came from is gone.
+ */
+Job *job_create_deferred(jid_t jid,
+                         Command const *command,
+                         jid_t const *depends,
+                         size_t depends_count,
+                         char condition) {
+    Job *job = job_create(jid, 0, command, JOB_DEFERRED);
+
+    size_t index;
+    for (index = 0; job->arguments[index]; ++index) {
+        job->command->arguments[index] = job->arguments[index];
+    }
+
+    if (command->infile) {
+        job->command->infile = strdup(command->infile);
+        check_memory(job->command->infile);
+    }
+
+    if (command->outfile) {
+        job->command->outfile = strdup(command->outfile);
+        check_memory(job->command->outfile);
+    }
+
+    memcpy(job->depends, depends, depends_count * sizeof(jid_t));
+    job->depends_count = depends_count;
+    job->condition = condition;
     return job;
 }
 
+void job_start(Job *job, pid_t pid) {
+    job->pid = pid;
+    job->pids[0] = pid;
+    job->count = 1;
+    job->status = JOB_RUNNING;
+    job->started = stats_now();
+    clock_gettime(CLOCK_REALTIME, &job->start_time);
+}
+
+/*
+ * The processes of a queued job wait for a byte each on the job's gate
+ * before they exec.
+ */
+void job_release(Job *job) {
+    if (job->gate == BAD_RESULT) {
+        return;
+    }
+
+    char tokens[MAX_COMMANDS];
+    memset(tokens, 0, sizeof(tokens));
+    if (write(job->gate, tokens, job->pids_count) == BAD_RESULT) {
+        perror("Couldn't start queued job");
+    }
+
+    close(job->gate);
+    job->gate = BAD_RESULT;
+    if (job->status & JOB_QUEUED) {
+        job->status = JOB_RUNNING;
+    }
+}
+
 void job_free(Job *job) {
     if (!job) {
         return;
     }
 
+    if (job->gate != BAD_RESULT) {
+        close(job->gate);
+    }
+
     command_free(job->command);
-    free(job);
+    free(job->arguments);
+    pool_free(&job_pool, job);
 }
 
 void job_swap(Job **lhs, Job **rhs) {
@@ -44,11 +142,26 @@ void job_swap(Job **lhs, Job **rhs) {
 }
 
 void job_kill(Job *job, int signal) {
-    kill(job->pid, signal);
+    if (!(job->status & JOB_DEFERRED)) {
+        kill(job->pid, signal);
+    }
 }
 
+/*
+ * Without job control the stages stay in the group of the shell and there
+ * is no group to signal, so each stage gets the signal.
+ */
 void job_killpg(Job *job, int signal) {
-    killpg(job->pid, signal);
+    if (job->status & JOB_DEFERRED) {
+        return;
+    }
+
+    if (killpg(job->pid, signal) == BAD_RESULT && errno == ESRCH) {
+        size_t index;
+        for (index = 0; index < job->pids_count; ++index) {
+            kill(job->pids[index], signal);
+        }
+    }
 }
 
 char *job_get_status(char status) {
@@ -61,52 +174,299 @@ char *job_get_status(char status) {
             return "Done";
         case JOB_FAILED:
             return "Failed";
+        case JOB_DEFERRED:
+            return "Waiting";
+        case JOB_SKIPPED:
+            return "Skipped";
+        case JOB_QUEUED:
+            return "Queued";
         default:
             return "Unexpected";
     }
 }
 
 void job_print(Job *job, FILE *file, char *prefix) {
-    if (job->status & JOB_RUNNING) {
-        fprintf(file, "%s[%d] %s %s %s &\n",
-                prefix,
-                job->jid, job_get_status(job->status),
-                command_get_name(job->command),
-                command_get_args(job->command));
-    } else {
-        fprintf(file, "%s[%d] %s %s %s\n",
-                prefix,
-                job->jid, job_get_status(job->status),
-                command_get_name(job->command),
-                command_get_args(job->command));
+    fprintf(file, "%s[%d] %s ", prefix, job->jid, job_get_status(job->status));
+    job_print_command(job, file);
+    fprintf(file, "%s\n", job->status & JOB_RUNNING ? " &" : "");
+}
+
+void job_print_command(Job *job, FILE *file) {
+    command_print_arguments(job->arguments, job->pids_count, file);
+}
+
+void job_print_long(Job *job, FILE *file) {
+    fprintf(file, "[%d]", job->jid);
+
+    size_t index;
+    for (index = 0; index < job->pids_count && job->pid; ++index) {
+        fprintf(file, " %d", (int) job->pids[index]);
+    }
+
+    fprintf(file, " %s ", job_get_status(job->status));
+    job_print_command(job, file);
+    fprintf(file, "%s\n", job->status & JOB_RUNNING ? " &" : "");
+
+    if (job->command->limits.mask) {
+        fprintf(file, "    limits:");
+        resource_limits_print(&job->command->limits, file);
+        fprintf(file, "\n");
+    }
+
+    if (job->command->scheduling.mask) {
+        fprintf(file, "    scheduling:");
+        scheduling_print(&job->command->scheduling, file);
+        fprintf(file, "\n");
+    }
+
+    if (job->status & JOB_DEFERRED) {
+        fprintf(file, "    after:");
+        for (index = 0; index < job->depends_count; ++index) {
+            if (job->depends[index]) {
+                fprintf(file, " %%%d", job->depends[index]);
+            }
+        }
+
+        fprintf(file, "%s\n", job->condition == AFTER_SUCCESS
+                              ? " --on-success"
+                              : job->condition == AFTER_FAILURE
+                                ? " --on-failure"
+                                : "");
+    }
+}
+
+/*
+ * Prints the job as one JSON object. CPU time and resident memory are
+ * sampled from /proc for every stage that is still alive. A job that has
+ * no process yet, like a deferred one, has null for its pgid and for the
+ * pid and state of its stages.
+ */
+void job_print_json(Job *job, pid_t pgid, FILE *file) {
+    fprintf(file, "{\"jid\":%d,\"pgid\":", job->jid);
+    json_print_pid(job->pid ? pgid : 0, file);
+    fprintf(file, ",\"status\":\"%s\",\"command\":\"",
+            job_get_status(job->status));
+
+    char *const *arguments = job->arguments;
+    size_t index;
+    for (index = 0; index < job->pids_count; ++index) {
+        fputs(index ? " | " : "", file);
+        char *const *word;
+        for (word = arguments; *word; ++word) {
+            fputs(word == arguments ? "" : " ", file);
+            json_print_chars(*word, file);
+        }
+
+        arguments = word + 1;
+    }
+
+    double elapsed = (double) (stats_now() - job->started) / 1e6;
+    fprintf(file, "\",\"started\":%lld.%03ld,\"elapsed\":%.3f",
+            (long long) job->start_time.tv_sec,
+            job->start_time.tv_nsec / 1000000, elapsed);
+
+    double cpu_seconds = 0;
+    unsigned long long rss_bytes = 0;
+    fprintf(file, ",\"stages\":[");
+    arguments = job->arguments;
+    for (index = 0; index < job->pids_count; ++index) {
+        pid_t pid = job->pids[index];
+        fprintf(file, "%s{\"pid\":", index ? "," : "");
+        json_print_pid(pid, file);
+        fprintf(file, ",\"argv\":[");
+
+        char *const *word;
+        for (word = arguments; *word; ++word) {
+            fputs(word == arguments ? "" : ",", file);
+            json_print_string(*word, file);
+        }
+
+        arguments = word + 1;
+        if (!pid) {
+            fprintf(file, "],\"state\":null,\"cpu\":0.00,\"rss\":0}");
+            continue;
+        }
+
+        ProcessUsage usage;
+        process_usage_read(pid, &usage);
+        cpu_seconds += usage.cpu_seconds;
+        rss_bytes += usage.rss_bytes;
+        fprintf(file, "],\"state\":\"%c\",\"cpu\":%.2f,\"rss\":%llu}",
+                usage.state, usage.cpu_seconds, usage.rss_bytes);
     }
+
+    fprintf(file, "],\"cpu\":%.2f,\"rss\":%llu}", cpu_seconds, rss_bytes);
 }
 
+/*
+ * While captured jobs write, the wait wakes up to merge their output, so a
+ * captured job brought to the foreground never blocks on a full pipe.
+ */
 void job_wait(Job *job) {
-    int status;
-    pid_t wait_result = waitpid(job->pid, &status, WUNTRACED);
-    if (wait_result != BAD_RESULT) {
-        if (WIFSTOPPED(status)) {
-            job->status = JOB_STOPPED;
+    int options = merge_fd() != BAD_RESULT ? WUNTRACED | WNOHANG : WUNTRACED;
+    job->status = JOB_RUNNING;
+    while (!job_is_finished(job)) {
+        int status;
+        stats_count(STATS_WAITPID);
+        pid_t wait_result = waitpid(-job->pid, &status, options);
+        if (wait_result == 0) {
+            event_wait(BAD_RESULT);
+            continue;
+        }
+
+        if (wait_result == BAD_RESULT) {
+            if (errno != ECHILD) {
+                perror("Couldn't wait for child process termination");
+            }
+
+            job_reap(job);
+            return;
+        }
+
+        job_update(job, wait_result, status);
+        if (job->status & JOB_STOPPED) {
             job_print(job, stdout, "");
-        } else {
-            job->status = JOB_DONE;
+            return;
         }
-    } else {
-        perror("Couldn't wait for child process termination");
     }
 }
 
-void job_set_status(Job *job, int status) {
+void job_update(Job *job, pid_t pid, int status) {
+    if (WIFSTOPPED(status)) {
+        job->status = JOB_STOPPED;
+        return;
+    }
+
+    if (WIFCONTINUED(status)) {
+        job->status = JOB_RUNNING;
+        return;
+    }
+
+    if (job->count) {
+        --job->count;
+    }
+
+    if (pid == job->pids[job->pids_count - 1]) {
+        job->exit_status = status;
+    }
+
+    if (!job->count) {
+        job->status = job_status_code(job->exit_status) == EXIT_SUCCESS
+                      ? JOB_DONE
+                      : JOB_FAILED;
+    }
+}
+
+/*
+ * Collects every state change of the job's process group without blocking.
+ * Returns TRUE if the job has changed; the change is kept in notify until it
+ * is reported.
+ */
+int job_reap(Job *job) {
+    char changed = FALSE;
+    while (!job_is_finished(job) && !(job->status & JOB_DEFERRED)) {
+        int status = 0;
+        stats_count(STATS_WAITPID);
+        pid_t answer = waitpid(-job->pid, &status, WNOHANG | WUNTRACED);
+        if (answer == 0) {
+            break;
+        }
+
+        if (answer == BAD_RESULT) {
+            if (errno == ECHILD) {
+                changed = (char) (job_reap_pids(job) || changed);
+            }
+
+            break;
+        }
+
+        job_update(job, answer, status);
+        changed = TRUE;
+    }
+
+    if (changed) {
+        job->notify = TRUE;
+    }
+
+    return changed;
+}
+
+/*
+ * Without job control the job has no process group of its own, so its
+ * processes are polled one by one. Processes that are already gone have
+ * been collected before.
+ */
+static int job_reap_pids(Job *job) {
+    char changed = FALSE;
+    char running = FALSE;
+    size_t index;
+    for (index = 0; index < job->pids_count; ++index) {
+        int status = 0;
+        stats_count(STATS_WAITPID);
+        pid_t answer = waitpid(job->pids[index], &status, WNOHANG | WUNTRACED);
+        if (answer == 0) {
+            running = TRUE;
+        } else if (answer != BAD_RESULT) {
+            job_update(job, answer, status);
+            changed = TRUE;
+            if (!WIFEXITED(status) && !WIFSIGNALED(status)) {
+                running = TRUE;
+            }
+        }
+    }
+
+    if (!running && !job_is_finished(job)) {
+        job->count = 1;
+        job_update(job, 0, job->exit_status);
+        changed = TRUE;
+    }
+
+    return changed;
+}
+
+int job_is_finished(Job const *job) {
+    return job->status & (JOB_DONE | JOB_FAILED | JOB_SKIPPED);
+}
+
+int job_status_code(int status) {
     if (WIFEXITED(status)) {
-        if (WEXITSTATUS(status) != EXIT_SUCCESS) {
-            job->status = JOB_FAILED;
+        return WEXITSTATUS(status);
+    }
+
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+
+    return EXIT_FAILURE;
+}
+
+static void json_print_string(char const *str, FILE *file) {
+    fputc('"', file);
+    json_print_chars(str, file);
+    fputc('"', file);
+}
+
+static void json_print_pid(pid_t pid, FILE *file) {
+    if (pid) {
+        fprintf(file, "%d", (int) pid);
+    } else {
+        fputs("null", file);
+    }
+}
+
+static void json_print_chars(char const *str, FILE *file) {
+    for (; *str != END; ++str) {
+        unsigned char symbol = (unsigned char) *str;
+        if (symbol == '"' || symbol == '\\') {
+            fprintf(file, "\\%c", symbol);
+        } else if (symbol < 0x20) {
+            fprintf(file, "\\u%04x", symbol);
         } else {
-            job->status = JOB_DONE;
+            fputc(symbol, file);
         }
-    } else if (WIFSTOPPED(status)) {
-        job->status = JOB_STOPPED;
-    } else if (WIFCONTINUED(status)) {
-        job->status = JOB_RUNNING;
     }
 }
@@ -8,12 +8,24 @@
 
 
 #include "command.h"
+#include "stats.h"
+
+#include <time.h>
 
 
 #define JOB_STOPPED 1
 #define JOB_RUNNING 2
 #define JOB_DONE 4
 #define JOB_FAILED 8
+#define JOB_DEFERRED 16
+#define JOB_SKIPPED 32
+#define JOB_QUEUED 64
+
+#define AFTER_ANY 0
+#define AFTER_SUCCESS 1
+#define AFTER_FAILURE 2
+
+#define MAX_DEPENDENCIES 16
 
 
 typedef int jid_t;
@@ -21,21 +33,49 @@ typedef int jid_t;
 struct Job_St {
     jid_t jid;
     pid_t pid;
+    pid_t pids[MAX_COMMANDS];
+    size_t pids_count;
     size_t count;
     Command *command;
+    char **arguments;
+    int exit_status;
     char status;
+    char notify;
+    jid_t depends[MAX_DEPENDENCIES];
+    size_t depends_count;
+    char depends_failed;
+    char condition;
+    int gate;
+    struct timespec start_time;
+    stats_time_t started;
 };
 
 typedef struct Job_St Job;
 
 
-Job *job_create(jid_t jid, pid_t pid, Command *command, char status);
+Job *job_create(jid_t jid, pid_t pid, Command const *command, char status);
+
+Job *job_create_conveyor(jid_t jid, pid_t const *pids, Command const *commands, char status, size_t jobs_count);
+
+Job *job_create_deferred(jid_t jid,
+                         Command const *command,
+                         jid_t const *depends,
+                         size_t depends_count,
+                         char condition);
+
+void job_start(Job *job, pid_t pid);
 
-Job *job_create_conveyor(jid_t jid, pid_t pid, Command *command, char status, size_t jobs_count);
+void job_release(Job *job);
 
 void job_free(Job *job);
 
-void job_set_status(Job *job, int status);
+void job_update(Job *job, pid_t pid, int status);
+
+int job_reap(Job *job);
+
+int job_is_finished(Job const *job);
+
+int job_status_code(int status);
 
 void job_swap(Job **lhs, Job **rhs);
 
@@ -47,6 +87,12 @@ void job_killpg(Job *job, int signal);
 
 void job_print(Job *job, FILE *file, char *prefix);
 
+void job_print_command(Job *job, FILE *file);
+
+void job_print_long(Job *job, FILE *file);
+
+void job_print_json(Job *job, pid_t pgid, FILE *file);
+
 void job_wait(Job *job);
 
 
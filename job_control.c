@@ -5,9 +5,29 @@
 
 #include "job_control.h"
 #include "terminal.h"
+#include "stats.h"
 
 #include <wait.h>
 #include <signal.h>
+#include <sched.h>
+
+
+static void job_controller_resolve(JobController *controller, Job const *job);
+
+static int job_controller_limit(JobController const *controller);
+
+static int job_controller_running(JobController const *controller);
+
+static int job_priority(Job const *job);
+
+static void job_controller_append(JobController *controller, Job *job);
+
+static void job_controller_keep_result(JobController *controller,
+                                       Job const *job);
+
+static void job_controller_forget_result(JobController *controller, jid_t jid);
+
+static char job_controller_failed(Job const *job);
 
 
 JobController *job_controller_create() {
@@ -24,44 +44,265 @@ void job_controller_free(JobController *controller) {
         job_free(controller->jobs[index]);
     }
 
+    free(controller->jobs);
     free(controller);
 }
 
 void job_controller_init(JobController *controller) {
-    memset(controller->jobs, 0, sizeof(Job *) * JOB_LIMIT);
+    controller->jobs = calloc(JOB_LIMIT, sizeof(Job *));
+    check_memory(controller->jobs);
+    controller->jobs_capacity = JOB_LIMIT;
+    controller->results_count = 0;
     controller->current_max_jid = 1;
     controller->number_of_jobs = 0;
+    controller->last_status = EXIT_SUCCESS;
+    controller->interrupted = FALSE;
+    controller->job_control = TRUE;
+    controller->queue_mode = QUEUE_OFF;
+    controller->max_running = 0;
+
+    char const *limit = getenv(QUEUE_ENV);
+    if (limit && *limit
+        && job_controller_set_queue(controller, limit) == BAD_RESULT) {
+        fprintf(stderr, "shell: %s: %s: invalid limit\n", QUEUE_ENV, limit);
+    }
 }
 
 jid_t job_controller_add_job(JobController *controller,
                              pid_t pid,
                              Command const *command,
                              char status) {
-    return job_controller_add_conveyor(controller, pid, command, status, 1);
+    return job_controller_add_conveyor(controller, &pid, command, status, 1);
 }
 
 jid_t job_controller_add_conveyor(JobController *controller,
-                                  pid_t pid,
-                                  Command const *command,
+                                  pid_t const *pids,
+                                  Command const *commands,
                                   char status,
                                   size_t job_count) {
-    if (controller->number_of_jobs >= JOB_LIMIT - 1) {
-        fprintf(stderr, "shell: number of jobs (%d) exceeded\n", JOB_LIMIT);
+    if (job_controller_is_full(controller)) {
         return BAD_RESULT;
     }
 
-    Command *copy_of_command = command_copy_for_job(command);
-    Job *job = job_create_conveyor(controller->current_max_jid++, pid, copy_of_command,
-                          status, job_count);
-    controller->jobs[controller->number_of_jobs++] = job;
+    Job *job = job_create_conveyor(controller->current_max_jid++, pids,
+                                   commands, status, job_count);
+    job_controller_append(controller, job);
+    merge_forget(job->jid);
+
+    if (controller->job_control) {
+        fprintf(stderr, "\n[%d] %d\n", job->jid, (int) job->pid);
+    }
 
-    fprintf(stderr, "\n[%d] %d\n", job->jid, (int) job->pid);
     return job->jid;
 }
 
+/*
+ * Registers a job that is started once the given jobs are finished, see
+ * execute_deferred.
+ */
+jid_t job_controller_add_deferred(JobController *controller,
+                                  Command const *command,
+                                  jid_t const *depends,
+                                  size_t depends_count,
+                                  char condition) {
+    if (job_controller_is_full(controller)) {
+        return BAD_RESULT;
+    }
+
+    Job *job = job_create_deferred(controller->current_max_jid++, command,
+                                   depends, depends_count, condition);
+    job_controller_append(controller, job);
+    merge_forget(job->jid);
+    return job->jid;
+}
+
+int job_controller_has_pending(JobController const *controller) {
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        if (controller->jobs[index]->status & (JOB_DEFERRED | JOB_QUEUED)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+int job_controller_is_full(JobController const *controller) {
+    int started = 0;
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        if (!(controller->jobs[index]->status & JOB_QUEUED)) {
+            ++started;
+        }
+    }
+
+    if (started >= JOB_LIMIT - 1) {
+        fprintf(stderr, "shell: number of jobs (%d) exceeded\n", JOB_LIMIT);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * The number of background jobs running at once is a number, "cpus" for
+ * the CPUs the shell may run on, or "off".
+ */
+int job_controller_set_queue(JobController *controller, char const *value) {
+    if (strcmp(value, QUEUE_OFF_VALUE) == 0) {
+        controller->queue_mode = QUEUE_OFF;
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(value, QUEUE_CPUS_VALUE) == 0) {
+        controller->queue_mode = QUEUE_CPUS;
+        return EXIT_SUCCESS;
+    }
+
+    char *end = NULL;
+    long limit = strtol(value, &end, 10);
+    if (!isdigit(*value) || *end != END || limit <= 0 || limit >= JOB_LIMIT) {
+        return BAD_RESULT;
+    }
+
+    controller->queue_mode = QUEUE_FIXED;
+    controller->max_running = (int) limit;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A new background job may start at once if there is a free slot and no
+ * queued job is ahead of it.
+ */
+int job_controller_admits(JobController const *controller) {
+    int limit = job_controller_limit(controller);
+    if (!limit) {
+        return TRUE;
+    }
+
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        if (controller->jobs[index]->status & JOB_QUEUED) {
+            return FALSE;
+        }
+    }
+
+    return job_controller_running(controller) < limit;
+}
+
+/*
+ * Starts queued jobs while there are free slots: the job with the lowest
+ * nice value first, jobs with the same value in the order they were queued.
+ */
+void job_controller_schedule(JobController *controller) {
+    int limit = job_controller_limit(controller);
+    int running = job_controller_running(controller);
+    while (!limit || running < limit) {
+        Job *next = NULL;
+        size_t index;
+        for (index = 0; index < controller->number_of_jobs; ++index) {
+            Job *current_job = controller->jobs[index];
+            if (!(current_job->status & JOB_QUEUED)) {
+                continue;
+            }
+
+            if (!next || job_priority(current_job) < job_priority(next)) {
+                next = current_job;
+            }
+        }
+
+        if (!next) {
+            return;
+        }
+
+        job_release(next);
+        ++running;
+    }
+}
+
+void job_controller_print_queue(JobController const *controller, FILE *file) {
+    size_t queued = 0;
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        if (controller->jobs[index]->status & JOB_QUEUED) {
+            ++queued;
+        }
+    }
+
+    int limit = job_controller_limit(controller);
+    if (limit) {
+        fprintf(file, "limit %d", limit);
+    } else {
+        fprintf(file, "limit %s", QUEUE_OFF_VALUE);
+    }
+
+    fprintf(file, ", running %d, queued %zu\n",
+            job_controller_running(controller), queued);
+}
+
+/*
+ * A dependency fails if it exits with a non-zero status, is skipped or is
+ * killed before it finishes. Dependencies that are no longer in the table
+ * have left their result in the job.
+ */
+int job_controller_dependencies(JobController *controller, Job const *job) {
+    char failed = job->depends_failed;
+    size_t index;
+    for (index = 0; index < job->depends_count; ++index) {
+        if (!job->depends[index]) {
+            continue;
+        }
+
+        jid_t jid = job->depends[index];
+        size_t job_index = job_controller_search_job_by_jid(controller, jid);
+        if (job_index >= controller->number_of_jobs) {
+            continue;
+        }
+
+        Job const *dependency = controller->jobs[job_index];
+        if (!job_is_finished(dependency)) {
+            return DEPENDENCIES_PENDING;
+        }
+
+        if (job_status_code(dependency->exit_status) != EXIT_SUCCESS) {
+            failed = TRUE;
+        }
+    }
+
+    return failed ? DEPENDENCIES_FAILED : DEPENDENCIES_SUCCEEDED;
+}
+
+/*
+ * Whether a job that is no longer in the table failed, like a dependency,
+ * or BAD_RESULT if nothing is kept for the jid.
+ */
+int job_controller_result(JobController const *controller, jid_t jid) {
+    size_t index;
+    for (index = 0; index < controller->results_count; ++index) {
+        if (controller->results[index].jid == jid) {
+            return controller->results[index].failed;
+        }
+    }
+
+    return BAD_RESULT;
+}
+
+/*
+ * Collects the state changes of all jobs without reporting them, they are
+ * reported by job_controller_print_current_status.
+ */
+void job_controller_update(JobController *controller) {
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        job_reap(controller->jobs[index]);
+    }
+}
+
 int job_controller_remove_job_by_index(JobController *controller,
                                        size_t index) {
     Job *current_job = controller->jobs[index];
+    job_controller_resolve(controller, current_job);
+    job_controller_keep_result(controller, current_job);
 
     size_t last_index = (size_t) (controller->number_of_jobs - 1);
     memmove(controller->jobs + index, controller->jobs + index + 1,
@@ -81,7 +322,7 @@ int job_controller_release(JobController *controller) {
     size_t index;
     for (index = 0; index < controller->number_of_jobs; ++index) {
         Job *current_job = controller->jobs[index];
-        killpg(current_job->pid, SIGHUP);
+        job_killpg(current_job, SIGHUP);
     }
 
     if (controller->number_of_jobs) {
@@ -91,11 +332,35 @@ int job_controller_release(JobController *controller) {
     return EXIT_SUCCESS;
 }
 
-void job_controller_print_all_jobs(JobController *controller) {
+void job_controller_print_all_jobs(JobController *controller, char format) {
+    if (format == JOBS_JSON) {
+        printf("[");
+    }
+
     size_t index;
     for (index = 0; index < controller->number_of_jobs; ++index) {
         Job *current_job = controller->jobs[index];
-        job_print(current_job, stdout, "");
+        switch (format) {
+            case JOBS_JSON:
+                if (index) {
+                    printf(",");
+                }
+
+                job_print_json(current_job, controller->job_control
+                                            ? current_job->pid
+                                            : getpgrp(), stdout);
+                break;
+            case JOBS_LONG:
+                job_print_long(current_job, stdout);
+                break;
+            default:
+                job_print(current_job, stdout, "");
+                break;
+        }
+    }
+
+    if (format == JOBS_JSON) {
+        printf("]\n");
     }
 }
 
@@ -103,21 +368,18 @@ void job_controller_print_current_status(JobController *controller) {
     size_t index;
     for (index = 0; index < controller->number_of_jobs; ++index) {
         Job *current_job = controller->jobs[index];
-
-        int status;
-        pid_t answer = waitpid(-current_job->pid, &status, WNOHANG | WUNTRACED);
-        while (answer != 0 && answer != BAD_RESULT) {
-            --current_job->count;
-            answer = waitpid(-current_job->pid, &status, WNOHANG | WUNTRACED);
+        job_reap(current_job);
+        if (!current_job->notify) {
+            continue;
         }
 
-        if (answer == 0) {
-            continue;
+        current_job->notify = FALSE;
+
+        if (controller->job_control) {
+            job_print(current_job, stdout, "\n");
         }
 
-        job_set_status(current_job, status);
-        job_print(current_job, stdout, "\n");
-        if (WIFEXITED(status)) {
+        if (job_is_finished(current_job)) {
             job_controller_remove_job_by_index(controller, index);
             --index;
         }
@@ -135,3 +397,126 @@ size_t job_controller_search_job_by_jid(JobController *controller, jid_t jid) {
 
     return (size_t) controller->number_of_jobs + 1;
 }
+
+size_t job_controller_search_job_by_pid(JobController *controller, pid_t pid) {
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        Job *current_job = controller->jobs[index];
+
+        size_t pid_index;
+        for (pid_index = 0; pid_index < current_job->pids_count; ++pid_index) {
+            if (current_job->pids[pid_index] == pid) {
+                return index;
+            }
+        }
+    }
+
+    return (size_t) controller->number_of_jobs + 1;
+}
+
+/*
+ * Hands the result of a job that leaves the table to the deferred jobs
+ * waiting for it.
+ */
+static void job_controller_resolve(JobController *controller, Job const *job) {
+    char failed = job_controller_failed(job);
+
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        Job *current_job = controller->jobs[index];
+        if (!(current_job->status & JOB_DEFERRED)) {
+            continue;
+        }
+
+        size_t depend_index;
+        for (depend_index = 0; depend_index < current_job->depends_count;
+             ++depend_index) {
+            if (current_job->depends[depend_index] == job->jid) {
+                current_job->depends[depend_index] = 0;
+                current_job->depends_failed |= failed;
+            }
+        }
+    }
+}
+
+static char job_controller_failed(Job const *job) {
+    return (char) (!job_is_finished(job)
+                   || job_status_code(job->exit_status) != EXIT_SUCCESS);
+}
+
+static int job_controller_limit(JobController const *controller) {
+    switch (controller->queue_mode) {
+        case QUEUE_FIXED:
+            return controller->max_running;
+        case QUEUE_CPUS: {
+            cpu_set_t cpus;
+            if (sched_getaffinity(0, sizeof(cpus), &cpus) == BAD_RESULT) {
+                return (int) sysconf(_SC_NPROCESSORS_ONLN);
+            }
+
+            return CPU_COUNT(&cpus);
+        }
+        default:
+            return 0;
+    }
+}
+
+static int job_controller_running(JobController const *controller) {
+    int running = 0;
+    size_t index;
+    for (index = 0; index < controller->number_of_jobs; ++index) {
+        if (controller->jobs[index]->status & JOB_RUNNING) {
+            ++running;
+        }
+    }
+
+    return running;
+}
+
+static void job_controller_append(JobController *controller, Job *job) {
+    if ((size_t) controller->number_of_jobs + 1 >= controller->jobs_capacity) {
+        size_t capacity = controller->jobs_capacity * 2;
+        Job **jobs = realloc(controller->jobs, capacity * sizeof(Job *));
+        check_memory(jobs);
+        memset(jobs + controller->jobs_capacity, 0,
+               (capacity - controller->jobs_capacity) * sizeof(Job *));
+        controller->jobs = jobs;
+        controller->jobs_capacity = capacity;
+    }
+
+    controller->jobs[controller->number_of_jobs++] = job;
+    job_controller_forget_result(controller, job->jid);
+}
+
+/*
+ * The oldest result makes room for a new one when all are kept.
+ */
+static void job_controller_keep_result(JobController *controller,
+                                       Job const *job) {
+    job_controller_forget_result(controller, job->jid);
+    if (controller->results_count == JOB_RESULTS_LIMIT) {
+        job_controller_forget_result(controller, controller->results[0].jid);
+    }
+
+    JobResult *result = &controller->results[controller->results_count++];
+    result->jid = job->jid;
+    result->failed = job_controller_failed(job);
+}
+
+static void job_controller_forget_result(JobController *controller, jid_t jid) {
+    size_t index;
+    for (index = 0; index < controller->results_count; ++index) {
+        if (controller->results[index].jid == jid) {
+            --controller->results_count;
+            memmove(controller->results + index,
+                    controller->results + index + 1,
+                    (controller->results_count - index) * sizeof(JobResult));
+            return;
+        }
+    }
+}
+
+static int job_priority(Job const *job) {
+    Scheduling const *scheduling = &job->command->scheduling;
+    return scheduling->mask & SCHEDULING_NICE ? scheduling->nice : 0;
+}
@@ -13,11 +13,55 @@
 
 #define JOB_LIMIT 32
 
+#define STATUS_UNSET (-1)
 
+#define JOBS_SHORT 0
+#define JOBS_LONG 1
+#define JOBS_JSON 2
+
+#define QUEUE_OFF 0
+#define QUEUE_FIXED 1
+#define QUEUE_CPUS 2
+
+#define QUEUE_ENV "SHELL_MAX_JOBS"
+#define QUEUE_CPUS_VALUE "cpus"
+#define QUEUE_OFF_VALUE "off"
+
+#define JOB_RESULTS_LIMIT JOB_LIMIT
+
+#define DEPENDENCIES_PENDING 0
+#define DEPENDENCIES_SUCCEEDED 1
+#define DEPENDENCIES_FAILED 2
+
+
+/*
+ * Whether a job that has left the table failed, kept for "after" until its
+ * jid is given to a new job.
+ */
+struct JobResult_St {
+    jid_t jid;
+    char failed;
+};
+
+typedef struct JobResult_St JobResult;
+
+/*
+ * Queued jobs don't count towards JOB_LIMIT, so the table grows past it
+ * when they are many. interrupted tells whether ^C ended the last foreground
+ * command, which a last status of 130 does not.
+ */
 struct JobController_St {
-    Job *jobs[JOB_LIMIT];
+    Job **jobs;
+    size_t jobs_capacity;
+    JobResult results[JOB_RESULTS_LIMIT];
+    size_t results_count;
     jid_t current_max_jid;
     int number_of_jobs;
+    int last_status;
+    char interrupted;
+    char job_control;
+    char queue_mode;
+    int max_running;
 };
 
 typedef struct JobController_St JobController;
@@ -37,18 +81,44 @@ jid_t job_controller_add_job(JobController *controller,
                              char status);
 
 jid_t job_controller_add_conveyor(JobController *controller,
-                                  pid_t pid,
-                                  Command const *command,
+                                  pid_t const *pids,
+                                  Command const *commands,
                                   char status,
                                   size_t job_count);
 
+jid_t job_controller_add_deferred(JobController *controller,
+                                  Command const *command,
+                                  jid_t const *depends,
+                                  size_t depends_count,
+                                  char condition);
+
+int job_controller_has_pending(JobController const *controller);
+
+int job_controller_is_full(JobController const *controller);
+
+int job_controller_set_queue(JobController *controller, char const *value);
+
+int job_controller_admits(JobController const *controller);
+
+void job_controller_schedule(JobController *controller);
+
+void job_controller_print_queue(JobController const *controller, FILE *file);
+
+int job_controller_dependencies(JobController *controller, Job const *job);
+
+int job_controller_result(JobController const *controller, jid_t jid);
+
+void job_controller_update(JobController *controller);
+
 int job_controller_remove_job_by_index(JobController *controller, size_t index);
 
 size_t job_controller_search_job_by_jid(JobController *controller, jid_t jid);
 
+size_t job_controller_search_job_by_pid(JobController *controller, pid_t pid);
+
 void job_controller_print_current_status(JobController *controller);
 
-void job_controller_print_all_jobs(JobController *controller);
+void job_controller_print_all_jobs(JobController *controller, char format);
 
 
 #endif //JOB_CONTROL_H
@@ -0,0 +1,587 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "merge.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+
+#define MERGE_PREFIX_MAX 64
+#define MERGE_FILE_MODE 0644
+#define MERGE_DRAIN_ROUNDS 16
+
+
+struct MergeRing_St {
+    char used;
+    int jid;
+    char *data;
+    size_t size;
+    size_t start;
+    size_t len;
+    unsigned long long total;
+};
+
+typedef struct MergeRing_St MergeRing;
+
+struct MergeStream_St {
+    char used;
+    int jid;
+    int fd;
+    int output;
+    char flags;
+    char closed;
+    MergeRing *ring;
+    char line[MERGE_LINE_MAX];
+    size_t line_len;
+    size_t ready;
+};
+
+typedef struct MergeStream_St MergeStream;
+
+
+/*
+ * The shell's ends of the pipes of captured jobs, all in one epoll set. A
+ * stream keeps the start of a line until its end arrives, so only whole
+ * lines are written, each batch with one write. A forked subshell inherits
+ * the table but leaves the streams to the shell that owns them.
+ */
+static pid_t owner = BAD_RESULT;
+static MergeStream *streams = NULL;
+static size_t streams_count = 0;
+static int epoll_fd = BAD_RESULT;
+static char batch[MERGE_LINE_MAX * 2];
+
+/*
+ * A job captured into a ring keeps only the last bytes of its output, in
+ * memory, and nothing reaches the terminal, so neither a slow terminal nor
+ * a stopped shell can hold it up. The ring outlives the job until its jid
+ * is given to another job.
+ */
+static MergeRing rings[MERGE_STREAMS];
+static int last_ring = BAD_RESULT;
+
+
+static void merge_init();
+
+static MergeStream *merge_find(int jid);
+
+static int merge_open_output(MergeStream *stream, MergeOptions const *options);
+
+static MergeRing *merge_ring_find(int jid);
+
+static MergeRing *merge_ring_open(int jid, size_t size);
+
+static void merge_ring_put(MergeRing *ring, char const *data, size_t size);
+
+static void merge_ring_free(MergeRing *ring);
+
+static int merge_collect();
+
+static void merge_read(MergeStream *stream);
+
+static void merge_flush(MergeStream *stream);
+
+static void merge_write(MergeStream *stream, char const *data, size_t size);
+
+static int merge_output(MergeStream *stream, char const *data, size_t size);
+
+static size_t merge_prefix(MergeStream const *stream, char *prefix, size_t size);
+
+static void merge_close(MergeStream *stream);
+
+
+/*
+ * Takes the read end of the pipe the job writes its output and errors to.
+ * The lines go to a copy of the shell's stdout made now, so a redirect the
+ * shell applies later for one of its own commands doesn't take them. On
+ * failure the pipe is closed, so the job gets SIGPIPE.
+ */
+int merge_attach(int jid, int fd, MergeOptions const *options) {
+    merge_init();
+    MergeStream *stream = NULL;
+    size_t index;
+    for (index = 0; index < MERGE_STREAMS && !stream; ++index) {
+        if (!streams[index].used) {
+            stream = &streams[index];
+        }
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = stream;
+    int output = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (!stream || epoll_fd == BAD_RESULT || output == BAD_RESULT
+        || fcntl(fd, F_SETFL, O_NONBLOCK) == BAD_RESULT
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == BAD_RESULT) {
+        fprintf(stderr, "shell: merge: [%d]: couldn't capture the output\n",
+                jid);
+        if (output != BAD_RESULT) {
+            close(output);
+        }
+
+        close(fd);
+        return BAD_RESULT;
+    }
+
+    stream->used = TRUE;
+    stream->jid = jid;
+    stream->fd = fd;
+    stream->output = output;
+    stream->closed = FALSE;
+    stream->ring = NULL;
+    stream->line_len = 0;
+    stream->ready = 0;
+    ++streams_count;
+    return merge_open_output(stream, options);
+}
+
+/*
+ * Changes where the lines of a captured job go and how they are prefixed.
+ */
+int merge_update(int jid, MergeOptions const *options) {
+    MergeStream *stream = merge_find(jid);
+    return stream ? merge_open_output(stream, options) : BAD_RESULT;
+}
+
+int merge_is_open(int jid) {
+    return merge_find(jid) != NULL;
+}
+
+int merge_fd() {
+    return streams_count && owner == getpid() ? epoll_fd : BAD_RESULT;
+}
+
+/*
+ * Reads what the captured jobs have written, without blocking on them.
+ * Lines for rings are stored at once. Returns TRUE if whole lines are ready
+ * for merge_drain, so the prompt can make room for them first.
+ */
+int merge_poll() {
+    merge_collect();
+
+    char ready = FALSE;
+    size_t index;
+    for (index = 0; merge_fd() != BAD_RESULT && index < MERGE_STREAMS;
+         ++index) {
+        MergeStream *stream = &streams[index];
+        if (!stream->used || (!stream->ready && !stream->closed)) {
+            continue;
+        }
+
+        if (stream->ring) {
+            merge_flush(stream);
+        } else {
+            ready = TRUE;
+        }
+    }
+
+    return ready;
+}
+
+/*
+ * Writes out everything the captured jobs have written so far, without
+ * blocking on them. A stream whose job has closed it is flushed and
+ * dropped. A job that keeps writing is left for the next call after a few
+ * rounds, so it can't hold the shell.
+ */
+void merge_drain() {
+    if (merge_fd() == BAD_RESULT) {
+        return;
+    }
+
+    size_t round = 0;
+    do {
+        size_t index;
+        for (index = 0; index < MERGE_STREAMS; ++index) {
+            if (streams[index].used) {
+                merge_flush(&streams[index]);
+            }
+        }
+    } while (++round < MERGE_DRAIN_ROUNDS && merge_collect() > 0);
+}
+
+/*
+ * Parses a ring size: bytes, or with a K, M or G suffix.
+ */
+int merge_parse_size(char const *str, size_t *size) {
+    if (!isdigit(*str)) {
+        return BAD_RESULT;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long number = strtoull(str, &end, 10);
+    unsigned long long multiplier = 1;
+    switch (toupper(*end)) {
+        case END:
+            break;
+        case 'K':
+            multiplier = 1ULL << 10;
+            break;
+        case 'M':
+            multiplier = 1ULL << 20;
+            break;
+        case 'G':
+            multiplier = 1ULL << 30;
+            break;
+        default:
+            return BAD_RESULT;
+    }
+
+    if (errno || (*end != END && end[1] != END) || !number
+        || number > MERGE_RING_MAX / multiplier) {
+        return BAD_RESULT;
+    }
+
+    *size = (size_t) (number * multiplier);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Drops the ring kept for an earlier job with the jid, which is given to a
+ * new job.
+ */
+void merge_forget(int jid) {
+    MergeRing *ring = merge_ring_find(jid);
+    if (ring) {
+        merge_ring_free(ring);
+    }
+}
+
+/*
+ * Returns the jid of the job last captured into a ring, or BAD_RESULT.
+ */
+int merge_ring_last() {
+    return merge_ring_find(last_ring) ? last_ring : BAD_RESULT;
+}
+
+/*
+ * Returns the number of bytes the job has written into its ring so far, or
+ * BAD_RESULT if it has none.
+ */
+long long merge_ring_total(int jid) {
+    MergeRing *ring = merge_ring_find(jid);
+    return ring ? (long long) ring->total : BAD_RESULT;
+}
+
+/*
+ * Writes the ring of the job from the offset, counted from the start of its
+ * output, and moves the offset past what was written. Bytes already
+ * overwritten are skipped and counted in skipped. A limit other than zero
+ * caps the bytes written. Returns their number, or BAD_RESULT.
+ */
+ssize_t merge_ring_copy(int jid,
+                        int output,
+                        unsigned long long *offset,
+                        size_t limit,
+                        unsigned long long *skipped) {
+    MergeRing *ring = merge_ring_find(jid);
+    if (!ring) {
+        return BAD_RESULT;
+    }
+
+    unsigned long long oldest = ring->total - ring->len;
+    *skipped = *offset < oldest ? oldest - *offset : 0;
+    if (*offset < oldest) {
+        *offset = oldest;
+    }
+
+    size_t len = (size_t) (ring->total - *offset);
+    if (limit && len > limit) {
+        len = limit;
+    }
+
+    size_t position = (ring->start + (size_t) (*offset - oldest)) % ring->size;
+    size_t first = len < ring->size - position ? len : ring->size - position;
+    if (stream_write_all(output, ring->data + position, first) == BAD_RESULT
+        || stream_write_all(output, ring->data, len - first) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    *offset += len;
+    return (ssize_t) len;
+}
+
+static void merge_init() {
+    if (streams && owner == getpid()) {
+        return;
+    }
+
+    if (streams) {
+        size_t index;
+        for (index = 0; index < MERGE_STREAMS; ++index) {
+            if (streams[index].used) {
+                merge_close(&streams[index]);
+            }
+        }
+
+        close(epoll_fd);
+    } else {
+        streams = calloc(MERGE_STREAMS, sizeof(MergeStream));
+        check_memory(streams);
+    }
+
+    owner = getpid();
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == BAD_RESULT) {
+        perror("Couldn't create epoll instance");
+    }
+}
+
+static MergeStream *merge_find(int jid) {
+    if (merge_fd() == BAD_RESULT) {
+        return NULL;
+    }
+
+    size_t index;
+    for (index = 0; index < MERGE_STREAMS; ++index) {
+        if (streams[index].used && streams[index].jid == jid) {
+            return &streams[index];
+        }
+    }
+
+    return NULL;
+}
+
+static int merge_open_output(MergeStream *stream, MergeOptions const *options) {
+    stream->flags = options->flags;
+    if (options->ring) {
+        stream->ring = merge_ring_open(stream->jid, options->ring);
+    }
+
+    if (!options->file) {
+        return EXIT_SUCCESS;
+    }
+
+    int output = open(options->file,
+                      O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                      (mode_t) MERGE_FILE_MODE);
+    if (output == BAD_RESULT) {
+        fprintf(stderr, "shell: merge: %s: %s\n", options->file,
+                strerror(errno));
+        return BAD_RESULT;
+    }
+
+    close(stream->output);
+    stream->output = output;
+    return EXIT_SUCCESS;
+}
+
+static MergeRing *merge_ring_find(int jid) {
+    size_t index;
+    for (index = 0; jid != BAD_RESULT && index < MERGE_STREAMS; ++index) {
+        if (rings[index].used && rings[index].jid == jid) {
+            return &rings[index];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Gives the job a new ring. The ring of a finished job makes room if all
+ * are taken; an open stream always has one, as there are as many rings as
+ * streams.
+ */
+static MergeRing *merge_ring_open(int jid, size_t size) {
+    merge_forget(jid);
+
+    MergeRing *ring = NULL;
+    size_t index;
+    for (index = 0; index < MERGE_STREAMS && !ring; ++index) {
+        if (!rings[index].used) {
+            ring = &rings[index];
+        }
+    }
+
+    for (index = 0; index < MERGE_STREAMS && !ring; ++index) {
+        if (!merge_is_open(rings[index].jid)) {
+            ring = &rings[index];
+            merge_ring_free(ring);
+        }
+    }
+
+    ring->data = malloc(size);
+    check_memory(ring->data);
+    ring->used = TRUE;
+    ring->jid = jid;
+    ring->size = size;
+    ring->start = 0;
+    ring->len = 0;
+    ring->total = 0;
+    last_ring = jid;
+    return ring;
+}
+
+/*
+ * Appends to the ring; when it is full the oldest bytes are overwritten.
+ */
+static void merge_ring_put(MergeRing *ring, char const *data, size_t size) {
+    ring->total += size;
+    if (size >= ring->size) {
+        memcpy(ring->data, data + size - ring->size, ring->size);
+        ring->start = 0;
+        ring->len = ring->size;
+        return;
+    }
+
+    size_t end = (ring->start + ring->len) % ring->size;
+    size_t first = size < ring->size - end ? size : ring->size - end;
+    memcpy(ring->data + end, data, first);
+    memcpy(ring->data, data + first, size - first);
+
+    ring->len += size;
+    if (ring->len > ring->size) {
+        ring->start = (ring->start + ring->len - ring->size) % ring->size;
+        ring->len = ring->size;
+    }
+}
+
+static void merge_ring_free(MergeRing *ring) {
+    size_t index;
+    for (index = 0; streams && index < MERGE_STREAMS; ++index) {
+        if (streams[index].ring == ring) {
+            streams[index].ring = NULL;
+        }
+    }
+
+    free(ring->data);
+    ring->data = NULL;
+    ring->used = FALSE;
+}
+
+static int merge_collect() {
+    if (merge_fd() == BAD_RESULT) {
+        return 0;
+    }
+
+    struct epoll_event events[MERGE_STREAMS];
+    int count = epoll_wait(epoll_fd, events, MERGE_STREAMS, 0);
+    int index;
+    for (index = 0; index < count; ++index) {
+        merge_read(events[index].data.ptr);
+    }
+
+    return count;
+}
+
+/*
+ * Appends to the line buffer. Everything up to its last newline is ready;
+ * a buffer full of one line, or the rest after the end of the stream, is
+ * ready as it is.
+ */
+static void merge_read(MergeStream *stream) {
+    size_t free_space = sizeof(stream->line) - stream->line_len;
+    if (stream->closed || !free_space) {
+        return;
+    }
+
+    ssize_t number_of_read = read(stream->fd, stream->line + stream->line_len,
+                                  free_space);
+    if (number_of_read == BAD_RESULT
+        && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (number_of_read <= 0) {
+        stream->closed = TRUE;
+        stream->ready = stream->line_len;
+        return;
+    }
+
+    stream->line_len += (size_t) number_of_read;
+    char const *end = memrchr(stream->line, '\n', stream->line_len);
+    stream->ready = end ? (size_t) (end - stream->line) + 1 : 0;
+    if (stream->line_len == sizeof(stream->line)) {
+        stream->ready = stream->line_len;
+    }
+}
+
+static void merge_flush(MergeStream *stream) {
+    if (stream->ready) {
+        merge_write(stream, stream->line, stream->ready);
+        memmove(stream->line, stream->line + stream->ready,
+                stream->line_len - stream->ready);
+        stream->line_len -= stream->ready;
+        stream->ready = 0;
+    }
+
+    if (stream->closed) {
+        merge_close(stream);
+    }
+}
+
+/*
+ * Writes lines, each with its prefix. An unfinished last line gets a
+ * newline of its own.
+ */
+static void merge_write(MergeStream *stream, char const *data, size_t size) {
+    char prefix[MERGE_PREFIX_MAX];
+    size_t prefix_len = merge_prefix(stream, prefix, sizeof(prefix));
+    size_t batch_len = 0;
+    while (size) {
+        char const *end = memchr(data, '\n', size);
+        size_t line_len = end ? (size_t) (end - data) + 1 : size;
+        if (batch_len + prefix_len + line_len + 1 > sizeof(batch)) {
+            merge_output(stream, batch, batch_len);
+            batch_len = 0;
+        }
+
+        memcpy(batch + batch_len, prefix, prefix_len);
+        memcpy(batch + batch_len + prefix_len, data, line_len);
+        batch_len += prefix_len + line_len;
+        if (!end) {
+            batch[batch_len++] = '\n';
+        }
+
+        data += line_len;
+        size -= line_len;
+    }
+
+    if (batch_len && merge_output(stream, batch, batch_len) == BAD_RESULT) {
+        perror("shell: merge");
+    }
+}
+
+static int merge_output(MergeStream *stream, char const *data, size_t size) {
+    if (stream->ring) {
+        merge_ring_put(stream->ring, data, size);
+        return EXIT_SUCCESS;
+    }
+
+    return stream_write_all(stream->output, data, size);
+}
+
+static size_t merge_prefix(MergeStream const *stream, char *prefix, size_t size) {
+    size_t len = 0;
+    if (stream->flags & MERGE_PREFIX) {
+        len += (size_t) snprintf(prefix, size, "[%d] ", stream->jid);
+    }
+
+    if (stream->flags & MERGE_TIME) {
+        struct timespec now;
+        struct tm local;
+        clock_gettime(CLOCK_REALTIME, &now);
+        localtime_r(&now.tv_sec, &local);
+        len += strftime(prefix + len, size - len, "%H:%M:%S", &local);
+        len += (size_t) snprintf(prefix + len, size - len, ".%03ld ",
+                                 now.tv_nsec / 1000000);
+    }
+
+    return len;
+}
+
+static void merge_close(MergeStream *stream) {
+    close(stream->fd);
+    close(stream->output);
+
+    stream->used = FALSE;
+    --streams_count;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef MERGE_H
+#define MERGE_H
+
+
+#include "shell.h"
+
+
+#define MERGE_PREFIX 1
+#define MERGE_TIME 2
+
+#define MERGE_STREAMS 32
+#define MERGE_LINE_MAX (1 << 16)
+#define MERGE_RING_MAX (1 << 30)
+
+
+struct MergeOptions_St {
+    char capture;
+    char flags;
+    char *file;
+    size_t ring;
+};
+
+typedef struct MergeOptions_St MergeOptions;
+
+
+int merge_attach(int jid, int fd, MergeOptions const *options);
+
+int merge_update(int jid, MergeOptions const *options);
+
+int merge_is_open(int jid);
+
+int merge_fd();
+
+int merge_poll();
+
+void merge_drain();
+
+int merge_parse_size(char const *str, size_t *size);
+
+void merge_forget(int jid);
+
+int merge_ring_last();
+
+long long merge_ring_total(int jid);
+
+ssize_t merge_ring_copy(int jid,
+                        int output,
+                        unsigned long long *offset,
+                        size_t limit,
+                        unsigned long long *skipped);
+
+
+#endif //MERGE_H
@@ -8,6 +8,8 @@
 
 #define PRINT_SYNTAX_ERROR(token) fprintf(stderr, "shell: syntax error near unexpected token '%s'\n", token)
 
+#define PRINT_SYNTAX_GROUP_ERROR(token) fprintf(stderr, "shell: syntax error: missing '%s'\n", token)
+
 #define PRINT_SYNTAX_PIPELINE_ERROR(token) fprintf(stderr, "shell: syntax error in pipeline near token '%s'\n", token)
 
 
@@ -19,6 +21,8 @@ static int parse_redirect_output(char **data, Command *command);
 
 static int parse_redirect_input(char **data, Command *command);
 
+static int parse_redirect_target(char **data, char **target, char const *token);
+
 static int parse_background(char **data,
                             CommandLine *command_line,
                             size_t *current_index_of_command,
@@ -33,19 +37,35 @@ static int parse_separator(char **data,
                            size_t *current_index_of_command,
                            size_t *current_index_of_arguments);
 
+static int parse_connector(char **data,
+                           CommandLine *command_line,
+                           size_t *current_index_of_command,
+                           size_t *current_index_of_arguments,
+                           char connector);
+
 static int parse_add_command(char **data,
+                             CommandLine *command_line,
                              Command *current_command,
                              const size_t *current_index_of_command,
                              size_t *current_index_of_arguments,
                              size_t *number_of_command);
 
+static int parse_group(char **data,
+                       CommandLine *command_line,
+                       Command *command,
+                       size_t *current_index_of_arguments);
+
+static char *find_group_end(char *data, char group);
+
+static int is_group_token(char const *data, char const *begin, char token);
+
 static int parse_tokens(char **data,
                         CommandLine *command_line,
                         size_t *current_index_of_command,
                         size_t *current_index_of_arguments,
                         size_t *number_of_command);
 
-static void go_to_next_delimiter(char **data);
+static int go_to_next_delimiter(char **data);
 
 static void set_end(char **data);
 
@@ -96,6 +116,65 @@ ssize_t parse_input_line(char *input_data, CommandLine *command_line) {
     return result_number_of_command;
 }
 
+/*
+ * Splits the body of a fan-out, without its braces, into consumers at the
+ * commas that end a word outside nested groups. Returns the number of
+ * consumers, or BAD_SYNTAX if one of them is empty.
+ */
+ssize_t parse_fanout(char *body, char **consumers, size_t max) {
+    size_t count = 0;
+    size_t depth = 0;
+    char *begin = body;
+    char *data;
+    for (data = body;; ++data) {
+        char separator = depth == 0 && *data == TOKEN_FANOUT_SEPARATOR
+                         && (is_end(data + 1) || isspace(data[1]));
+        if (!is_end(data) && !separator) {
+            if (*data == TOKEN_SUBSHELL_OPEN
+                || is_group_token(data, body, TOKEN_GROUP_OPEN)) {
+                ++depth;
+            } else if (depth && (*data == TOKEN_SUBSHELL_CLOSE
+                                 || is_group_token(data, body,
+                                                   TOKEN_GROUP_CLOSE))) {
+                --depth;
+            }
+
+            continue;
+        }
+
+        if (blank_skip(begin) == data) {
+            PRINT_SYNTAX_ERROR(TOKEN_FANOUT_SEPARATOR_STR);
+            return BAD_SYNTAX;
+        }
+
+        if (count == max) {
+            fprintf(stderr, "shell: number of commands (%d) exceeded\n",
+                    MAX_COMMANDS);
+            return BAD_SYNTAX;
+        }
+
+        consumers[count++] = begin;
+        if (!separator) {
+            return count;
+        }
+
+        *data = END;
+        begin = data + 1;
+    }
+}
+
+/*
+ * Returns the closing bracket or backquote of the command substitution
+ * starting at data, or NULL if it is not closed. Backquotes do not nest.
+ */
+char *parse_substitution_end(char *data) {
+    if (*data == TOKEN_BACKQUOTE) {
+        return strchr(data + 1, TOKEN_BACKQUOTE);
+    }
+
+    return find_group_end(data + 1, GROUP_SUBSHELL);
+}
+
 static int check_command_line(CommandLine *command_line,
                               size_t command_amount) {
     if (command_amount == 0) {
@@ -115,6 +194,14 @@ static int check_command_line(CommandLine *command_line,
         return BAD_SYNTAX;
     }
 
+    char connector = command_line->commands[command_amount - 1].connector;
+    if (connector != CONNECT_NONE) {
+        PRINT_SYNTAX_ERROR(connector == CONNECT_AND
+                           ? TOKEN_AND_STR
+                           : TOKEN_OR_STR);
+        return BAD_SYNTAX;
+    }
+
     return SUCCESS;
 }
 
@@ -142,7 +229,7 @@ static int parse_tokens(char **data,
             return parse_pipeline(data, command_line, current_index_of_command,
                                   current_index_of_arguments);
         default:
-            return parse_add_command(data, current_command,
+            return parse_add_command(data, command_line, current_command,
                                      current_index_of_command,
                                      current_index_of_arguments,
                                      number_of_command);
@@ -175,27 +262,55 @@ static int parse_pipeline(char **data,
                           CommandLine *command_line,
                           size_t *current_index_of_command,
                           size_t *current_index_of_arguments) {
+    if ((*data)[1] == TOKEN_PIPELINE) {
+        return parse_connector(data, command_line, current_index_of_command,
+                               current_index_of_arguments, CONNECT_OR);
+    }
+
+    char fanout = (*data)[1] == TOKEN_OUTFILE;
     if (*current_index_of_arguments == 0
         || *current_index_of_command + 1 == MAX_COMMANDS) {
-        PRINT_SYNTAX_ERROR(TOKEN_PIPELINE_STR);
+        PRINT_SYNTAX_ERROR(fanout ? TOKEN_FANOUT_STR : TOKEN_PIPELINE_STR);
         return BAD_SYNTAX;
     }
 
     command_line->commands[(*current_index_of_command)++].flag |= OUT_PIPE;
     command_line->commands[*current_index_of_command].flag |= IN_PIPE;
 
+    if (fanout) {
+        command_line->commands[*current_index_of_command].group = GROUP_FANOUT;
+        set_end(data);
+    }
+
     set_end(data);
     *current_index_of_arguments = 0;
     return SUCCESS;
 }
 
 static int parse_add_command(char **data,
+                             CommandLine *command_line,
                              Command *current_command,
                              const size_t *current_index_of_command,
                              size_t *current_index_of_arguments,
                              size_t *number_of_command) {
     if (*current_index_of_arguments == 0) {
         *number_of_command = *current_index_of_command + 1;
+        if (is_group_token(*data, *data, TOKEN_GROUP_OPEN)
+            || (**data == TOKEN_SUBSHELL_OPEN
+                && current_command->group != GROUP_FANOUT)) {
+            return parse_group(data, command_line, current_command,
+                               current_index_of_arguments);
+        }
+
+        if (current_command->group == GROUP_FANOUT) {
+            PRINT_SYNTAX_ERROR(TOKEN_FANOUT_STR);
+            return BAD_SYNTAX;
+        }
+    } else if (current_command->group != GROUP_NONE) {
+        char *word = *data;
+        go_to_next_delimiter(data);
+        PRINT_SYNTAX_ERROR(word);
+        return BAD_SYNTAX;
     }
 
     if (*current_index_of_arguments + 1 == MAX_ARGS) {
@@ -206,10 +321,99 @@ static int parse_add_command(char **data,
     current_command->arguments[(*current_index_of_arguments)++] = *data;
     current_command->arguments[(*current_index_of_arguments)] = (char *) NULL;
 
-    go_to_next_delimiter(data);
+    return go_to_next_delimiter(data);
+}
+
+/*
+ * The text of a group is kept whole, with its brackets, as the only argument
+ * of the command. It is parsed again when the group runs. The consumers of a
+ * fan-out are a brace group too, split at commas when the stage runs.
+ */
+static int parse_group(char **data,
+                       CommandLine *command_line,
+                       Command *command,
+                       size_t *current_index_of_arguments) {
+    char group = **data == TOKEN_SUBSHELL_OPEN ? GROUP_SUBSHELL : GROUP_BRACE;
+    char const *close = group == GROUP_SUBSHELL
+                        ? TOKEN_SUBSHELL_CLOSE_STR
+                        : TOKEN_GROUP_CLOSE_STR;
+
+    char *end = find_group_end(*data, group);
+    if (!end) {
+        PRINT_SYNTAX_GROUP_ERROR(close);
+        return BAD_SYNTAX;
+    }
+
+    char *body = blank_skip(*data + 1);
+    if (body == end) {
+        PRINT_SYNTAX_ERROR(close);
+        return BAD_SYNTAX;
+    }
+
+    size_t len = (size_t) (end - *data) + 1;
+    char *text = strndup(*data, len);
+    check_memory(text);
+
+    if (command->group == GROUP_FANOUT) {
+        char *consumers[MAX_COMMANDS];
+        char *fanout = strndup(*data + 1, len - 2);
+        check_memory(fanout);
+        ssize_t count = parse_fanout(fanout, consumers, MAX_COMMANDS);
+        free(fanout);
+        if (count == BAD_SYNTAX) {
+            free(text);
+            return BAD_SYNTAX;
+        }
+    } else {
+        command->group = group;
+    }
+
+    command->arguments[(*current_index_of_arguments)++] =
+            command_line_keep(command_line, text);
+    command->arguments[*current_index_of_arguments] = (char *) NULL;
+
+    *data = end + 1;
     return SUCCESS;
 }
 
+/*
+ * Braces are reserved words and count only as whole words, parentheses
+ * count anywhere. Returns the closing bracket of the group opened at data.
+ */
+static char *find_group_end(char *data, char group) {
+    char open = group == GROUP_SUBSHELL ? TOKEN_SUBSHELL_OPEN : TOKEN_GROUP_OPEN;
+    char close = group == GROUP_SUBSHELL
+                 ? TOKEN_SUBSHELL_CLOSE
+                 : TOKEN_GROUP_CLOSE;
+
+    char *begin = data;
+    size_t depth = 0;
+    for (; !is_end(data); ++data) {
+        if (group == GROUP_BRACE && !is_group_token(data, begin, *data)) {
+            continue;
+        }
+
+        if (*data == open) {
+            ++depth;
+        } else if (*data == close && --depth == 0) {
+            return data;
+        }
+    }
+
+    return NULL;
+}
+
+static int is_group_token(char const *data, char const *begin, char token) {
+    if (*data != token || (data != begin && !isspace(data[-1])
+                           && data[-1] != TOKEN_SEPARATOR)) {
+        return FALSE;
+    }
+
+    return is_end(data + 1) || isspace(data[1])
+           || (token == TOKEN_GROUP_CLOSE && strchr(delimiters, data[1]))
+           || (token == TOKEN_GROUP_CLOSE && data[1] == TOKEN_PIPELINE);
+}
+
 static int parse_separator(char **data,
                            size_t *current_index_of_command,
                            size_t *current_index_of_arguments) {
@@ -224,10 +428,34 @@ static int parse_separator(char **data,
     return SUCCESS;
 }
 
+static int parse_connector(char **data,
+                           CommandLine *command_line,
+                           size_t *current_index_of_command,
+                           size_t *current_index_of_arguments,
+                           char connector) {
+    if (*current_index_of_arguments == 0) {
+        PRINT_SYNTAX_ERROR(connector == CONNECT_AND
+                           ? TOKEN_AND_STR
+                           : TOKEN_OR_STR);
+        return BAD_SYNTAX;
+    }
+
+    command_line->commands[(*current_index_of_command)++].connector = connector;
+    *current_index_of_arguments = 0;
+    set_end(data);
+    set_end(data);
+    return SUCCESS;
+}
+
 static int parse_background(char **data,
                             CommandLine *command_line,
                             size_t *current_index_of_command,
                             size_t *current_index_of_arguments) {
+    if ((*data)[1] == TOKEN_BACKGROUND) {
+        return parse_connector(data, command_line, current_index_of_command,
+                               current_index_of_arguments, CONNECT_AND);
+    }
+
     if (*current_index_of_arguments == 0) {
         PRINT_SYNTAX_ERROR(TOKEN_BACKGROUND_STR);
         return BAD_SYNTAX;
@@ -248,39 +476,77 @@ static int parse_redirect_output(char **data, Command *command) {
     }
 
     set_end(data);
-    *data = blank_skip(*data);
-    if (is_end(*data)) {
-        PRINT_SYNTAX_ERROR(TOKEN_OUTFILE_STR);
+    if (parse_redirect_target(data, &command->outfile,
+                              TOKEN_OUTFILE_STR) != SUCCESS) {
         return BAD_SYNTAX;
     }
 
-    command->outfile = *data;
     command->flag |= OUT_FILE;
-
-    go_to_next_delimiter(data);
     return SUCCESS;
 }
 
 static int parse_redirect_input(char **data, Command *command) {
     set_end(data);
-    *data = blank_skip(*data);
-    if (is_end(*data)) {
-        PRINT_SYNTAX_ERROR(TOKEN_INFILE_STR);
+    if (parse_redirect_target(data, &command->infile,
+                              TOKEN_INFILE_STR) != SUCCESS) {
         return BAD_SYNTAX;
     }
 
-    command->infile = *data;
     command->flag |= IN_FILE;
-
-    go_to_next_delimiter(data);
     return SUCCESS;
 }
 
-static void go_to_next_delimiter(char **data) {
-    *data = strpbrk(*data, delimiters);
+/*
+ * A target starting with '&' names a descriptor, as in ">&3", and is kept
+ * with the '&' so the executor can tell it from a file name.
+ */
+static int parse_redirect_target(char **data, char **target, char const *token) {
+    *data = blank_skip(*data);
+    char *word = *data;
+    if (*word == REDIRECT_DUPLICATE) {
+        ++*data;
+    }
+
+    if (is_end(*data) || strchr(delimiters, **data)) {
+        PRINT_SYNTAX_ERROR(token);
+        return BAD_SYNTAX;
+    }
+
+    *target = word;
+    return go_to_next_delimiter(data);
+}
+
+/*
+ * A command substitution is a part of the word it is in, whatever it
+ * contains, so "$(a b; c)" and "`a b`" do not end the word.
+ */
+static int go_to_next_delimiter(char **data) {
+    char *word = *data;
+    while (!is_end(word) && !strchr(delimiters, *word)) {
+        if (strncmp(word, TOKEN_SUBSTITUTION_OPEN,
+                    strlen(TOKEN_SUBSTITUTION_OPEN)) == 0
+            || *word == TOKEN_BACKQUOTE) {
+            char *end = parse_substitution_end(word);
+            if (!end) {
+                *data = word + strlen(word);
+                PRINT_SYNTAX_GROUP_ERROR(*word == TOKEN_BACKQUOTE
+                                         ? TOKEN_BACKQUOTE_STR
+                                         : TOKEN_SUBSHELL_CLOSE_STR);
+                return BAD_SYNTAX;
+            }
+
+            word = end;
+        }
+
+        ++word;
+    }
+
+    *data = word;
     if (isspace(**data) && !is_end(*data)) {
         set_end(data);
     }
+
+    return SUCCESS;
 }
 
 static void set_end(char **data) {
@@ -289,5 +555,6 @@ static void set_end(char **data) {
 }
 
 static void reset_command_line(CommandLine *command_line) {
+    command_line_release(command_line);
     memset(command_line->commands, 0, sizeof(Command) * MAX_COMMANDS);
 }
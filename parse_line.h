@@ -25,11 +25,34 @@
 #define TOKEN_PIPELINE '|'
 #define TOKEN_PIPELINE_STR "|"
 
+#define TOKEN_FANOUT_STR "|>"
+#define TOKEN_FANOUT_SEPARATOR ','
+#define TOKEN_FANOUT_SEPARATOR_STR ","
+
 #define TOKEN_SEPARATOR ';'
 #define TOKEN_SEPARATOR_STR ";"
 
+#define TOKEN_GROUP_OPEN '{'
+#define TOKEN_GROUP_CLOSE '}'
+#define TOKEN_GROUP_CLOSE_STR "}"
+
+#define TOKEN_SUBSHELL_OPEN '('
+#define TOKEN_SUBSHELL_CLOSE ')'
+#define TOKEN_SUBSHELL_CLOSE_STR ")"
+
+#define TOKEN_SUBSTITUTION_OPEN "$("
+#define TOKEN_BACKQUOTE '`'
+#define TOKEN_BACKQUOTE_STR "`"
+
+#define TOKEN_AND_STR "&&"
+#define TOKEN_OR_STR "||"
+
 
 ssize_t parse_input_line(char *input_data, CommandLine *command_line);
 
+ssize_t parse_fanout(char *body, char **consumers, size_t max);
+
+char *parse_substitution_end(char *data);
+
 
 #endif //PARSE_LINE_H
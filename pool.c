@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "pool.h"
+
+
+union PoolItem_U {
+    union PoolItem_U *next;
+    long double float_align;
+    long long integer_align;
+};
+
+typedef union PoolItem_U PoolItem;
+
+
+static void pool_grow(Pool *pool);
+
+static size_t pool_item_size(Pool const *pool);
+
+
+/*
+ * Items are carved from slabs of POOL_SLAB_ITEMS and go back to a free list
+ * when released, so records of finished jobs are reused by the next ones.
+ * Slabs live as long as the shell.
+ */
+void *pool_alloc(Pool *pool) {
+    if (!pool->free_items) {
+        pool_grow(pool);
+    }
+
+    PoolItem *item = pool->free_items;
+    pool->free_items = item->next;
+    return item;
+}
+
+void pool_free(Pool *pool, void *item) {
+    if (!item) {
+        return;
+    }
+
+    PoolItem *free_item = item;
+    free_item->next = pool->free_items;
+    pool->free_items = free_item;
+}
+
+static void pool_grow(Pool *pool) {
+    size_t item_size = pool_item_size(pool);
+    char *slab = malloc(item_size * POOL_SLAB_ITEMS);
+    check_memory(slab);
+
+    size_t index;
+    for (index = POOL_SLAB_ITEMS; index > 0; --index) {
+        pool_free(pool, slab + (index - 1) * item_size);
+    }
+}
+
+static size_t pool_item_size(Pool const *pool) {
+    size_t align = sizeof(PoolItem);
+    return (pool->item_size + align - 1) / align * align;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef POOL_H
+#define POOL_H
+
+
+#include "shell.h"
+
+
+#define POOL_SLAB_ITEMS 8
+
+#define POOL_INITIALIZER(type) {sizeof(type), NULL}
+
+
+struct Pool_St {
+    size_t item_size;
+    void *free_items;
+};
+
+typedef struct Pool_St Pool;
+
+
+void *pool_alloc(Pool *pool);
+
+void pool_free(Pool *pool, void *item);
+
+
+#endif //POOL_H
@@ -0,0 +1,71 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "process.h"
+
+#include <fcntl.h>
+
+
+#define STAT_PATH_LEN 32
+#define STAT_BUFFER_LEN 512
+
+
+/*
+ * Everything is taken from one read of /proc/pid/stat: the fields after the
+ * command name are the state, CPU time of the process and of its waited-for
+ * children in clock ticks, and the resident set size in pages.
+ */
+int process_usage_read(pid_t pid, ProcessUsage *usage) {
+    static long ticks_per_second = 0;
+    static long page_size = 0;
+    if (!ticks_per_second) {
+        ticks_per_second = sysconf(_SC_CLK_TCK);
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    usage->state = PROCESS_GONE;
+    usage->cpu_seconds = 0;
+    usage->rss_bytes = 0;
+
+    char path[STAT_PATH_LEN];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    char buffer[STAT_BUFFER_LEN];
+    ssize_t number_of_read = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (number_of_read <= 0) {
+        return BAD_RESULT;
+    }
+
+    buffer[number_of_read] = END;
+    char const *fields = strrchr(buffer, ')');
+    if (!fields) {
+        return BAD_RESULT;
+    }
+
+    char state;
+    unsigned long utime;
+    unsigned long stime;
+    long cutime;
+    long cstime;
+    long rss;
+    int answer = sscanf(fields + 1,
+                        " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+                        " %lu %lu %ld %ld %*d %*d %*d %*d %*u %*u %ld",
+                        &state, &utime, &stime, &cutime, &cstime, &rss);
+    if (answer != 6) {
+        return BAD_RESULT;
+    }
+
+    usage->state = state;
+    usage->cpu_seconds = (double) (utime + stime + cutime + cstime)
+                         / (double) ticks_per_second;
+    usage->rss_bytes = (unsigned long long) rss * (unsigned long long) page_size;
+    return EXIT_SUCCESS;
+}
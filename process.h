@@ -0,0 +1,30 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+
+#include "shell.h"
+
+#include <sys/types.h>
+
+
+#define PROCESS_GONE 'X'
+
+
+struct ProcessUsage_St {
+    double cpu_seconds;
+    unsigned long long rss_bytes;
+    char state;
+};
+
+typedef struct ProcessUsage_St ProcessUsage;
+
+
+int process_usage_read(pid_t pid, ProcessUsage *usage);
+
+
+#endif //PROCESS_H
@@ -4,15 +4,117 @@
 
 
 #include "prompt_line.h"
+#include "segment.h"
+#include "execute.h"
+#include "event.h"
+#include "merge.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 
-ssize_t prompt_line(char *buffer, size_t buffer_size) {
-    ssize_t number_of_write = write(STDOUT_FILENO, PROMPT_LINE,
-                                    strlen(PROMPT_LINE));
-    if (number_of_write < 0) {
+
+#define PROMPT_ESCAPE '\\'
+#define PROMPT_REDRAW "\r\033[J"
+#define PROMPT_REDRAW_LINES "\r\033[%zuA\033[J"
+#define PROMPT_MOVE_LEN 32
+
+
+static int prompt_render(char const *template,
+                         int last_status,
+                         size_t number_of_jobs,
+                         char *prompt,
+                         size_t size);
+
+static void prompt_directory(char *directory, size_t size);
+
+static int prompt_write(char const *prompt, char redraw);
+
+static int prompt_erase(char const *prompt);
+
+
+/*
+ * The prompt comes from the SHELL_PROMPT template when it is set. The
+ * branch segment is taken from the cache; if it is not fresh the prompt is
+ * shown without waiting and redrawn in place once the worker has it,
+ * unless the user has already finished the line. While deferred jobs are
+ * waiting, children are reaped at the prompt too, so they start without
+ * waiting for the next line. Output of captured jobs is written above the
+ * prompt as it comes.
+ */
+ssize_t prompt_line(char *buffer,
+                    size_t buffer_size,
+                    JobController *controller) {
+    char const *template = getenv(PROMPT_VARIABLE);
+    if (!template) {
+        template = PROMPT_LINE;
+    }
+
+    int last_status = controller->last_status;
+    size_t number_of_jobs = (size_t) controller->number_of_jobs;
+    char prompt[MAX_PROMPT];
+    int pending = prompt_render(template, last_status, number_of_jobs,
+                                prompt, sizeof(prompt));
+    if (prompt_write(prompt, FALSE) == BAD_RESULT) {
         return BAD_RESULT;
     }
 
+    char deferred = (char) job_controller_has_pending(controller);
+    while (pending || deferred || merge_fd() != BAD_RESULT) {
+        struct pollfd fds[4];
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = pending ? segment_fd() : BAD_RESULT;
+        fds[1].events = POLLIN;
+        fds[2].fd = deferred ? event_child_fd() : BAD_RESULT;
+        fds[2].events = POLLIN;
+        fds[3].fd = merge_fd();
+        fds[3].events = POLLIN;
+        if (poll(fds, 4, BAD_RESULT) == BAD_RESULT) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return BAD_RESULT;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (fds[3].revents && merge_poll()) {
+            if (prompt_erase(prompt) == BAD_RESULT) {
+                return BAD_RESULT;
+            }
+
+            merge_drain();
+            if (prompt_write(prompt, FALSE) == BAD_RESULT) {
+                return BAD_RESULT;
+            }
+        }
+
+        if (fds[2].revents) {
+            event_child_drain();
+            execute_deferred(controller);
+            deferred = (char) job_controller_has_pending(controller);
+        }
+
+        if (!fds[1].revents) {
+            continue;
+        }
+
+        segment_drain();
+        char updated[MAX_PROMPT];
+        pending = prompt_render(template, last_status, number_of_jobs,
+                                updated, sizeof(updated));
+        if (strcmp(updated, prompt) != 0) {
+            strcpy(prompt, updated);
+            if (prompt_write(prompt, TRUE) == BAD_RESULT) {
+                return BAD_RESULT;
+            }
+        }
+    }
+
     ssize_t number_of_read = read(STDIN_FILENO, buffer, buffer_size - 1);
     if (number_of_read >= 0) {
         buffer[number_of_read] = END;
@@ -20,3 +122,142 @@ ssize_t prompt_line(char *buffer, size_t buffer_size) {
 
     return number_of_read;
 }
+
+/*
+ * Reads the next line of a script, skipping blank lines and comments. The
+ * line always ends with a newline like a line read from the terminal.
+ * Returns 0 at the end of the input.
+ */
+ssize_t script_line(FILE *file, char *buffer, size_t buffer_size) {
+    while (fgets(buffer, (int) buffer_size, file)) {
+        size_t len = strlen(buffer);
+        if (buffer[len - 1] != '\n') {
+            if (len + 2 > buffer_size) {
+                errno = ENOBUFS;
+                return BAD_RESULT;
+            }
+
+            buffer[len++] = '\n';
+            buffer[len] = END;
+        }
+
+        char const *data = buffer;
+        while (isspace(*data)) {
+            ++data;
+        }
+
+        if (*data != END && *data != COMMENT) {
+            return (ssize_t) len;
+        }
+    }
+
+    return ferror(file) ? BAD_RESULT : 0;
+}
+
+/*
+ * Escapes: \w working directory, \? last status, \j number of jobs,
+ * \b VCS branch, \n newline, \\ backslash. Returns FALSE if a segment is
+ * still being computed.
+ */
+static int prompt_render(char const *template,
+                         int last_status,
+                         size_t number_of_jobs,
+                         char *prompt,
+                         size_t size) {
+    int fresh = TRUE;
+    size_t len = 0;
+    for (; *template != END && len + 1 < size; ++template) {
+        if (*template != PROMPT_ESCAPE || template[1] == END) {
+            prompt[len++] = *template;
+            continue;
+        }
+
+        char segment[PATH_MAX];
+        switch (*++template) {
+            case 'w':
+                prompt_directory(segment, sizeof(segment));
+                break;
+            case '?':
+                snprintf(segment, sizeof(segment), "%d", last_status);
+                break;
+            case 'j':
+                snprintf(segment, sizeof(segment), "%zu", number_of_jobs);
+                break;
+            case 'b': {
+                char directory[PATH_MAX];
+                if (!getcwd(directory, sizeof(directory))) {
+                    *segment = END;
+                    break;
+                }
+
+                fresh &= segment_branch(directory, segment, sizeof(segment));
+                break;
+            }
+            case 'n':
+                strcpy(segment, "\n");
+                break;
+            default:
+                snprintf(segment, sizeof(segment), "%c", *template);
+                break;
+        }
+
+        len += (size_t) snprintf(prompt + len, size - len, "%s", segment);
+        if (len >= size) {
+            len = size - 1;
+        }
+    }
+
+    prompt[len] = END;
+    return !fresh;
+}
+
+/*
+ * The home directory is shortened to "~".
+ */
+static void prompt_directory(char *directory, size_t size) {
+    if (!getcwd(directory, size)) {
+        snprintf(directory, size, "?");
+        return;
+    }
+
+    char const *home = getenv("HOME");
+    size_t home_len = home ? strlen(home) : 0;
+    if (home_len > 1 && strncmp(directory, home, home_len) == 0
+        && (directory[home_len] == '/' || directory[home_len] == END)) {
+        directory[0] = '~';
+        memmove(directory + 1, directory + home_len,
+                strlen(directory + home_len) + 1);
+    }
+}
+
+static int prompt_write(char const *prompt, char redraw) {
+    if (redraw && prompt_erase(prompt) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    ssize_t number_of_write = write(STDOUT_FILENO, prompt, strlen(prompt));
+    return number_of_write < 0 ? BAD_RESULT : EXIT_SUCCESS;
+}
+
+/*
+ * Moves the cursor back to the start of the prompt, which may take several
+ * lines, and clears everything below it.
+ */
+static int prompt_erase(char const *prompt) {
+    char move[PROMPT_MOVE_LEN];
+    size_t lines = 0;
+    char const *position;
+    for (position = strchr(prompt, '\n'); position;
+         position = strchr(position + 1, '\n')) {
+        ++lines;
+    }
+
+    if (lines) {
+        snprintf(move, sizeof(move), PROMPT_REDRAW_LINES, lines);
+    } else {
+        snprintf(move, sizeof(move), PROMPT_REDRAW);
+    }
+
+    return write(STDOUT_FILENO, move, strlen(move)) < 0 ? BAD_RESULT
+                                                          : EXIT_SUCCESS;
+}
@@ -8,12 +8,21 @@
 
 
 #include "shell.h"
+#include "job_control.h"
 
 
 #define PROMPT_LINE "(*_*)$>"
+#define PROMPT_VARIABLE "SHELL_PROMPT"
+#define MAX_PROMPT 1024
 
+#define COMMENT '#'
 
-ssize_t prompt_line(char *buffer, size_t buffer_size);
+
+ssize_t prompt_line(char *buffer,
+                    size_t buffer_size,
+                    JobController *controller);
+
+ssize_t script_line(FILE *file, char *buffer, size_t buffer_size);
 
 
 #endif //PROMPT_LINE_H
@@ -0,0 +1,271 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "resource_limit.h"
+
+#include <errno.h>
+
+
+#define UNLIMITED "unlimited"
+#define OPTIONS_END "--"
+
+
+struct LimitOption_St {
+    char option;
+    int resource;
+    rlim_t unit;
+    char const *description;
+    char const *unit_name;
+};
+
+typedef struct LimitOption_St LimitOption;
+
+
+/*
+ * Sizes are given in kilobytes like in other shells, unless a K/M/G/T suffix
+ * is used. Both -m and -v map to the address space limit, because Linux
+ * ignores RLIMIT_RSS.
+ */
+static LimitOption const limit_options[] = {
+        {'c', RLIMIT_CORE,    1024, "core file size",   "kbytes"},
+        {'d', RLIMIT_DATA,    1024, "data seg size",    "kbytes"},
+        {'f', RLIMIT_FSIZE,   1024, "file size",        "kbytes"},
+        {'l', RLIMIT_MEMLOCK, 1024, "max locked memory", "kbytes"},
+        {'m', RLIMIT_AS,      1024, "max memory size",  "kbytes"},
+        {'n', RLIMIT_NOFILE,  1,    "open files",       ""},
+        {'s', RLIMIT_STACK,   1024, "stack size",       "kbytes"},
+        {'t', RLIMIT_CPU,     1,    "cpu time",         "seconds"},
+        {'u', RLIMIT_NPROC,   1,    "max user processes", ""},
+        {'v', RLIMIT_AS,      1024, "virtual memory",   "kbytes"},
+};
+
+#define LIMIT_OPTIONS (sizeof(limit_options) / sizeof(limit_options[0]))
+
+
+static LimitOption const *limit_option_by_resource(int resource);
+
+static void resource_limit_print_value(rlim_t value,
+                                       LimitOption const *option,
+                                       FILE *file);
+
+
+int resource_limit_by_option(char option) {
+    size_t index;
+    for (index = 0; index < LIMIT_OPTIONS; ++index) {
+        if (limit_options[index].option == option) {
+            return limit_options[index].resource;
+        }
+    }
+
+    return BAD_RESULT;
+}
+
+int resource_limit_parse_value(char const *str, int resource, rlim_t *value) {
+    if (strcmp(str, UNLIMITED) == 0) {
+        *value = RLIM_INFINITY;
+        return EXIT_SUCCESS;
+    }
+
+    if (!isdigit(*str)) {
+        return BAD_RESULT;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long number = strtoull(str, &end, 10);
+    if (errno) {
+        return BAD_RESULT;
+    }
+
+    rlim_t multiplier = limit_option_by_resource(resource)->unit;
+    switch (toupper(*end)) {
+        case END:
+            break;
+        case 'K':
+            multiplier = 1ULL << 10;
+            break;
+        case 'M':
+            multiplier = 1ULL << 20;
+            break;
+        case 'G':
+            multiplier = 1ULL << 30;
+            break;
+        case 'T':
+            multiplier = 1ULL << 40;
+            break;
+        default:
+            return BAD_RESULT;
+    }
+
+    if (*end != END && end[1] != END) {
+        return BAD_RESULT;
+    }
+
+    if (number > RLIM_INFINITY / multiplier) {
+        return BAD_RESULT;
+    }
+
+    *value = (rlim_t) number * multiplier;
+    return EXIT_SUCCESS;
+}
+
+int resource_limits_parse(char **arguments,
+                          ResourceLimits *limits,
+                          char const *name) {
+    int consumed = 0;
+    while (arguments[consumed] && arguments[consumed][0] == '-') {
+        char *option = arguments[consumed];
+        if (strcmp(option, OPTIONS_END) == 0) {
+            return consumed + 1;
+        }
+
+        int resource = option[2] == END
+                       ? resource_limit_by_option(option[1])
+                       : BAD_RESULT;
+        if (resource == BAD_RESULT) {
+            fprintf(stderr, "shell: %s: %s: invalid option\n", name, option);
+            return BAD_RESULT;
+        }
+
+        char *argument = arguments[consumed + 1];
+        rlim_t value;
+        if (!argument
+            || resource_limit_parse_value(argument, resource, &value)
+               == BAD_RESULT) {
+            fprintf(stderr, "shell: %s: %s: invalid limit\n", name,
+                    argument ? argument : option);
+            return BAD_RESULT;
+        }
+
+        limits->values[resource].rlim_cur = value;
+        limits->values[resource].rlim_max = value;
+        limits->mask |= 1U << resource;
+        consumed += 2;
+    }
+
+    return consumed;
+}
+
+void resource_limits_merge(ResourceLimits *dst, ResourceLimits const *src) {
+    int resource;
+    for (resource = 0; resource < LIMIT_RESOURCES; ++resource) {
+        if (src->mask & (1U << resource)) {
+            dst->values[resource] = src->values[resource];
+        }
+    }
+
+    dst->mask |= src->mask;
+}
+
+int resource_limits_apply(ResourceLimits const *limits, pid_t pid) {
+    int resource;
+    for (resource = 0; resource < LIMIT_RESOURCES; ++resource) {
+        if (!(limits->mask & (1U << resource))) {
+            continue;
+        }
+
+        int exit_code = prlimit(pid, resource, &limits->values[resource], NULL);
+        if (exit_code == BAD_RESULT && errno != ESRCH) {
+            perror("Couldn't set resource limit");
+            return BAD_RESULT;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void resource_limits_print(ResourceLimits const *limits, FILE *file) {
+    size_t index;
+    for (index = 0; index < LIMIT_OPTIONS; ++index) {
+        LimitOption const *option = &limit_options[index];
+        if (!(limits->mask & (1U << option->resource))
+            || limit_option_by_resource(option->resource) != option) {
+            continue;
+        }
+
+        fprintf(file, " -%c ", option->option);
+        resource_limit_print_value(limits->values[option->resource].rlim_max,
+                                   option, file);
+    }
+}
+
+int resource_limit_print_current(int resource, char which, FILE *file) {
+    struct rlimit current;
+    int exit_code = getrlimit(resource, &current);
+    if (exit_code == BAD_RESULT) {
+        perror("Couldn't get resource limit");
+        return BAD_RESULT;
+    }
+
+    resource_limit_print_value(which & LIMIT_SOFT
+                               ? current.rlim_cur
+                               : current.rlim_max,
+                               limit_option_by_resource(resource), file);
+    fprintf(file, "\n");
+    return EXIT_SUCCESS;
+}
+
+int resource_limit_set_current(int resource, char which, rlim_t value) {
+    struct rlimit current;
+    int exit_code = getrlimit(resource, &current);
+    if (exit_code == BAD_RESULT) {
+        perror("Couldn't get resource limit");
+        return BAD_RESULT;
+    }
+
+    if (which & LIMIT_SOFT) {
+        current.rlim_cur = value;
+    }
+
+    if (which & LIMIT_HARD) {
+        current.rlim_max = value;
+    }
+
+    exit_code = setrlimit(resource, &current);
+    if (exit_code == BAD_RESULT) {
+        perror("Couldn't set resource limit");
+        return BAD_RESULT;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void resource_limit_print_all(char which, FILE *file) {
+    size_t index;
+    for (index = 0; index < LIMIT_OPTIONS; ++index) {
+        LimitOption const *option = &limit_options[index];
+        char unit[32];
+        if (*option->unit_name) {
+            snprintf(unit, sizeof(unit), "(%s, -%c)", option->unit_name,
+                     option->option);
+        } else {
+            snprintf(unit, sizeof(unit), "(-%c)", option->option);
+        }
+
+        fprintf(file, "%-20s %-18s ", option->description, unit);
+        resource_limit_print_current(option->resource, which, file);
+    }
+}
+
+static LimitOption const *limit_option_by_resource(int resource) {
+    size_t index;
+    for (index = 0; index < LIMIT_OPTIONS; ++index) {
+        if (limit_options[index].resource == resource) {
+            return &limit_options[index];
+        }
+    }
+
+    return NULL;
+}
+
+static void resource_limit_print_value(rlim_t value,
+                                       LimitOption const *option,
+                                       FILE *file) {
+    if (value == RLIM_INFINITY) {
+        fprintf(file, UNLIMITED);
+    } else {
+        fprintf(file, "%llu", (unsigned long long) (value / option->unit));
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef RESOURCE_LIMIT_H
+#define RESOURCE_LIMIT_H
+
+
+#include "shell.h"
+
+#include <sys/resource.h>
+
+
+#define LIMIT_SOFT 1
+#define LIMIT_HARD 2
+#define LIMIT_BOTH (LIMIT_SOFT | LIMIT_HARD)
+
+#define LIMIT_RESOURCES RLIM_NLIMITS
+
+
+struct ResourceLimits_St {
+    struct rlimit values[LIMIT_RESOURCES];
+    unsigned int mask;
+};
+
+typedef struct ResourceLimits_St ResourceLimits;
+
+
+int resource_limit_by_option(char option);
+
+int resource_limit_parse_value(char const *str, int resource, rlim_t *value);
+
+int resource_limits_parse(char **arguments,
+                          ResourceLimits *limits,
+                          char const *name);
+
+void resource_limits_merge(ResourceLimits *dst, ResourceLimits const *src);
+
+int resource_limits_apply(ResourceLimits const *limits, pid_t pid);
+
+void resource_limits_print(ResourceLimits const *limits, FILE *file);
+
+int resource_limit_print_current(int resource, char which, FILE *file);
+
+int resource_limit_set_current(int resource, char which, rlim_t value);
+
+void resource_limit_print_all(char which, FILE *file);
+
+
+#endif //RESOURCE_LIMIT_H
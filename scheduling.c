@@ -0,0 +1,273 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "scheduling.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_PRIO_CLASS(ioprio) ((ioprio) >> IOPRIO_CLASS_SHIFT)
+#define IOPRIO_PRIO_DATA(ioprio) ((ioprio) & ((1 << IOPRIO_CLASS_SHIFT) - 1))
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_WHO_PGRP 2
+
+#define IOPRIO_MAX_LEVEL 7
+
+
+static char const *ioprio_classes[] = {
+        "none",
+        "realtime",
+        "best-effort",
+        "idle"
+};
+
+#define IOPRIO_CLASSES (sizeof(ioprio_classes) / sizeof(ioprio_classes[0]))
+
+
+static int ioprio_set(int which, int who, int ioprio);
+
+static int parse_number(char const *str, char **end);
+
+static void print_cpus(cpu_set_t const *cpus, FILE *file);
+
+
+int scheduling_parse_cpus(char const *str, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while (*str != END) {
+        char *end;
+        int first = parse_number(str, &end);
+        int last = first;
+        if (first != BAD_RESULT && *end == '-') {
+            last = parse_number(end + 1, &end);
+        }
+
+        if (first == BAD_RESULT || last == BAD_RESULT || last < first
+            || last >= CPU_SETSIZE || (*end != ',' && *end != END)) {
+            return BAD_RESULT;
+        }
+
+        int cpu;
+        for (cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+
+        str = *end == ',' ? end + 1 : end;
+    }
+
+    return CPU_COUNT(cpus) ? EXIT_SUCCESS : BAD_RESULT;
+}
+
+int scheduling_parse_ioprio(char **arguments, int *ioprio, char const *name) {
+    int class = IOPRIO_CLASS_BE;
+    int level = DEFAULT_IOPRIO_LEVEL;
+
+    int consumed = 0;
+    while (arguments[consumed] && arguments[consumed + 1]
+           && (strcmp(arguments[consumed], "-c") == 0
+               || strcmp(arguments[consumed], "-n") == 0)) {
+        char *value = arguments[consumed + 1];
+        char *end = NULL;
+        if (arguments[consumed][1] == 'c') {
+            size_t index;
+            for (index = 1, class = BAD_RESULT; index < IOPRIO_CLASSES; ++index) {
+                if (strcmp(value, ioprio_classes[index]) == 0) {
+                    class = (int) index;
+                }
+            }
+
+            if (class == BAD_RESULT) {
+                class = parse_number(value, &end);
+            }
+
+            if (class < IOPRIO_CLASS_RT || class > IOPRIO_CLASS_IDLE
+                || (end && *end != END)) {
+                fprintf(stderr, "shell: %s: %s: invalid class\n", name, value);
+                return BAD_RESULT;
+            }
+        } else {
+            level = parse_number(value, &end);
+            if (level == BAD_RESULT || level > IOPRIO_MAX_LEVEL || *end != END) {
+                fprintf(stderr, "shell: %s: %s: invalid level\n", name, value);
+                return BAD_RESULT;
+            }
+        }
+
+        consumed += 2;
+    }
+
+    *ioprio = IOPRIO_PRIO_VALUE(class, class == IOPRIO_CLASS_IDLE ? 0 : level);
+    return consumed;
+}
+
+int scheduling_apply(Scheduling const *scheduling, pid_t pid) {
+    if (scheduling->mask & SCHEDULING_AFFINITY) {
+        int exit_code = sched_setaffinity(pid, sizeof(cpu_set_t),
+                                          &scheduling->cpus);
+        if (exit_code == BAD_RESULT && errno != ESRCH) {
+            perror("Couldn't set CPU affinity");
+            return BAD_RESULT;
+        }
+    }
+
+    if (scheduling->mask & SCHEDULING_NICE) {
+        int exit_code = setpriority(PRIO_PROCESS, (id_t) pid, scheduling->nice);
+        if (exit_code == BAD_RESULT && errno != ESRCH) {
+            perror("Couldn't set nice value");
+            return BAD_RESULT;
+        }
+    }
+
+    if (scheduling->mask & SCHEDULING_IOPRIO) {
+        int exit_code = ioprio_set(IOPRIO_WHO_PROCESS, pid, scheduling->ioprio);
+        if (exit_code == BAD_RESULT && errno != ESRCH) {
+            perror("Couldn't set I/O priority");
+            return BAD_RESULT;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Nice and I/O priority are set for the whole process group, so they also
+ * reach processes the job has started itself. Affinity has no group form.
+ */
+int scheduling_apply_group(Scheduling const *scheduling,
+                           pid_t pgid,
+                           pid_t const *pids,
+                           size_t pids_count) {
+    if (scheduling->mask & SCHEDULING_AFFINITY) {
+        Scheduling affinity = *scheduling;
+        affinity.mask = SCHEDULING_AFFINITY;
+
+        size_t index;
+        for (index = 0; index < pids_count; ++index) {
+            int exit_code = scheduling_apply(&affinity, pids[index]);
+            if (exit_code == BAD_RESULT) {
+                return exit_code;
+            }
+        }
+    }
+
+    if (scheduling->mask & SCHEDULING_NICE) {
+        int exit_code = setpriority(PRIO_PGRP, (id_t) pgid, scheduling->nice);
+        if (exit_code == BAD_RESULT) {
+            perror("Couldn't set nice value");
+            return BAD_RESULT;
+        }
+    }
+
+    if (scheduling->mask & SCHEDULING_IOPRIO) {
+        int exit_code = ioprio_set(IOPRIO_WHO_PGRP, pgid, scheduling->ioprio);
+        if (exit_code == BAD_RESULT) {
+            perror("Couldn't set I/O priority");
+            return BAD_RESULT;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void scheduling_merge(Scheduling *dst, Scheduling const *src) {
+    if (src->mask & SCHEDULING_AFFINITY) {
+        if (dst->mask & SCHEDULING_AFFINITY) {
+            CPU_OR(&dst->cpus, &dst->cpus, &src->cpus);
+        } else {
+            dst->cpus = src->cpus;
+        }
+    }
+
+    if (src->mask & SCHEDULING_NICE) {
+        dst->nice = src->nice;
+    }
+
+    if (src->mask & SCHEDULING_IOPRIO) {
+        dst->ioprio = src->ioprio;
+    }
+
+    dst->mask |= src->mask;
+}
+
+/*
+ * Stage N of a spread conveyor is pinned to the N-th CPU of the base set,
+ * so neighbouring stages share a cache when the set is contiguous.
+ */
+void scheduling_spread(Scheduling *dst, Scheduling const *base, size_t stage) {
+    size_t position = stage % (size_t) CPU_COUNT(&base->cpus);
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &base->cpus) && position-- == 0) {
+            break;
+        }
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    dst->cpus = cpus;
+    dst->mask |= SCHEDULING_AFFINITY;
+}
+
+void scheduling_print(Scheduling const *scheduling, FILE *file) {
+    if (scheduling->mask & SCHEDULING_AFFINITY) {
+        fprintf(file, " cpus ");
+        print_cpus(&scheduling->cpus, file);
+    }
+
+    if (scheduling->mask & SCHEDULING_NICE) {
+        fprintf(file, " nice %d", scheduling->nice);
+    }
+
+    if (scheduling->mask & SCHEDULING_IOPRIO) {
+        int class = IOPRIO_PRIO_CLASS(scheduling->ioprio);
+        fprintf(file, " io %s/%d",
+                class < (int) IOPRIO_CLASSES ? ioprio_classes[class] : "unknown",
+                IOPRIO_PRIO_DATA(scheduling->ioprio));
+    }
+}
+
+static int ioprio_set(int which, int who, int ioprio) {
+    return (int) syscall(SYS_ioprio_set, which, who, ioprio);
+}
+
+static int parse_number(char const *str, char **end) {
+    if (!isdigit(*str)) {
+        return BAD_RESULT;
+    }
+
+    long number = strtol(str, end, 10);
+    return number > INT_MAX ? BAD_RESULT : (int) number;
+}
+
+static void print_cpus(cpu_set_t const *cpus, FILE *file) {
+    char const *separator = "";
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            ++cpu;
+            continue;
+        }
+
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            ++last;
+        }
+
+        if (last == cpu) {
+            fprintf(file, "%s%d", separator, cpu);
+        } else {
+            fprintf(file, "%s%d-%d", separator, cpu, last);
+        }
+
+        separator = ",";
+        cpu = last + 1;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef SCHEDULING_H
+#define SCHEDULING_H
+
+
+#include "shell.h"
+
+#include <sched.h>
+
+
+#define SCHEDULING_AFFINITY 1
+#define SCHEDULING_NICE 2
+#define SCHEDULING_IOPRIO 4
+#define SCHEDULING_SPREAD 8
+
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+#define DEFAULT_NICE_INCREMENT 10
+#define DEFAULT_IOPRIO_LEVEL 4
+
+
+struct Scheduling_St {
+    cpu_set_t cpus;
+    int nice;
+    int ioprio;
+    char mask;
+};
+
+typedef struct Scheduling_St Scheduling;
+
+
+int scheduling_parse_cpus(char const *str, cpu_set_t *cpus);
+
+int scheduling_parse_ioprio(char **arguments, int *ioprio, char const *name);
+
+int scheduling_apply(Scheduling const *scheduling, pid_t pid);
+
+int scheduling_apply_group(Scheduling const *scheduling,
+                           pid_t pgid,
+                           pid_t const *pids,
+                           size_t pids_count);
+
+void scheduling_merge(Scheduling *dst, Scheduling const *src);
+
+void scheduling_spread(Scheduling *dst, Scheduling const *base, size_t stage);
+
+void scheduling_print(Scheduling const *scheduling, FILE *file);
+
+
+#endif //SCHEDULING_H
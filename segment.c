@@ -0,0 +1,284 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "segment.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+
+#define GIT_DIR ".git"
+#define GIT_HEAD "HEAD"
+#define GIT_REF_PREFIX "ref: refs/heads/"
+#define GIT_DIR_PREFIX "gitdir: "
+#define SHORT_HASH_LEN 7
+#define GIT_PATH_MAX (2 * PATH_MAX)
+
+#define WORKER_IDLE 0
+#define WORKER_RUNNING 1
+#define WORKER_FAILED 2
+
+
+struct SegmentEntry_St {
+    char directory[PATH_MAX];
+    char value[SEGMENT_MAX];
+    time_t updated;
+    size_t used;
+};
+
+typedef struct SegmentEntry_St SegmentEntry;
+
+
+/*
+ * Expensive segments are computed by one worker thread. The prompt takes
+ * whatever the cache has, fresh or not, and asks the worker for the rest;
+ * the worker stores the result and wakes the prompt through an eventfd. Only
+ * the latest request is kept, older ones are for prompts that are gone.
+ */
+static SegmentEntry cache[SEGMENT_CACHE_SIZE];
+static size_t cache_tick = 0;
+static char requested[PATH_MAX];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_ready = PTHREAD_COND_INITIALIZER;
+static int ready_fd = BAD_RESULT;
+static char worker_state = WORKER_IDLE;
+
+
+static int segment_start();
+
+static void *segment_worker(void *argument);
+
+static SegmentEntry *cache_find(char const *directory);
+
+static SegmentEntry *cache_slot(char const *directory);
+
+static void branch_compute(char const *directory, char *branch, size_t size);
+
+static void branch_read_head(char const *git_dir, char *branch, size_t size);
+
+static int read_first_line(char const *path, char *line, size_t size);
+
+
+/*
+ * Copies the cached branch of the repository containing directory, or an
+ * empty string. Returns FALSE if the value is missing or old and a fresh one
+ * will be announced on segment_fd().
+ */
+int segment_branch(char const *directory, char *branch, size_t size) {
+    if (worker_state == WORKER_IDLE && segment_start() == BAD_RESULT) {
+        worker_state = WORKER_FAILED;
+    }
+
+    if (worker_state == WORKER_FAILED) {
+        branch_compute(directory, branch, size);
+        return TRUE;
+    }
+
+    pthread_mutex_lock(&lock);
+    SegmentEntry *entry = cache_find(directory);
+    int fresh = entry && time(NULL) - entry->updated < SEGMENT_TTL_SECONDS;
+    if (entry) {
+        snprintf(branch, size, "%s", entry->value);
+        entry->used = ++cache_tick;
+    } else {
+        *branch = END;
+    }
+
+    if (!fresh) {
+        snprintf(requested, sizeof(requested), "%s", directory);
+        pthread_cond_signal(&request_ready);
+    }
+
+    pthread_mutex_unlock(&lock);
+    return fresh;
+}
+
+int segment_fd() {
+    return ready_fd;
+}
+
+void segment_drain() {
+    uint64_t count;
+    while (read(ready_fd, &count, sizeof(count)) > 0) {
+    }
+}
+
+/*
+ * The worker blocks every signal, so SIGCHLD and the job control signals
+ * keep going to the main thread.
+ */
+static int segment_start() {
+    ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ready_fd == BAD_RESULT) {
+        perror("Couldn't create eventfd");
+        return BAD_RESULT;
+    }
+
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    pthread_t worker;
+    int exit_code = pthread_create(&worker, NULL, segment_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (exit_code) {
+        errno = exit_code;
+        perror("Couldn't start prompt worker");
+        close(ready_fd);
+        ready_fd = BAD_RESULT;
+        return BAD_RESULT;
+    }
+
+    pthread_detach(worker);
+    worker_state = WORKER_RUNNING;
+    return EXIT_SUCCESS;
+}
+
+static void *segment_worker(void *argument) {
+    (void) argument;
+    pthread_mutex_lock(&lock);
+    while (TRUE) {
+        while (*requested == END) {
+            pthread_cond_wait(&request_ready, &lock);
+        }
+
+        char directory[PATH_MAX];
+        strcpy(directory, requested);
+        *requested = END;
+        pthread_mutex_unlock(&lock);
+
+        char branch[SEGMENT_MAX];
+        branch_compute(directory, branch, sizeof(branch));
+
+        pthread_mutex_lock(&lock);
+        SegmentEntry *entry = cache_slot(directory);
+        strcpy(entry->directory, directory);
+        strcpy(entry->value, branch);
+        entry->updated = time(NULL);
+        entry->used = ++cache_tick;
+
+        uint64_t one = 1;
+        if (write(ready_fd, &one, sizeof(one)) == BAD_RESULT) {
+            perror("Couldn't notify prompt");
+        }
+    }
+
+    return NULL;
+}
+
+static SegmentEntry *cache_find(char const *directory) {
+    size_t index;
+    for (index = 0; index < SEGMENT_CACHE_SIZE; ++index) {
+        if (cache[index].used && strcmp(cache[index].directory, directory) == 0) {
+            return &cache[index];
+        }
+    }
+
+    return NULL;
+}
+
+static SegmentEntry *cache_slot(char const *directory) {
+    SegmentEntry *entry = cache_find(directory);
+    if (entry) {
+        return entry;
+    }
+
+    entry = &cache[0];
+    size_t index;
+    for (index = 1; index < SEGMENT_CACHE_SIZE; ++index) {
+        if (cache[index].used < entry->used) {
+            entry = &cache[index];
+        }
+    }
+
+    return entry;
+}
+
+/*
+ * Looks for .git in the directory and its parents. A .git file, as in
+ * worktrees and submodules, points to the real git directory.
+ */
+static void branch_compute(char const *directory, char *branch, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", directory);
+    *branch = END;
+
+    while (*path != END) {
+        char git[GIT_PATH_MAX];
+        snprintf(git, sizeof(git), "%s/%s", strcmp(path, "/") == 0 ? "" : path,
+                 GIT_DIR);
+
+        struct stat info;
+        if (stat(git, &info) == EXIT_SUCCESS) {
+            char line[PATH_MAX];
+            if (S_ISDIR(info.st_mode)) {
+                branch_read_head(git, branch, size);
+            } else if (read_first_line(git, line, sizeof(line)) == EXIT_SUCCESS
+                       && strncmp(line, GIT_DIR_PREFIX,
+                                  strlen(GIT_DIR_PREFIX)) == 0) {
+                char const *target = line + strlen(GIT_DIR_PREFIX);
+                if (*target == '/') {
+                    snprintf(git, sizeof(git), "%s", target);
+                } else {
+                    snprintf(git, sizeof(git), "%s/%s", path, target);
+                }
+
+                branch_read_head(git, branch, size);
+            }
+
+            return;
+        }
+
+        char *slash = strrchr(path, '/');
+        if (!slash || strcmp(path, "/") == 0) {
+            return;
+        }
+
+        slash[slash == path ? 1 : 0] = END;
+    }
+}
+
+/*
+ * HEAD names the branch, or holds a commit hash when it is detached.
+ */
+static void branch_read_head(char const *git_dir, char *branch, size_t size) {
+    char path[GIT_PATH_MAX];
+    char line[SEGMENT_MAX];
+    snprintf(path, sizeof(path), "%s/%s", git_dir, GIT_HEAD);
+    if (read_first_line(path, line, sizeof(line)) == BAD_RESULT) {
+        return;
+    }
+
+    if (strncmp(line, GIT_REF_PREFIX, strlen(GIT_REF_PREFIX)) == 0) {
+        snprintf(branch, size, "%s", line + strlen(GIT_REF_PREFIX));
+    } else {
+        snprintf(branch, size, "%.*s", SHORT_HASH_LEN, line);
+    }
+}
+
+static int read_first_line(char const *path, char *line, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    ssize_t number_of_read = read(fd, line, size - 1);
+    close(fd);
+    if (number_of_read <= 0) {
+        return BAD_RESULT;
+    }
+
+    line[number_of_read] = END;
+    line[strcspn(line, "\n")] = END;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+
+#include "shell.h"
+
+
+#define SEGMENT_MAX 256
+#define SEGMENT_CACHE_SIZE 16
+#define SEGMENT_TTL_SECONDS 2
+
+
+int segment_branch(char const *directory, char *branch, size_t size);
+
+int segment_fd();
+
+void segment_drain();
+
+
+#endif //SEGMENT_H
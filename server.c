@@ -0,0 +1,336 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+#define SERVER_BACKLOG 64
+#define SERVER_REPLY_MAX 256
+#define DEV_NULL "/dev/null"
+#define MICROSECONDS_IN_SECOND 1000000.0
+
+
+static int server_bind(int server, struct sockaddr_un const *address);
+
+static int server_parse(ServerRequest *request, size_t size);
+
+static int server_receive_fds(struct msghdr *message, ServerRequest *request);
+
+static double timeval_seconds(struct timeval const *end,
+                              struct timeval const *start);
+
+
+/*
+ * Listens on a SOCK_SEQPACKET socket, so every request and reply is one
+ * message and can carry descriptors. A socket left by a server that is
+ * gone is replaced.
+ */
+int server_listen(char const *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "shell: %s: socket path too long\n", path);
+        return BAD_RESULT;
+    }
+
+    strcpy(address.sun_path, path);
+    int server = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (server == BAD_RESULT) {
+        perror("Couldn't create socket");
+        return BAD_RESULT;
+    }
+
+    if (server_bind(server, &address) == BAD_RESULT
+        || listen(server, SERVER_BACKLOG) == BAD_RESULT) {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+        close(server);
+        return BAD_RESULT;
+    }
+
+    return server;
+}
+
+/*
+ * Accepts a connection of the same user; others are refused, so the socket
+ * gives nobody more than they could run themselves.
+ */
+int server_accept(int server) {
+    int connection = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+    if (connection == BAD_RESULT) {
+        if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+            perror("Couldn't accept connection");
+        }
+
+        return BAD_RESULT;
+    }
+
+    struct ucred peer;
+    socklen_t len = sizeof(peer);
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer,
+                   &len) == BAD_RESULT
+        || (peer.uid != geteuid() && peer.uid != 0)) {
+        close(connection);
+        return BAD_RESULT;
+    }
+
+    return connection;
+}
+
+/*
+ * Reads one request: NUL-terminated fields, each starting with its tag,
+ * and up to three descriptors for its input, output and errors. Returns
+ * TRUE for a request, FALSE at the end of the connection and BAD_RESULT for
+ * a malformed one.
+ */
+int server_receive(int connection, ServerRequest *request) {
+    request->fds_count = 0;
+
+    struct iovec data;
+    data.iov_base = request->buffer;
+    data.iov_len = SERVER_REQUEST_MAX;
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * SERVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t number_of_read;
+    do {
+        number_of_read = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    } while (number_of_read == BAD_RESULT && errno == EINTR);
+
+    if (number_of_read <= 0) {
+        return number_of_read == 0 || errno == ECONNRESET ? FALSE : BAD_RESULT;
+    }
+
+    int exit_code = server_receive_fds(&message, request);
+    if (exit_code == BAD_RESULT || message.msg_flags & MSG_TRUNC) {
+        fprintf(stderr, "shell: serve: request too long\n");
+        server_release(request);
+        return BAD_RESULT;
+    }
+
+    if (server_parse(request, (size_t) number_of_read) == BAD_RESULT) {
+        fprintf(stderr, "shell: serve: malformed request\n");
+        server_release(request);
+        return BAD_RESULT;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Gives the process the descriptors, directory and variables of the
+ * request. A descriptor the client did not pass is /dev/null. Errors go to
+ * the client's stderr.
+ */
+int server_apply(ServerRequest *request) {
+    int fd;
+    for (fd = 0; fd < SERVER_MAX_FDS; ++fd) {
+        int source = (size_t) fd < request->fds_count
+                     ? request->fds[fd]
+                     : open(DEV_NULL, fd ? O_WRONLY : O_RDONLY);
+        if (source == BAD_RESULT || dup2(source, fd) == BAD_RESULT) {
+            perror("Couldn't redirect request descriptors");
+            return BAD_RESULT;
+        }
+
+        if ((size_t) fd >= request->fds_count) {
+            close(source);
+        }
+    }
+
+    size_t index;
+    for (index = 0; index < request->variables_count; ++index) {
+        char *variable = request->variables[index];
+        char *separator = strchr(variable, '=');
+        if (!separator) {
+            unsetenv(variable);
+            continue;
+        }
+
+        *separator = END;
+        setenv(variable, separator + 1, TRUE);
+        *separator = '=';
+    }
+
+    if (request->directory && chdir(request->directory) == BAD_RESULT) {
+        fprintf(stderr, "shell: %s: %s\n", request->directory,
+                strerror(errno));
+        return BAD_RESULT;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Closes the received descriptors and points fds 0-2 at /dev/null again,
+ * so the client sees the end of its pipes once the request is done.
+ */
+void server_release(ServerRequest *request) {
+    size_t index;
+    for (index = 0; index < request->fds_count; ++index) {
+        close(request->fds[index]);
+    }
+
+    request->fds_count = 0;
+    int null = open(DEV_NULL, O_RDWR | O_CLOEXEC);
+    if (null == BAD_RESULT) {
+        return;
+    }
+
+    int fd;
+    for (fd = 0; fd < SERVER_MAX_FDS; ++fd) {
+        dup2(null, fd);
+    }
+
+    close(null);
+}
+
+void server_usage_start(ServerUsage *usage) {
+    usage->started = stats_now();
+    getrusage(RUSAGE_CHILDREN, &usage->children);
+}
+
+/*
+ * The reply is one JSON line: the status of the request, its wall time,
+ * the CPU time of the processes it reaped and the largest resident set
+ * among all processes the connection has reaped so far.
+ */
+int server_reply(int connection, int status, ServerUsage const *usage) {
+    struct rusage children;
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    char reply[SERVER_REPLY_MAX];
+    int len = snprintf(reply, sizeof(reply),
+                       "{\"status\":%d,\"elapsed\":%.6f,\"user\":%.6f,"
+                       "\"sys\":%.6f,\"rss\":%llu}\n",
+                       status,
+                       (double) (stats_now() - usage->started)
+                       / MICROSECONDS_IN_SECOND,
+                       timeval_seconds(&children.ru_utime,
+                                       &usage->children.ru_utime),
+                       timeval_seconds(&children.ru_stime,
+                                       &usage->children.ru_stime),
+                       (unsigned long long) children.ru_maxrss * 1024ULL);
+    if (len < 0 || (size_t) len >= sizeof(reply)) {
+        return BAD_RESULT;
+    }
+
+    if (send(connection, reply, (size_t) len, MSG_NOSIGNAL) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int server_bind(int server, struct sockaddr_un const *address) {
+    if (bind(server, (struct sockaddr const *) address,
+             sizeof(*address)) == EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+
+    if (errno != EADDRINUSE) {
+        return BAD_RESULT;
+    }
+
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (probe == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    int exit_code = connect(probe, (struct sockaddr const *) address,
+                            sizeof(*address));
+    close(probe);
+    if (exit_code == EXIT_SUCCESS || errno != ECONNREFUSED) {
+        errno = EADDRINUSE;
+        return BAD_RESULT;
+    }
+
+    unlink(address->sun_path);
+    return bind(server, (struct sockaddr const *) address, sizeof(*address));
+}
+
+static int server_parse(ServerRequest *request, size_t size) {
+    request->line = NULL;
+    request->directory = NULL;
+    request->variables_count = 0;
+    request->buffer[size] = END;
+
+    char *field = request->buffer;
+    char *end = request->buffer + size;
+    while (field < end) {
+        size_t len = strlen(field);
+        char tag = *field;
+        char *value = field + 1;
+        if (!len) {
+            return BAD_RESULT;
+        }
+
+        if (tag == SERVER_TAG_LINE && !request->line) {
+            request->line = value;
+        } else if (tag == SERVER_TAG_DIRECTORY && !request->directory) {
+            request->directory = value;
+        } else if (tag == SERVER_TAG_VARIABLE && *value != END
+                   && *value != '='
+                   && request->variables_count < SERVER_MAX_VARIABLES) {
+            request->variables[request->variables_count++] = value;
+        } else {
+            return BAD_RESULT;
+        }
+
+        field += len + 1;
+    }
+
+    return request->line ? EXIT_SUCCESS : BAD_RESULT;
+}
+
+static int server_receive_fds(struct msghdr *message, ServerRequest *request) {
+    int exit_code = message->msg_flags & MSG_CTRUNC ? BAD_RESULT : EXIT_SUCCESS;
+    struct cmsghdr *header;
+    for (header = CMSG_FIRSTHDR(message); header;
+         header = CMSG_NXTHDR(message, header)) {
+        if (header->cmsg_level != SOL_SOCKET
+            || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int const *fds = (int const *) CMSG_DATA(header);
+        size_t index;
+        for (index = 0; index < count; ++index) {
+            if (request->fds_count < SERVER_MAX_FDS) {
+                memcpy(&request->fds[request->fds_count++], &fds[index],
+                       sizeof(int));
+            } else {
+                int fd;
+                memcpy(&fd, &fds[index], sizeof(int));
+                close(fd);
+                exit_code = BAD_RESULT;
+            }
+        }
+    }
+
+    return exit_code;
+}
+
+static double timeval_seconds(struct timeval const *end,
+                              struct timeval const *start) {
+    return (double) (end->tv_sec - start->tv_sec)
+           + (double) (end->tv_usec - start->tv_usec) / MICROSECONDS_IN_SECOND;
+}
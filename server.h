@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef SERVER_H
+#define SERVER_H
+
+
+#include "shell.h"
+#include "stats.h"
+
+#include <sys/resource.h>
+
+
+#define SERVER_REQUEST_MAX (1 << 16)
+#define SERVER_MAX_VARIABLES 256
+#define SERVER_MAX_FDS 3
+
+#define SERVER_TAG_LINE 'c'
+#define SERVER_TAG_DIRECTORY 'd'
+#define SERVER_TAG_VARIABLE 'e'
+
+
+struct ServerRequest_St {
+    char buffer[SERVER_REQUEST_MAX + 1];
+    char *line;
+    char *directory;
+    char *variables[SERVER_MAX_VARIABLES];
+    size_t variables_count;
+    int fds[SERVER_MAX_FDS];
+    size_t fds_count;
+};
+
+typedef struct ServerRequest_St ServerRequest;
+
+struct ServerUsage_St {
+    stats_time_t started;
+    struct rusage children;
+};
+
+typedef struct ServerUsage_St ServerUsage;
+
+
+int server_listen(char const *path);
+
+int server_accept(int server);
+
+int server_receive(int connection, ServerRequest *request);
+
+int server_apply(ServerRequest *request);
+
+void server_release(ServerRequest *request);
+
+void server_usage_start(ServerUsage *usage);
+
+int server_reply(int connection, int status, ServerUsage const *usage);
+
+
+#endif //SERVER_H
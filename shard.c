@@ -0,0 +1,522 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "shard.h"
+#include "execute.h"
+#include "stats.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <wait.h>
+
+
+#define EQUALS 0
+
+#define SHARD_READ (1 << 16)
+#define BROKEN_PIPE_STATUS (128 + SIGPIPE)
+
+
+struct ShardTask_St {
+    char used;
+    pid_t pid;
+    int input;
+    int output;
+    char *data;
+    size_t size;
+    size_t written;
+    char *result;
+    size_t result_len;
+    size_t result_capacity;
+    unsigned long long sequence;
+};
+
+typedef struct ShardTask_St ShardTask;
+
+struct Shard_St {
+    ShardTask tasks[SHARD_MAX_WORKERS];
+    size_t workers;
+    char ordered;
+    char separator;
+    char *const *command;
+    char *chunk;
+    size_t chunk_len;
+    size_t chunk_capacity;
+    char input_done;
+    unsigned long long started;
+    unsigned long long emitted;
+    int status;
+    char broken;
+};
+
+typedef struct Shard_St Shard;
+
+
+static int shard_parse(char *const *arguments, Shard *shard);
+
+static int shard_cpus();
+
+static size_t shard_ready(Shard const *shard);
+
+static void shard_fill(Shard *shard);
+
+static int shard_start(Shard *shard, ShardTask *task, size_t size);
+
+static void shard_feed(ShardTask *task);
+
+static void shard_collect(Shard *shard, ShardTask *task);
+
+static void shard_finish(Shard *shard, ShardTask *task);
+
+static void shard_emit(Shard *shard);
+
+static void shard_output(Shard *shard, char const *data, size_t size);
+
+static size_t shard_active(Shard const *shard);
+
+static ShardTask *shard_free_task(Shard *shard);
+
+
+/*
+ * "shard [-j N] [--ordered] [-z] command" cuts its input into chunks of
+ * about SHARD_CHUNK bytes that end on a line (or a NUL with -z) and runs
+ * the command on each chunk, at most N at a time, all in the stage's
+ * process group. Output is passed on by whole lines as it comes, or with
+ * --ordered in the order of the chunks. The status is the highest status
+ * of the workers.
+ */
+int shard_run(char *const *arguments) {
+    Shard *shard = calloc(1, sizeof(Shard));
+    check_memory(shard);
+    int index = shard_parse(arguments, shard);
+    if (index == BAD_RESULT) {
+        free(shard);
+        return EXIT_USAGE_STATUS;
+    }
+
+    shard->command = arguments + index;
+    shard->chunk_capacity = SHARD_CHUNK + SHARD_READ;
+    shard->chunk = malloc(shard->chunk_capacity);
+    check_memory(shard->chunk);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[2 * SHARD_MAX_WORKERS + 1];
+    ShardTask *owners[2 * SHARD_MAX_WORKERS + 1];
+    while (TRUE) {
+        ShardTask *task;
+        size_t size;
+        while (!shard->broken && (task = shard_free_task(shard))
+               && (size = shard_ready(shard))) {
+            if (shard_start(shard, task, size) == BAD_RESULT) {
+                shard->broken = TRUE;
+            }
+        }
+
+        if (!shard_active(shard)
+            && (shard->broken || (shard->input_done && !shard->chunk_len))) {
+            break;
+        }
+
+        nfds_t count = 0;
+        if (!shard->broken && !shard->input_done && !shard_ready(shard)) {
+            fds[count].fd = STDIN_FILENO;
+            fds[count].events = POLLIN;
+            owners[count++] = NULL;
+        }
+
+        size_t slot;
+        for (slot = 0; slot < shard->workers; ++slot) {
+            task = &shard->tasks[slot];
+            if (task->used && task->input != BAD_RESULT) {
+                fds[count].fd = task->input;
+                fds[count].events = POLLOUT;
+                owners[count++] = task;
+            }
+
+            if (task->used && task->output != BAD_RESULT) {
+                fds[count].fd = task->output;
+                fds[count].events = POLLIN;
+                owners[count++] = task;
+            }
+        }
+
+        if (poll(fds, count, BAD_RESULT) == BAD_RESULT) {
+            if (errno != EINTR) {
+                perror("Couldn't wait for workers");
+                shard->broken = TRUE;
+            }
+
+            continue;
+        }
+
+        nfds_t position;
+        for (position = 0; position < count; ++position) {
+            if (!fds[position].revents) {
+                continue;
+            }
+
+            task = owners[position];
+            if (!task) {
+                shard_fill(shard);
+            } else if (fds[position].fd == task->input) {
+                shard_feed(task);
+            } else {
+                shard_collect(shard, task);
+            }
+        }
+
+        shard_emit(shard);
+    }
+
+    int status = shard->status;
+    free(shard->chunk);
+    free(shard);
+    return status;
+}
+
+static int shard_parse(char *const *arguments, Shard *shard) {
+    shard->workers = (size_t) shard_cpus();
+    shard->separator = '\n';
+
+    int index;
+    for (index = 1; arguments[index]; ++index) {
+        char const *argument = arguments[index];
+        if (strcmp(argument, "--") == EQUALS) {
+            ++index;
+            break;
+        }
+
+        if (strcmp(argument, "-j") == EQUALS && arguments[index + 1]) {
+            char *end;
+            long workers = strtol(arguments[++index], &end, 10);
+            if (*end != END || workers < 1 || workers > SHARD_MAX_WORKERS) {
+                fprintf(stderr, "shell: shard: %s: invalid number of workers\n",
+                        arguments[index]);
+                return BAD_RESULT;
+            }
+
+            shard->workers = (size_t) workers;
+        } else if (strcmp(argument, "--ordered") == EQUALS) {
+            shard->ordered = TRUE;
+        } else if (strcmp(argument, "-z") == EQUALS) {
+            shard->separator = END;
+        } else if (*argument == '-') {
+            fprintf(stderr, "shell: shard: %s: invalid option\n", argument);
+            return BAD_RESULT;
+        } else {
+            break;
+        }
+    }
+
+    if (!arguments[index]) {
+        fprintf(stderr, "shell: shard: usage: shard [-j N] [--ordered] [-z] command\n");
+        return BAD_RESULT;
+    }
+
+    return index;
+}
+
+static int shard_cpus() {
+    cpu_set_t cpus;
+    int count = sched_getaffinity(0, sizeof(cpus), &cpus) == BAD_RESULT
+                ? (int) sysconf(_SC_NPROCESSORS_ONLN)
+                : CPU_COUNT(&cpus);
+    if (count < 1) {
+        return 1;
+    }
+
+    return count > SHARD_MAX_WORKERS ? SHARD_MAX_WORKERS : count;
+}
+
+/*
+ * Returns how much of the pending input makes the next chunk: everything up
+ * to the last separator once SHARD_CHUNK bytes are there, the rest at the
+ * end of the input, or 0 while more input is needed.
+ */
+static size_t shard_ready(Shard const *shard) {
+    if (shard->input_done) {
+        return shard->chunk_len;
+    }
+
+    if (shard->chunk_len < SHARD_CHUNK) {
+        return 0;
+    }
+
+    char const *separator = memrchr(shard->chunk, shard->separator,
+                                    shard->chunk_len);
+    return separator ? (size_t) (separator - shard->chunk) + 1 : 0;
+}
+
+static void shard_fill(Shard *shard) {
+    if (shard->chunk_capacity - shard->chunk_len < SHARD_READ) {
+        shard->chunk_capacity *= 2;
+        shard->chunk = realloc(shard->chunk, shard->chunk_capacity);
+        check_memory(shard->chunk);
+    }
+
+    ssize_t number_of_read = read(STDIN_FILENO,
+                                  shard->chunk + shard->chunk_len, SHARD_READ);
+    if (number_of_read == BAD_RESULT && errno == EINTR) {
+        return;
+    }
+
+    if (number_of_read <= 0) {
+        if (number_of_read == BAD_RESULT) {
+            perror("shell: shard");
+        }
+
+        shard->input_done = TRUE;
+        return;
+    }
+
+    shard->chunk_len += (size_t) number_of_read;
+}
+
+/*
+ * Gives the first size bytes of the pending input to a new worker; the
+ * rest moves to a fresh buffer. The worker's ends of the pipes are its
+ * standard input and output, the shard's ends don't block.
+ */
+static int shard_start(Shard *shard, ShardTask *task, size_t size) {
+    int input[2];
+    int output[2];
+    if (pipe2(input, O_CLOEXEC) == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        return BAD_RESULT;
+    }
+
+    if (pipe2(output, O_CLOEXEC) == BAD_RESULT) {
+        perror("Couldn't create pipe");
+        close(input[0]);
+        close(input[1]);
+        return BAD_RESULT;
+    }
+
+    stats_count(STATS_PIPE);
+    stats_count(STATS_PIPE);
+    stats_count(STATS_FORK);
+    pid_t pid = fork();
+    if (pid == DESCENDANT_PID) {
+        signal(SIGPIPE, SIG_DFL);
+        dup2(input[0], STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        stats_count(STATS_EXEC);
+        execvp(shard->command[0], shard->command);
+        stats_count(STATS_EXEC_FAILED);
+        int error = errno;
+        perror("Couldn't execute command");
+        _exit(error == ENOENT ? EXEC_NOT_FOUND_STATUS : EXEC_FAILED_STATUS);
+    }
+
+    close(input[0]);
+    close(output[1]);
+    if (pid == BAD_PID) {
+        perror("Couldn't create process");
+        close(input[1]);
+        close(output[0]);
+        return BAD_RESULT;
+    }
+
+    fcntl(input[1], F_SETFL, O_NONBLOCK);
+    fcntl(output[0], F_SETFL, O_NONBLOCK);
+    fcntl(input[1], F_SETPIPE_SZ, SHARD_CHUNK);
+
+    memset(task, 0, sizeof(ShardTask));
+    task->used = TRUE;
+    task->pid = pid;
+    task->input = input[1];
+    task->output = output[0];
+    task->data = shard->chunk;
+    task->size = size;
+    task->sequence = shard->started++;
+
+    size_t rest = shard->chunk_len - size;
+    shard->chunk_capacity = SHARD_CHUNK + SHARD_READ > rest
+                            ? SHARD_CHUNK + SHARD_READ
+                            : rest + SHARD_READ;
+    shard->chunk = malloc(shard->chunk_capacity);
+    check_memory(shard->chunk);
+    memcpy(shard->chunk, task->data + size, rest);
+    shard->chunk_len = rest;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A worker that exits without reading all its chunk loses the rest.
+ */
+static void shard_feed(ShardTask *task) {
+    ssize_t number_of_write = write(task->input, task->data + task->written,
+                                    task->size - task->written);
+    if (number_of_write == BAD_RESULT
+        && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (number_of_write == BAD_RESULT) {
+        task->written = task->size;
+    } else {
+        task->written += (size_t) number_of_write;
+    }
+
+    if (task->written == task->size) {
+        close(task->input);
+        task->input = BAD_RESULT;
+        free(task->data);
+        task->data = NULL;
+    }
+}
+
+/*
+ * Reads what the worker has written. Unordered, whole lines go out at once;
+ * ordered, the output of the oldest chunk goes out and the others wait.
+ */
+static void shard_collect(Shard *shard, ShardTask *task) {
+    if (task->result_capacity - task->result_len < SHARD_READ) {
+        task->result_capacity = task->result_capacity
+                                ? task->result_capacity * 2
+                                : SHARD_READ * 2;
+        task->result = realloc(task->result, task->result_capacity);
+        check_memory(task->result);
+    }
+
+    ssize_t number_of_read = read(task->output,
+                                  task->result + task->result_len, SHARD_READ);
+    if (number_of_read == BAD_RESULT
+        && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (number_of_read <= 0) {
+        close(task->output);
+        task->output = BAD_RESULT;
+        return;
+    }
+
+    task->result_len += (size_t) number_of_read;
+    size_t ready = task->result_len;
+    if (shard->ordered && task->sequence != shard->emitted) {
+        return;
+    }
+
+    if (!shard->ordered) {
+        char const *separator = memrchr(task->result, shard->separator,
+                                        task->result_len);
+        ready = separator ? (size_t) (separator - task->result) + 1 : 0;
+    }
+
+    shard_output(shard, task->result, ready);
+    memmove(task->result, task->result + ready, task->result_len - ready);
+    task->result_len -= ready;
+}
+
+static void shard_finish(Shard *shard, ShardTask *task) {
+    int status;
+    stats_count(STATS_WAITPID);
+    while (waitpid(task->pid, &status, 0) == BAD_RESULT && errno == EINTR) {
+    }
+
+    int code = job_status_code(status);
+    if (code > shard->status) {
+        shard->status = code;
+    }
+
+    shard_output(shard, task->result, task->result_len);
+    free(task->result);
+    free(task->data);
+    if (task->input != BAD_RESULT) {
+        close(task->input);
+    }
+
+    memset(task, 0, sizeof(ShardTask));
+}
+
+/*
+ * A worker is done when both its pipes are closed. Ordered, done workers
+ * are finished in the order of their chunks and keep their slots until
+ * then, so at most N outputs are held.
+ */
+static void shard_emit(Shard *shard) {
+    char progress = TRUE;
+    while (progress) {
+        progress = FALSE;
+        size_t slot;
+        for (slot = 0; slot < shard->workers; ++slot) {
+            ShardTask *task = &shard->tasks[slot];
+            if (!task->used || task->input != BAD_RESULT
+                || task->output != BAD_RESULT
+                || (shard->ordered && task->sequence != shard->emitted)) {
+                continue;
+            }
+
+            shard_finish(shard, task);
+            if (shard->ordered) {
+                ++shard->emitted;
+                progress = TRUE;
+            }
+        }
+    }
+
+    if (!shard->ordered) {
+        return;
+    }
+
+    size_t slot;
+    for (slot = 0; slot < shard->workers; ++slot) {
+        ShardTask *task = &shard->tasks[slot];
+        if (task->used && task->sequence == shard->emitted
+            && task->result_len) {
+            shard_output(shard, task->result, task->result_len);
+            task->result_len = 0;
+        }
+    }
+}
+
+/*
+ * When the reader of the output is gone the workers are terminated and
+ * the stage ends like a command killed by SIGPIPE.
+ */
+static void shard_output(Shard *shard, char const *data, size_t size) {
+    if (!size || shard->broken
+        || stream_write_all(STDOUT_FILENO, data, size) == EXIT_SUCCESS) {
+        return;
+    }
+
+    if (errno != EPIPE) {
+        perror("shell: shard");
+    }
+
+    shard->broken = TRUE;
+    shard->status = BROKEN_PIPE_STATUS;
+    size_t slot;
+    for (slot = 0; slot < shard->workers; ++slot) {
+        if (shard->tasks[slot].used) {
+            kill(shard->tasks[slot].pid, SIGTERM);
+        }
+    }
+}
+
+static size_t shard_active(Shard const *shard) {
+    size_t count = 0;
+    size_t slot;
+    for (slot = 0; slot < shard->workers; ++slot) {
+        count += (size_t) shard->tasks[slot].used;
+    }
+
+    return count;
+}
+
+static ShardTask *shard_free_task(Shard *shard) {
+    size_t slot;
+    for (slot = 0; slot < shard->workers; ++slot) {
+        if (!shard->tasks[slot].used) {
+            return &shard->tasks[slot];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef SHARD_H
+#define SHARD_H
+
+
+#include "shell.h"
+
+
+#define SHARD_NAME "shard"
+#define SHARD_MAX_WORKERS 64
+#define SHARD_CHUNK (1 << 20)
+
+
+int shard_run(char *const *arguments);
+
+
+#endif //SHARD_H
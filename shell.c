@@ -4,6 +4,7 @@
 
 
 #include <sys/types.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,35 +14,121 @@
 #include "job_control.h"
 #include "parse_line.h"
 #include "execute.h"
+#include "stats.h"
+#include "event.h"
+#include "merge.h"
+#include "terminal.h"
+#include "server.h"
+
+#include <sys/wait.h>
+
+
+#define COMMAND_OPTION "-c"
+#define SERVE_OPTION "--serve"
+
+
+static int shell_interactive();
+
+static int shell_script(FILE *input);
+
+static int shell_serve(char const *path);
+
+static int shell_session(int connection);
+
+static int shell_request(JobController *controller,
+                         CommandLine *command_line,
+                         char *line);
+
+static int shell_execute_line(JobController *controller,
+                              CommandLine *command_line,
+                              char *buffer);
 
 
 int main(int argc, char *argv[]) {
-    return shell_run();
+    return shell_run(argc, argv);
+}
+
+/*
+ * Without arguments the shell is interactive. "-c string" and "file" run
+ * the commands without a prompt and without job control, "--serve socket"
+ * runs the command lines of clients.
+ */
+int shell_run(int argc, char *argv[]) {
+    if (argc < 2) {
+        return shell_interactive();
+    }
+
+    if ((strcmp(argv[1], COMMAND_OPTION) == 0
+         || strcmp(argv[1], SERVE_OPTION) == 0) && argc < 3) {
+        fprintf(stderr, "shell: %s: option requires an argument\n", argv[1]);
+        return EXIT_USAGE_STATUS;
+    }
+
+    if (strcmp(argv[1], SERVE_OPTION) == 0) {
+        return shell_serve(argv[2]);
+    }
+
+    FILE *input;
+    if (strcmp(argv[1], COMMAND_OPTION) == 0) {
+
+        if (!*argv[2]) {
+            return EXIT_SUCCESS;
+        }
+
+        input = fmemopen(argv[2], strlen(argv[2]), "r");
+    } else {
+        input = fopen(argv[1], "re");
+    }
+
+    if (!input) {
+        fprintf(stderr, "shell: %s: %s\n", argv[1], strerror(errno));
+        return EXEC_NOT_FOUND_STATUS;
+    }
+
+    int status = shell_script(input);
+    fclose(input);
+    return status;
 }
 
-int shell_run() {
+void check_memory(void *src) {
+    if (!src) {
+        fprintf(stderr, "Couldn't allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int shell_interactive() {
     CommandLine command_line;
+    command_line_init(&command_line);
     JobController *controller = job_controller_create();
     signal(SIGINT, SIG_IGN);
     signal(SIGTSTP, SIG_IGN);
+    stats_init();
+    if (event_init() == BAD_RESULT || terminal_init() == BAD_RESULT) {
+        return EXIT_FAILURE;
+    }
 
     char buffer[MAX_COMMAND_LINE];
-    ssize_t number_of_read = prompt_line(buffer, sizeof(buffer));
+    ssize_t number_of_read = prompt_line(buffer, sizeof(buffer), controller);
     while (number_of_read > 0) {
-        ssize_t number_of_commands = parse_input_line(buffer, &command_line);
-        int exit_code = execute_command_line(controller, &command_line,
-                                             number_of_commands);
+        stats_time_t line_started = stats_now();
+        int exit_code = shell_execute_line(controller, &command_line, buffer);
         switch (exit_code) {
             case CONTINUE:
                 break;
             case EXIT:
-                return EXIT_SUCCESS;
+                stats_dump();
+                return controller->last_status;
             default:
                 return EXIT_FAILURE;
         }
 
+        execute_deferred(controller);
+        merge_drain();
         job_controller_print_current_status(controller);
-        number_of_read = prompt_line(buffer, sizeof(buffer));
+        stats_tick();
+        stats_observe(STATS_PROMPT_TIME, line_started);
+        number_of_read = prompt_line(buffer, sizeof(buffer), controller);
     }
 
     if (number_of_read < 0) {
@@ -53,9 +140,194 @@ int shell_run() {
     return EXIT_SUCCESS;
 }
 
-void check_memory(void *src) {
-    if (!src) {
-        fprintf(stderr, "Couldn't allocate memory\n");
-        exit(EXIT_FAILURE);
+/*
+ * Reads one line ahead, so the last command of the input is known while it
+ * is executed and can replace the shell instead of being forked.
+ */
+static int shell_script(FILE *input) {
+    CommandLine command_line;
+    command_line_init(&command_line);
+    JobController *controller = job_controller_create();
+    controller->job_control = FALSE;
+    stats_init();
+    if (event_init() == BAD_RESULT) {
+        return EXIT_FAILURE;
     }
+
+    char buffers[2][MAX_COMMAND_LINE];
+    size_t current = 0;
+    ssize_t number_of_read = script_line(input, buffers[current],
+                                         MAX_COMMAND_LINE);
+    while (number_of_read > 0) {
+        ssize_t next_read = script_line(input, buffers[1 - current],
+                                        MAX_COMMAND_LINE);
+        command_line.tail_exec = (char) (next_read == 0);
+
+        int exit_code = shell_execute_line(controller, &command_line,
+                                           buffers[current]);
+        switch (exit_code) {
+            case CONTINUE:
+                break;
+            case EXIT:
+                stats_dump();
+                return controller->last_status;
+            default:
+                return EXIT_FAILURE;
+        }
+
+        execute_deferred(controller);
+        merge_drain();
+        job_controller_print_current_status(controller);
+        stats_tick();
+        current = 1 - current;
+        number_of_read = next_read;
+    }
+
+    if (number_of_read < 0) {
+        perror("Couldn't read input");
+        return EXIT_FAILURE;
+    }
+
+    int status = controller->last_status;
+    job_controller_free(controller);
+    return status;
+}
+
+/*
+ * Every connection gets a forked copy of the started shell, so clients run
+ * at the same time and the directory, variables and jobs of one connection
+ * never reach another. The server runs until it is killed.
+ */
+static int shell_serve(char const *path) {
+    stats_init();
+    if (event_init() == BAD_RESULT) {
+        return EXIT_FAILURE;
+    }
+
+    int server = server_listen(path);
+    if (server == BAD_RESULT) {
+        return EXIT_FAILURE;
+    }
+
+    while (TRUE) {
+        int events = event_wait(server);
+        if (events & EVENT_CHILD) {
+            while (waitpid(BAD_PID, NULL, WNOHANG) > 0) {
+            }
+        }
+
+        if (!(events & EVENT_FD)) {
+            continue;
+        }
+
+        int connection = server_accept(server);
+        if (connection == BAD_RESULT) {
+            continue;
+        }
+
+        stats_count(STATS_FORK);
+        pid_t pid = fork();
+        if (pid == DESCENDANT_PID) {
+            close(server);
+            int status = shell_session(connection);
+            fflush(NULL);
+            _exit(status);
+        }
+
+        if (pid == BAD_PID) {
+            perror("Couldn't create process");
+        }
+
+        close(connection);
+    }
+}
+
+/*
+ * Runs the requests of one connection in order, like the lines of a
+ * script, and replies to each with its status and resource usage.
+ */
+static int shell_session(int connection) {
+    CommandLine command_line;
+    command_line_init(&command_line);
+    JobController *controller = job_controller_create();
+    controller->job_control = FALSE;
+
+    ServerRequest *request = malloc(sizeof(ServerRequest));
+    check_memory(request);
+
+    int exit_code = CONTINUE;
+    while (exit_code == CONTINUE
+           && server_receive(connection, request) == TRUE) {
+        ServerUsage usage;
+        server_usage_start(&usage);
+        if (server_apply(request) == BAD_RESULT) {
+            controller->last_status = EXIT_FAILURE;
+        } else {
+            exit_code = shell_request(controller, &command_line,
+                                      request->line);
+        }
+
+        if (exit_code != CONTINUE && exit_code != EXIT) {
+            free(request);
+            return EXIT_FAILURE;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        server_release(request);
+        if (server_reply(connection, controller->last_status,
+                         &usage) == BAD_RESULT) {
+            break;
+        }
+    }
+
+    free(request);
+    int status = controller->last_status;
+    job_controller_free(controller);
+    return status;
+}
+
+static int shell_request(JobController *controller,
+                         CommandLine *command_line,
+                         char *line) {
+    FILE *input = fmemopen(line, strlen(line), "r");
+    if (!input) {
+        perror("Couldn't read request");
+        controller->last_status = EXIT_FAILURE;
+        return CONTINUE;
+    }
+
+    char buffer[MAX_COMMAND_LINE];
+    int exit_code = CONTINUE;
+    ssize_t number_of_read = 0;
+    while (exit_code == CONTINUE
+           && (number_of_read = script_line(input, buffer,
+                                            sizeof(buffer))) > 0) {
+        exit_code = shell_execute_line(controller, command_line, buffer);
+        execute_deferred(controller);
+        merge_drain();
+        job_controller_print_current_status(controller);
+        stats_tick();
+    }
+
+    if (number_of_read < 0) {
+        perror("Couldn't read request");
+        controller->last_status = EXIT_USAGE_STATUS;
+    }
+
+    fclose(input);
+    return exit_code;
+}
+
+static int shell_execute_line(JobController *controller,
+                              CommandLine *command_line,
+                              char *buffer) {
+    stats_time_t parse_started = stats_now();
+    ssize_t number_of_commands = parse_input_line(buffer, command_line);
+    stats_observe(STATS_PARSE_TIME, parse_started);
+    if (number_of_commands == BAD_SYNTAX) {
+        controller->last_status = EXIT_USAGE_STATUS;
+    }
+
+    return execute_command_line(controller, command_line, number_of_commands);
 }
@@ -22,7 +22,7 @@
 #define BAD_RESULT (-1)
 
 
-int shell_run();
+int shell_run(int argc, char *argv[]);
 
 void check_memory(void *src);
 
@@ -0,0 +1,275 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "stats.h"
+
+#include <sys/mman.h>
+#include <time.h>
+
+
+#define MICROSECONDS 1000000ULL
+#define NANOSECONDS_IN_MICROSECOND 1000ULL
+
+
+static char const *counter_names[STATS_COUNTERS] = {
+        "forks",
+        "execs",
+        "exec_failures",
+        "pipes",
+        "waitpid_calls",
+        "tcsetpgrp_calls",
+        "in_process_commands"
+};
+
+static char const *counter_help[STATS_COUNTERS] = {
+        "Processes forked by the shell",
+        "Exec attempts made by forked descendants",
+        "Exec attempts that returned an error",
+        "Pipes created for conveyors",
+        "Calls to waitpid",
+        "Calls to tcsetpgrp",
+        "Utility commands run inside the shell without a fork"
+};
+
+static char const *histogram_names[STATS_HISTOGRAMS] = {
+        "parse_seconds",
+        "prompt_to_prompt_seconds"
+};
+
+static char const *histogram_help[STATS_HISTOGRAMS] = {
+        "Time spent parsing a command line",
+        "Time from reading a command line to showing the next prompt"
+};
+
+
+/*
+ * The block is mapped shared so that descendants can account for their own
+ * exec attempts before the image is replaced.
+ */
+static Stats fallback_stats;
+static Stats *stats = &fallback_stats;
+
+static char *export_path = NULL;
+static unsigned int export_interval = STATS_DEFAULT_INTERVAL;
+static stats_time_t last_export = 0;
+
+
+static void stats_add(unsigned long long *value, unsigned long long delta);
+
+static size_t stats_bucket(stats_time_t duration);
+
+static void stats_print_histogram(FILE *file, int index);
+
+static void stats_print_prometheus_histogram(FILE *file, int index);
+
+
+int stats_init() {
+    void *block = mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        perror("Couldn't map statistics block");
+        return BAD_RESULT;
+    }
+
+    stats = block;
+    stats_reset();
+
+    char *path = getenv(STATS_FILE_ENV);
+    if (path && *path) {
+        char *interval = getenv(STATS_INTERVAL_ENV);
+        stats_set_export(path, interval && atoi(interval) > 0
+                               ? (unsigned int) atoi(interval)
+                               : STATS_DEFAULT_INTERVAL);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void stats_count(int counter) {
+    stats_add(&stats->counters[counter], 1);
+}
+
+stats_time_t stats_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (stats_time_t) now.tv_sec * MICROSECONDS
+           + (stats_time_t) now.tv_nsec / NANOSECONDS_IN_MICROSECOND;
+}
+
+void stats_observe(int histogram, stats_time_t started) {
+    stats_time_t duration = stats_now() - started;
+    StatsHistogram *current = &stats->histograms[histogram];
+
+    stats_add(&current->buckets[stats_bucket(duration)], 1);
+    stats_add(&current->count, 1);
+    stats_add(&current->sum, duration);
+}
+
+void stats_reset() {
+    memset(stats, 0, sizeof(Stats));
+    stats->started = stats_now();
+}
+
+void stats_print(FILE *file) {
+    int index;
+    for (index = 0; index < STATS_COUNTERS; ++index) {
+        fprintf(file, "%-24s %llu\n", counter_names[index],
+                stats->counters[index]);
+    }
+
+    for (index = 0; index < STATS_HISTOGRAMS; ++index) {
+        stats_print_histogram(file, index);
+    }
+}
+
+void stats_print_prometheus(FILE *file) {
+    int index;
+    for (index = 0; index < STATS_COUNTERS; ++index) {
+        fprintf(file, "# HELP shell_%s_total %s.\n"
+                      "# TYPE shell_%s_total counter\n"
+                      "shell_%s_total{pid=\"%d\"} %llu\n",
+                counter_names[index], counter_help[index],
+                counter_names[index],
+                counter_names[index], (int) getpid(),
+                stats->counters[index]);
+    }
+
+    for (index = 0; index < STATS_HISTOGRAMS; ++index) {
+        stats_print_prometheus_histogram(file, index);
+    }
+
+    fprintf(file, "# HELP shell_uptime_seconds Time since the counters were reset.\n"
+                  "# TYPE shell_uptime_seconds gauge\n"
+                  "shell_uptime_seconds{pid=\"%d\"} %.6f\n",
+            (int) getpid(),
+            (double) (stats_now() - stats->started) / MICROSECONDS);
+}
+
+int stats_set_export(char const *path, unsigned int interval) {
+    free(export_path);
+    export_path = NULL;
+    if (!path) {
+        return EXIT_SUCCESS;
+    }
+
+    export_path = strdup(path);
+    check_memory(export_path);
+    export_interval = interval;
+    last_export = 0;
+
+    stats_tick();
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Called between command lines. While the shell is idle at the prompt
+ * the counters don't change, so the file stays current without a timer.
+ */
+void stats_tick() {
+    if (!export_path) {
+        return;
+    }
+
+    stats_time_t now = stats_now();
+    if (last_export && now - last_export < export_interval * MICROSECONDS) {
+        return;
+    }
+
+    last_export = now;
+    stats_dump();
+}
+
+/*
+ * The textfile collector may read at any moment, so the file is
+ * replaced atomically.
+ */
+void stats_dump() {
+    if (!export_path) {
+        return;
+    }
+
+    size_t len = strlen(export_path) + 32;
+    char *temporary = malloc(len);
+    check_memory(temporary);
+    snprintf(temporary, len, "%s.%d.tmp", export_path, (int) getpid());
+
+    FILE *file = fopen(temporary, "w");
+    if (!file) {
+        perror("shell: stats: couldn't open export file");
+        free(temporary);
+        return;
+    }
+
+    stats_print_prometheus(file);
+    int exit_code = fclose(file);
+    if (exit_code == EOF || rename(temporary, export_path) == BAD_RESULT) {
+        perror("shell: stats: couldn't write export file");
+        unlink(temporary);
+    }
+
+    free(temporary);
+}
+
+static void stats_add(unsigned long long *value, unsigned long long delta) {
+    __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+}
+
+static size_t stats_bucket(stats_time_t duration) {
+    size_t bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && duration > (1ULL << bucket)) {
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+static void stats_print_histogram(FILE *file, int index) {
+    StatsHistogram const *current = &stats->histograms[index];
+    stats_time_t average = current->count ? current->sum / current->count : 0;
+    fprintf(file, "%-24s count %llu, avg %llu us\n", histogram_names[index],
+            current->count, average);
+
+    size_t bucket;
+    for (bucket = 0; bucket < STATS_BUCKETS; ++bucket) {
+        if (!current->buckets[bucket]) {
+            continue;
+        }
+
+        if (bucket == STATS_BUCKETS - 1) {
+            fprintf(file, "    %12s us %llu\n", "> max",
+                    current->buckets[bucket]);
+        } else {
+            fprintf(file, "    <= %9llu us %llu\n", 1ULL << bucket,
+                    current->buckets[bucket]);
+        }
+    }
+}
+
+static void stats_print_prometheus_histogram(FILE *file, int index) {
+    StatsHistogram const *current = &stats->histograms[index];
+    char const *name = histogram_names[index];
+    int pid = (int) getpid();
+
+    fprintf(file, "# HELP shell_%s %s.\n"
+                  "# TYPE shell_%s histogram\n",
+            name, histogram_help[index], name);
+
+    unsigned long long cumulative = 0;
+    size_t bucket;
+    for (bucket = 0; bucket < STATS_BUCKETS - 1; ++bucket) {
+        cumulative += current->buckets[bucket];
+        fprintf(file, "shell_%s_bucket{pid=\"%d\",le=\"%.6f\"} %llu\n",
+                name, pid, (double) (1ULL << bucket) / MICROSECONDS,
+                cumulative);
+    }
+
+    cumulative += current->buckets[STATS_BUCKETS - 1];
+    fprintf(file, "shell_%s_bucket{pid=\"%d\",le=\"+Inf\"} %llu\n"
+                  "shell_%s_sum{pid=\"%d\"} %.6f\n"
+                  "shell_%s_count{pid=\"%d\"} %llu\n",
+            name, pid, cumulative,
+            name, pid, (double) current->sum / MICROSECONDS,
+            name, pid, cumulative);
+}
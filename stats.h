@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef STATS_H
+#define STATS_H
+
+
+#include "shell.h"
+
+
+#define STATS_FORK 0
+#define STATS_EXEC 1
+#define STATS_EXEC_FAILED 2
+#define STATS_PIPE 3
+#define STATS_WAITPID 4
+#define STATS_TCSETPGRP 5
+#define STATS_IN_PROCESS 6
+#define STATS_COUNTERS 7
+
+#define STATS_PARSE_TIME 0
+#define STATS_PROMPT_TIME 1
+#define STATS_HISTOGRAMS 2
+
+/* Bucket i holds observations up to 2^i microseconds, the last one is +Inf */
+#define STATS_BUCKETS 26
+
+#define STATS_DEFAULT_INTERVAL 15
+
+#define STATS_FILE_ENV "SHELL_STATS_FILE"
+#define STATS_INTERVAL_ENV "SHELL_STATS_INTERVAL"
+
+
+typedef unsigned long long stats_time_t;
+
+struct StatsHistogram_St {
+    unsigned long long buckets[STATS_BUCKETS];
+    unsigned long long count;
+    stats_time_t sum;
+};
+
+typedef struct StatsHistogram_St StatsHistogram;
+
+struct Stats_St {
+    unsigned long long counters[STATS_COUNTERS];
+    StatsHistogram histograms[STATS_HISTOGRAMS];
+    stats_time_t started;
+};
+
+typedef struct Stats_St Stats;
+
+
+int stats_init();
+
+void stats_count(int counter);
+
+stats_time_t stats_now();
+
+void stats_observe(int histogram, stats_time_t started);
+
+void stats_reset();
+
+void stats_print(FILE *file);
+
+void stats_print_prometheus(FILE *file);
+
+int stats_set_export(char const *path, unsigned int interval);
+
+void stats_tick();
+
+void stats_dump();
+
+
+#endif //STATS_H
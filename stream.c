@@ -0,0 +1,922 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "stream.h"
+#include "event.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+
+#define EQUALS 0
+
+#define STDIN_NAME "-"
+
+#define COPY_FILE_RANGE 0
+#define COPY_SENDFILE 1
+#define COPY_SPLICE 2
+#define COPY_READ_WRITE 3
+
+#define BROKEN_PIPE_STATUS (128 + SIGPIPE)
+#define INTERRUPT_STATUS (128 + SIGINT)
+
+
+struct StreamTool_St {
+    char const *name;
+    char tool;
+};
+
+typedef struct StreamTool_St StreamTool;
+
+
+static StreamTool const stream_tools[] = {
+        {"cat",  STREAM_CAT},
+        {"head", STREAM_HEAD},
+        {"tail", STREAM_TAIL},
+        {"wc",   STREAM_WC},
+        {"tee",  STREAM_TEE},
+};
+
+#define STREAM_TOOLS (sizeof(stream_tools) / sizeof(stream_tools[0]))
+
+
+static char buffer[STREAM_CHUNK];
+
+
+static int parse_count(char *const *arguments, Stream *stream);
+
+static char const *stream_name(Stream const *stream);
+
+static int stream_open(char const *name, char const *tool);
+
+static int stream_cat(Stream const *stream);
+
+static int stream_cat_input(int input, char const *name);
+
+static int stream_head(Stream const *stream, int input);
+
+static int stream_tail(Stream const *stream, int input);
+
+static int stream_wc(Stream const *stream, int input);
+
+static int stream_tee(Stream const *stream);
+
+static ssize_t read_write(int input, int output, size_t size);
+
+static int fanout_splice(int input, int *output, size_t size);
+
+static int fanout_write(int *output, char const *data, size_t size);
+
+static int read_exactly(int input, size_t size);
+
+static long long count_lines(char const *data, size_t size);
+
+static int is_interrupted();
+
+static int is_regular(int fd);
+
+static int is_sized(struct stat const *info);
+
+
+/*
+ * Recognizes the forms the shell runs itself and fills stream. Anything
+ * else, like unknown options or several files for head, is left to the
+ * real utility.
+ */
+int stream_parse(Command const *command, Stream *stream) {
+    char *const *arguments = command->arguments;
+    memset(stream, 0, sizeof(Stream));
+    stream->count = STREAM_DEFAULT_COUNT;
+
+    size_t index;
+    for (index = 0; index < STREAM_TOOLS; ++index) {
+        if (strcmp(arguments[0], stream_tools[index].name) == EQUALS) {
+            stream->tool = stream_tools[index].tool;
+        }
+    }
+
+    int consumed = 1;
+    switch (stream->tool) {
+        case STREAM_HEAD:
+        case STREAM_TAIL: {
+            int count_consumed = parse_count(arguments + 1, stream);
+            if (count_consumed == BAD_RESULT
+                || (stream->tool == STREAM_TAIL
+                    && stream->unit == STREAM_BYTES)) {
+                return FALSE;
+            }
+
+            consumed += count_consumed;
+            break;
+        }
+        case STREAM_WC:
+            if (!arguments[1] || (strcmp(arguments[1], "-l") != EQUALS
+                                  && strcmp(arguments[1], "-c") != EQUALS)) {
+                return FALSE;
+            }
+
+            stream->unit = arguments[1][1] == 'l' ? STREAM_LINES : STREAM_BYTES;
+            consumed = 2;
+            break;
+        case STREAM_TEE:
+            if (arguments[1] && strcmp(arguments[1], "-a") == EQUALS) {
+                stream->append = TRUE;
+                consumed = 2;
+            }
+            break;
+        case STREAM_CAT:
+            break;
+        default:
+            return FALSE;
+    }
+
+    stream->files = arguments + consumed;
+    for (index = 0; stream->files[index]; ++index) {
+        if (stream->files[index][0] == '-'
+            && strcmp(stream->files[index], STDIN_NAME) != EQUALS) {
+            return FALSE;
+        }
+    }
+
+    return stream->tool == STREAM_CAT || stream->tool == STREAM_TEE
+           || index <= 1;
+}
+
+/*
+ * True if every input is a regular file with a size, so reading it can't
+ * block and its size can be trusted: procfs and sysfs files report none and
+ * are left to the real utility. The input is the file arguments, or else
+ * the redirect, or else stdin.
+ */
+int stream_inputs_regular(Stream const *stream, char const *infile) {
+    struct stat info;
+    if (stream->tool != STREAM_TEE && stream->files[0]) {
+        size_t index;
+        for (index = 0; stream->files[index]; ++index) {
+            char const *name = stream->files[index];
+            if (strcmp(name, STDIN_NAME) == EQUALS) {
+                if (!is_regular(STDIN_FILENO)) {
+                    return FALSE;
+                }
+            } else if (stat(name, &info) == EXIT_SUCCESS
+                       && !is_sized(&info)) {
+                return FALSE;
+            }
+        }
+
+        return TRUE;
+    }
+
+    if (infile && *infile == REDIRECT_DUPLICATE) {
+        return is_regular(atoi(infile + 1));
+    }
+
+    if (infile) {
+        return stat(infile, &info) == EXIT_SUCCESS && is_sized(&info);
+    }
+
+    return is_regular(STDIN_FILENO);
+}
+
+/*
+ * Runs the tool on the shell's stdin and stdout and returns its exit
+ * status. SIGPIPE is ignored meanwhile, so a reader that has gone ends the
+ * tool with the status it would have had, not the shell. While the shell
+ * catches interrupts, a pending SIGINT stops the tool between chunks.
+ */
+int stream_run(Stream const *stream) {
+    struct sigaction ignore;
+    struct sigaction previous;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &previous);
+
+    int status;
+    if (stream->tool == STREAM_CAT) {
+        status = stream_cat(stream);
+    } else if (stream->tool == STREAM_TEE) {
+        status = stream_tee(stream);
+    } else {
+        char const *name = stream->files[0];
+        int input = name && strcmp(name, STDIN_NAME) != EQUALS
+                    ? stream_open(name, stream_name(stream))
+                    : STDIN_FILENO;
+        if (input == BAD_RESULT) {
+            status = EXIT_FAILURE;
+        } else if (stream->tool == STREAM_HEAD) {
+            status = stream_head(stream, input);
+        } else if (stream->tool == STREAM_TAIL) {
+            status = stream_tail(stream, input);
+        } else {
+            status = stream_wc(stream, input);
+        }
+
+        if (input != STDIN_FILENO && input != BAD_RESULT) {
+            close(input);
+        }
+    }
+
+    if (status == BAD_RESULT) {
+        if (errno == EPIPE) {
+            status = BROKEN_PIPE_STATUS;
+        } else if (errno == EINTR) {
+            status = INTERRUPT_STATUS;
+        } else {
+            fprintf(stderr, "shell: %s: %s\n", stream_name(stream),
+                    strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+
+    sigaction(SIGPIPE, &previous, NULL);
+    return status;
+}
+
+/*
+ * "-n N", "-c N" or "-N". Returns the number of arguments taken.
+ */
+static int parse_count(char *const *arguments, Stream *stream) {
+    char const *value = NULL;
+    int consumed = 0;
+    if (arguments[0] && (strcmp(arguments[0], "-n") == EQUALS
+                         || strcmp(arguments[0], "-c") == EQUALS)) {
+        stream->unit = arguments[0][1] == 'n' ? STREAM_LINES : STREAM_BYTES;
+        value = arguments[1];
+        consumed = 2;
+    } else if (arguments[0] && arguments[0][0] == '-'
+               && isdigit(arguments[0][1])) {
+        value = arguments[0] + 1;
+        consumed = 1;
+    }
+
+    if (!consumed) {
+        return 0;
+    }
+
+    char *end = NULL;
+    if (!value || !isdigit(*value)) {
+        return BAD_RESULT;
+    }
+
+    stream->count = strtoll(value, &end, 10);
+    return *end == END ? consumed : BAD_RESULT;
+}
+
+static char const *stream_name(Stream const *stream) {
+    size_t index;
+    for (index = 0; index < STREAM_TOOLS; ++index) {
+        if (stream_tools[index].tool == stream->tool) {
+            return stream_tools[index].name;
+        }
+    }
+
+    return "";
+}
+
+static int stream_open(char const *name, char const *tool) {
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == BAD_RESULT) {
+        fprintf(stderr, "shell: %s: %s: %s\n", tool, name, strerror(errno));
+    }
+
+    return fd;
+}
+
+static int stream_cat(Stream const *stream) {
+    if (!stream->files[0]) {
+        return stream_cat_input(STDIN_FILENO, STDIN_NAME);
+    }
+
+    int status = EXIT_SUCCESS;
+    size_t index;
+    for (index = 0; stream->files[index]; ++index) {
+        char const *name = stream->files[index];
+        int input = strcmp(name, STDIN_NAME) == EQUALS
+                    ? STDIN_FILENO
+                    : stream_open(name, stream_name(stream));
+        if (input == BAD_RESULT) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        int exit_code = stream_cat_input(input, name);
+        if (input != STDIN_FILENO) {
+            close(input);
+        }
+
+        if (exit_code == BAD_RESULT) {
+            return BAD_RESULT;
+        }
+
+        if (exit_code != EXIT_SUCCESS) {
+            status = exit_code;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Like the real cat, refuses to copy a regular file into itself, which
+ * would never end with ">>".
+ */
+static int stream_cat_input(int input, char const *name) {
+    struct stat input_info;
+    struct stat output_info;
+    if (fstat(input, &input_info) == EXIT_SUCCESS
+        && fstat(STDOUT_FILENO, &output_info) == EXIT_SUCCESS
+        && S_ISREG(output_info.st_mode)
+        && input_info.st_dev == output_info.st_dev
+        && input_info.st_ino == output_info.st_ino) {
+        fprintf(stderr, "shell: cat: %s: input file is output file\n", name);
+        return EXIT_FAILURE;
+    }
+
+    return stream_copy(input, STDOUT_FILENO, BAD_RESULT);
+}
+
+/*
+ * Lines are cut with memchr. What was read past the last line is given
+ * back to a seekable input, so the next reader starts right after it.
+ */
+static int stream_head(Stream const *stream, int input) {
+    if (stream->unit == STREAM_BYTES) {
+        return stream->count ? stream_copy(input, STDOUT_FILENO, stream->count)
+                             : EXIT_SUCCESS;
+    }
+
+    long long remaining = stream->count;
+    while (remaining > 0) {
+        if (is_interrupted()) {
+            return BAD_RESULT;
+        }
+
+        ssize_t number_of_read = read(input, buffer, sizeof(buffer));
+        if (number_of_read == BAD_RESULT && errno == EINTR) {
+            continue;
+        }
+
+        if (number_of_read <= 0) {
+            return (int) number_of_read;
+        }
+
+        char const *end = buffer;
+        char const *last = buffer + number_of_read;
+        while (remaining > 0 && end < last) {
+            char const *newline = memchr(end, '\n', (size_t) (last - end));
+            end = newline ? newline + 1 : last;
+            remaining -= newline != NULL;
+        }
+
+        if (stream_write_all(STDOUT_FILENO, buffer, (size_t) (end - buffer))
+            == BAD_RESULT) {
+            return BAD_RESULT;
+        }
+
+        if (end < last) {
+            lseek(input, end - last, SEEK_CUR);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Only regular files are accepted, so the file is mapped and the lines are
+ * found backwards from its end without reading the rest.
+ */
+static int stream_tail(Stream const *stream, int input) {
+    struct stat info;
+    if (fstat(input, &info) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    off_t offset = lseek(input, 0, SEEK_CUR);
+    if (offset == BAD_RESULT || offset >= info.st_size || !stream->count) {
+        return EXIT_SUCCESS;
+    }
+
+    size_t size = (size_t) info.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input, 0);
+    if (data == MAP_FAILED) {
+        return BAD_RESULT;
+    }
+
+    char const *begin = data + offset;
+    char const *end = data + size;
+    if (end[-1] == '\n') {
+        --end;
+    }
+
+    long long remaining = stream->count;
+    char const *start = end;
+    while (start > begin) {
+        char const *newline = memrchr(begin, '\n', (size_t) (start - begin));
+        if (!newline) {
+            start = begin;
+            break;
+        }
+
+        start = newline;
+        if (--remaining == 0) {
+            ++start;
+            break;
+        }
+    }
+
+    int exit_code = stream_write_all(STDOUT_FILENO, start,
+                              (size_t) (data + size - start));
+    munmap(data, size);
+    return exit_code;
+}
+
+/*
+ * A regular file is mapped and its lines counted with memchr; the byte
+ * count of a regular file comes from its size. A file with no size, such as
+ * a procfs one, is read like a pipe.
+ */
+static int stream_wc(Stream const *stream, int input) {
+    long long count = 0;
+    struct stat info;
+    off_t offset = lseek(input, 0, SEEK_CUR);
+    char regular = fstat(input, &info) == EXIT_SUCCESS
+                   && is_sized(&info) && offset != BAD_RESULT;
+
+    if (regular && stream->unit == STREAM_BYTES) {
+        count = info.st_size > offset ? info.st_size - offset : 0;
+    } else if (regular && info.st_size > offset) {
+        size_t size = (size_t) info.st_size;
+        char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input, 0);
+        if (data == MAP_FAILED) {
+            return BAD_RESULT;
+        }
+
+        madvise(data, size, MADV_SEQUENTIAL);
+        count = count_lines(data + offset, size - (size_t) offset);
+        munmap(data, size);
+    } else if (!regular) {
+        ssize_t number_of_read;
+        while ((number_of_read = read(input, buffer, sizeof(buffer))) != 0) {
+            if (is_interrupted()) {
+                return BAD_RESULT;
+            }
+
+            if (number_of_read == BAD_RESULT) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return BAD_RESULT;
+            }
+
+            count += stream->unit == STREAM_LINES
+                     ? count_lines(buffer, (size_t) number_of_read)
+                     : number_of_read;
+        }
+    }
+
+    char line[PATH_MAX + 32];
+    int len;
+    if (stream->files[0]) {
+        len = snprintf(line, sizeof(line), "%lld %s\n", count, stream->files[0]);
+    } else {
+        len = snprintf(line, sizeof(line), "%lld\n", count);
+    }
+
+    return stream_write_all(STDOUT_FILENO, line, (size_t) len < sizeof(line)
+                                          ? (size_t) len
+                                          : sizeof(line) - 1);
+}
+
+/*
+ * With one file and pipes on both sides the data is duplicated with tee(2)
+ * and moved into the file with splice, without passing through the shell.
+ * splice can't append, so "-a" always copies.
+ */
+static int stream_tee(Stream const *stream) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC
+                | (stream->append ? O_APPEND : O_TRUNC);
+    int outputs[MAX_ARGS];
+    size_t count = 0;
+    int status = EXIT_SUCCESS;
+    outputs[count++] = STDOUT_FILENO;
+
+    size_t index;
+    for (index = 0; stream->files[index]; ++index) {
+        int fd = open(stream->files[index], flags, (mode_t) 0644);
+        if (fd == BAD_RESULT) {
+            fprintf(stderr, "shell: tee: %s: %s\n", stream->files[index],
+                    strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        outputs[count++] = fd;
+    }
+
+    int exit_code = EXIT_SUCCESS;
+    struct stat input;
+    struct stat output;
+    char zero_copy = count == 2 && !stream->append
+                     && fstat(STDIN_FILENO, &input) == EXIT_SUCCESS
+                     && fstat(STDOUT_FILENO, &output) == EXIT_SUCCESS
+                     && S_ISFIFO(input.st_mode) && S_ISFIFO(output.st_mode);
+    while (zero_copy) {
+        if (is_interrupted()) {
+            exit_code = BAD_RESULT;
+            break;
+        }
+
+        ssize_t duplicated = tee(STDIN_FILENO, STDOUT_FILENO, STREAM_CHUNK, 0);
+        if (duplicated == BAD_RESULT && errno == EINTR) {
+            continue;
+        }
+
+        if (duplicated == BAD_RESULT) {
+            zero_copy = errno != EINVAL;
+            exit_code = zero_copy ? BAD_RESULT : EXIT_SUCCESS;
+            break;
+        }
+
+        if (duplicated == 0) {
+            break;
+        }
+
+        while (duplicated > 0) {
+            ssize_t moved = splice(STDIN_FILENO, NULL, outputs[1], NULL,
+                                   (size_t) duplicated, SPLICE_F_MOVE);
+            if (moved == BAD_RESULT && errno != EINTR) {
+                exit_code = BAD_RESULT;
+                break;
+            }
+
+            duplicated -= moved > 0 ? moved : 0;
+        }
+
+        if (exit_code == BAD_RESULT) {
+            break;
+        }
+    }
+
+    while (!zero_copy && exit_code == EXIT_SUCCESS) {
+        if (is_interrupted()) {
+            exit_code = BAD_RESULT;
+            break;
+        }
+
+        ssize_t number_of_read = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (number_of_read == BAD_RESULT && errno == EINTR) {
+            continue;
+        }
+
+        if (number_of_read <= 0) {
+            exit_code = (int) number_of_read;
+            break;
+        }
+
+        for (index = 0; index < count; ++index) {
+            if (stream_write_all(outputs[index], buffer,
+                                 (size_t) number_of_read) == BAD_RESULT) {
+                exit_code = BAD_RESULT;
+            }
+        }
+    }
+
+    for (index = 1; index < count; ++index) {
+        close(outputs[index]);
+    }
+
+    return exit_code == BAD_RESULT ? exit_code : status;
+}
+
+/*
+ * Copies up to limit bytes (all with BAD_RESULT) with the cheapest call the
+ * pair of descriptors allows: copy_file_range between regular files,
+ * sendfile from a regular file, splice to or from a pipe, and read/write
+ * otherwise. A call that doesn't apply fails at once and the next is tried.
+ */
+int stream_copy(int input, int output, long long limit) {
+    char method = COPY_FILE_RANGE;
+    long long copied_total = 0;
+    while (limit < 0 || copied_total < limit) {
+        if (is_interrupted()) {
+            return BAD_RESULT;
+        }
+
+        size_t chunk = STREAM_CHUNK;
+        if (limit >= 0 && limit - copied_total < STREAM_CHUNK) {
+            chunk = (size_t) (limit - copied_total);
+        }
+
+        ssize_t copied;
+        switch (method) {
+            case COPY_FILE_RANGE:
+                copied = copy_file_range(input, NULL, output, NULL, chunk, 0);
+                break;
+            case COPY_SENDFILE:
+                copied = sendfile(output, input, NULL, chunk);
+                break;
+            case COPY_SPLICE:
+                copied = splice(input, NULL, output, NULL, chunk,
+                                SPLICE_F_MOVE);
+                break;
+            default:
+                copied = read_write(input, output, chunk);
+                break;
+        }
+
+        if (copied == BAD_RESULT && errno == EINTR) {
+            continue;
+        }
+
+        if (copied == BAD_RESULT && method != COPY_READ_WRITE
+            && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                || errno == EBADF || errno == EOPNOTSUPP)) {
+            ++method;
+            continue;
+        }
+
+        if (copied == BAD_RESULT) {
+            return BAD_RESULT;
+        }
+
+        /* Some pseudo files report 0 bytes to the zero-copy calls */
+        if (copied == 0 && copied_total == 0 && method != COPY_READ_WRITE) {
+            method = COPY_READ_WRITE;
+            continue;
+        }
+
+        if (copied == 0) {
+            break;
+        }
+
+        copied_total += copied;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Sends the input pipe to every output pipe. A chunk is duplicated into all
+ * outputs but the last with tee(2) and then moved into the last one with
+ * splice, so it stays in kernel pages; only when a tee comes up short is the
+ * chunk read and the rest written. The next chunk is taken once every output
+ * has this one, so the slowest reader throttles the writer and nothing is
+ * buffered beyond the pipes. An output whose reader is gone is closed and
+ * set to BAD_RESULT. Returns when the input ends or no output is left.
+ */
+int stream_fanout(int input, int *outputs, size_t count) {
+    size_t received[MAX_COMMANDS];
+    char zero_copy = TRUE;
+    while (TRUE) {
+        size_t last = count;
+        size_t index;
+        for (index = 0; index < count; ++index) {
+            if (outputs[index] != BAD_RESULT) {
+                last = index;
+            }
+        }
+
+        if (last == count) {
+            return EXIT_SUCCESS;
+        }
+
+        if (!zero_copy) {
+            ssize_t number_of_read = read(input, buffer, sizeof(buffer));
+            if (number_of_read == BAD_RESULT && errno == EINTR) {
+                continue;
+            }
+
+            if (number_of_read <= 0) {
+                return (int) number_of_read;
+            }
+
+            for (index = 0; index <= last; ++index) {
+                if (outputs[index] != BAD_RESULT
+                    && fanout_write(&outputs[index], buffer,
+                                    (size_t) number_of_read) == BAD_RESULT) {
+                    return BAD_RESULT;
+                }
+            }
+
+            continue;
+        }
+
+        size_t chunk = 0;
+        char complete = TRUE;
+        for (index = 0; index < last; ++index) {
+            received[index] = 0;
+            if (outputs[index] == BAD_RESULT) {
+                continue;
+            }
+
+            ssize_t duplicated = tee(input, outputs[index],
+                                     chunk ? chunk : STREAM_CHUNK, 0);
+            if (duplicated == BAD_RESULT && errno == EINTR) {
+                --index;
+                continue;
+            }
+
+            if (duplicated == BAD_RESULT && errno == EPIPE) {
+                close(outputs[index]);
+                outputs[index] = BAD_RESULT;
+                continue;
+            }
+
+            if (duplicated == BAD_RESULT && errno == EINVAL && !chunk) {
+                zero_copy = FALSE;
+                break;
+            }
+
+            if (duplicated == BAD_RESULT) {
+                return BAD_RESULT;
+            }
+
+            if (duplicated == 0 && !chunk) {
+                return EXIT_SUCCESS;
+            }
+
+            received[index] = (size_t) duplicated;
+            if (!chunk) {
+                chunk = (size_t) duplicated;
+            } else if ((size_t) duplicated < chunk) {
+                complete = FALSE;
+            }
+        }
+
+        if (!zero_copy) {
+            continue;
+        }
+
+        if (!chunk) {
+            ssize_t moved = splice(input, NULL, outputs[last], NULL,
+                                   STREAM_CHUNK, SPLICE_F_MOVE);
+            if (moved == BAD_RESULT && errno == EPIPE) {
+                close(outputs[last]);
+                outputs[last] = BAD_RESULT;
+            } else if (moved == BAD_RESULT && errno == EINVAL) {
+                zero_copy = FALSE;
+            } else if (moved == BAD_RESULT && errno != EINTR) {
+                return BAD_RESULT;
+            } else if (moved == 0) {
+                return EXIT_SUCCESS;
+            }
+
+            continue;
+        }
+
+        if (complete) {
+            if (fanout_splice(input, &outputs[last], chunk) == BAD_RESULT) {
+                return BAD_RESULT;
+            }
+
+            continue;
+        }
+
+        if (read_exactly(input, chunk) == BAD_RESULT) {
+            return BAD_RESULT;
+        }
+
+        for (index = 0; index <= last; ++index) {
+            size_t offset = index == last ? 0 : received[index];
+            if (outputs[index] != BAD_RESULT && offset < chunk
+                && fanout_write(&outputs[index], buffer + offset,
+                                chunk - offset) == BAD_RESULT) {
+                return BAD_RESULT;
+            }
+        }
+    }
+}
+
+/*
+ * Moves exactly size bytes from the input into the output. If the reader
+ * of the output is gone the rest is read and thrown away, since the other
+ * outputs already have it.
+ */
+static int fanout_splice(int input, int *output, size_t size) {
+    while (size && *output != BAD_RESULT) {
+        ssize_t moved = splice(input, NULL, *output, NULL, size,
+                               SPLICE_F_MOVE);
+        if (moved == BAD_RESULT && errno == EINTR) {
+            continue;
+        }
+
+        if (moved == BAD_RESULT && errno == EPIPE) {
+            close(*output);
+            *output = BAD_RESULT;
+            break;
+        }
+
+        if (moved <= 0) {
+            return BAD_RESULT;
+        }
+
+        size -= (size_t) moved;
+    }
+
+    return size ? read_exactly(input, size) : EXIT_SUCCESS;
+}
+
+static int fanout_write(int *output, char const *data, size_t size) {
+    if (stream_write_all(*output, data, size) == EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+
+    if (errno != EPIPE) {
+        return BAD_RESULT;
+    }
+
+    close(*output);
+    *output = BAD_RESULT;
+    return EXIT_SUCCESS;
+}
+
+static int read_exactly(int input, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t number_of_read = read(input, buffer + done, size - done);
+        if (number_of_read == BAD_RESULT && errno == EINTR) {
+            continue;
+        }
+
+        if (number_of_read <= 0) {
+            return BAD_RESULT;
+        }
+
+        done += (size_t) number_of_read;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static ssize_t read_write(int input, int output, size_t size) {
+    ssize_t number_of_read = read(input, buffer, size);
+    if (number_of_read <= 0) {
+        return number_of_read;
+    }
+
+    if (stream_write_all(output, buffer,
+                         (size_t) number_of_read) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    return number_of_read;
+}
+
+int stream_write_all(int output, char const *data, size_t size) {
+    while (size) {
+        ssize_t number_of_write = write(output, data, size);
+        if (number_of_write == BAD_RESULT) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return BAD_RESULT;
+        }
+
+        data += number_of_write;
+        size -= (size_t) number_of_write;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static long long count_lines(char const *data, size_t size) {
+    long long count = 0;
+    char const *end = data + size;
+    while ((data = memchr(data, '\n', (size_t) (end - data)))) {
+        ++count;
+        ++data;
+    }
+
+    return count;
+}
+
+/*
+ * A SIGINT caught by event_catch_interrupt is seen here; otherwise it is
+ * ignored or has already ended the process.
+ */
+static int is_interrupted() {
+    if (event_interrupt_pending()) {
+        errno = EINTR;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int is_regular(int fd) {
+    struct stat info;
+    return fstat(fd, &info) == EXIT_SUCCESS && is_sized(&info);
+}
+
+static int is_sized(struct stat const *info) {
+    return S_ISREG(info->st_mode) && info->st_size > 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef STREAM_H
+#define STREAM_H
+
+
+#include "command.h"
+
+
+#define STREAM_CAT 1
+#define STREAM_HEAD 2
+#define STREAM_TAIL 3
+#define STREAM_WC 4
+#define STREAM_TEE 5
+
+#define STREAM_LINES 0
+#define STREAM_BYTES 1
+
+#define STREAM_DEFAULT_COUNT 10
+#define STREAM_CHUNK (1 << 16)
+
+
+struct Stream_St {
+    char tool;
+    char unit;
+    char append;
+    long long count;
+    char *const *files;
+};
+
+typedef struct Stream_St Stream;
+
+
+int stream_parse(Command const *command, Stream *stream);
+
+int stream_inputs_regular(Stream const *stream, char const *infile);
+
+int stream_run(Stream const *stream);
+
+int stream_copy(int input, int output, long long limit);
+
+int stream_write_all(int output, char const *data, size_t size);
+
+int stream_fanout(int input, int *outputs, size_t count);
+
+
+#endif //STREAM_H
@@ -4,10 +4,22 @@
 
 
 #include "terminal.h"
+#include "stats.h"
 
+#include <fcntl.h>
 #include <signal.h>
 
 
+#define TERMINAL_FD_MIN 10
+
+
+/*
+ * The controlling terminal is kept on its own descriptor, so giving it to a
+ * job still works while a brace group has redirected the shell's stdin.
+ */
+static int terminal_fd = STDIN_FILENO;
+
+
 static int terminal_set(int fd,
                         pid_t pgrp,
                         int sig,
@@ -15,8 +27,19 @@ static int terminal_set(int fd,
                         void (*sig_handler_after)(int));
 
 
+int terminal_init() {
+    int fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, TERMINAL_FD_MIN);
+    if (fd == BAD_RESULT) {
+        perror("Couldn't duplicate terminal descriptor");
+        return BAD_RESULT;
+    }
+
+    terminal_fd = fd;
+    return EXIT_SUCCESS;
+}
+
 int terminal_set_stdin(pid_t pgrp) {
-    return terminal_set(STDIN_FILENO, pgrp, SIGTTOU, SIG_IGN, SIG_DFL);
+    return terminal_set(terminal_fd, pgrp, SIGTTOU, SIG_IGN, SIG_DFL);
 }
 
 int terminal_set_parent() {
@@ -36,6 +59,7 @@ static int terminal_set(int fd,
                         void (*sig_handler_before)(int),
                         void (*sig_handler_after)(int)) {
     signal(sig, sig_handler_before);
+    stats_count(STATS_TCSETPGRP);
     int exit_code = tcsetpgrp(fd, pgrp);
     if (exit_code == BAD_RESULT) {
         perror("Couldn't set terminal foreground process group");
@@ -9,6 +9,8 @@
 #include "execute.h"
 
 
+int terminal_init();
+
 int terminal_set_stdin(pid_t pgrp);
 
 int terminal_set_parent();
@@ -0,0 +1,184 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "timeout.h"
+
+#include <signal.h>
+#include <sys/timerfd.h>
+
+
+#define MILLISECONDS 1000ULL
+#define NANOSECONDS_IN_MILLISECOND 1000000ULL
+
+#define SIGNAL_PREFIX "SIG"
+
+
+struct SignalName_St {
+    char const *name;
+    int signal;
+};
+
+typedef struct SignalName_St SignalName;
+
+
+static SignalName const signal_names[] = {
+        {"HUP",  SIGHUP},
+        {"INT",  SIGINT},
+        {"QUIT", SIGQUIT},
+        {"KILL", SIGKILL},
+        {"USR1", SIGUSR1},
+        {"USR2", SIGUSR2},
+        {"ALRM", SIGALRM},
+        {"TERM", SIGTERM},
+        {"CONT", SIGCONT},
+        {"STOP", SIGSTOP},
+};
+
+#define SIGNAL_NAMES (sizeof(signal_names) / sizeof(signal_names[0]))
+
+
+static int timeout_parse_duration(char const *str, unsigned long long *duration);
+
+
+/*
+ * Parses "[-s signal] [-k duration] duration" and returns the number of
+ * consumed arguments. Durations are kept in milliseconds.
+ */
+int timeout_parse(char **arguments, Timeout *timeout) {
+    memset(timeout, 0, sizeof(Timeout));
+    timeout->signal = SIGTERM;
+
+    int index = 0;
+    while (arguments[index] && arguments[index][0] == '-'
+           && arguments[index][1] != END) {
+        char *option = arguments[index];
+        char *value = arguments[index + 1];
+        if (strcmp(option, "--") == 0) {
+            ++index;
+            break;
+        }
+
+        if (strcmp(option, "-s") == 0 && value) {
+            timeout->signal = timeout_parse_signal(value);
+            if (timeout->signal == BAD_RESULT) {
+                fprintf(stderr, "shell: timeout: %s: invalid signal\n", value);
+                return BAD_RESULT;
+            }
+        } else if (strcmp(option, "-k") == 0 && value) {
+            if (timeout_parse_duration(value, &timeout->kill_after)
+                == BAD_RESULT) {
+                fprintf(stderr, "shell: timeout: %s: invalid duration\n",
+                        value);
+                return BAD_RESULT;
+            }
+        } else {
+            fprintf(stderr, "shell: timeout: %s: invalid option\n", option);
+            return BAD_RESULT;
+        }
+
+        index += 2;
+    }
+
+    if (!arguments[index]
+        || timeout_parse_duration(arguments[index], &timeout->duration)
+           == BAD_RESULT) {
+        fprintf(stderr, "shell: timeout: %s: invalid duration\n",
+                arguments[index] ? arguments[index] : "");
+        return BAD_RESULT;
+    }
+
+    return index + 1;
+}
+
+int timeout_parse_signal(char const *str) {
+    if (isdigit(*str)) {
+        int signal = atoi(str);
+        return signal > 0 && signal < NSIG ? signal : BAD_RESULT;
+    }
+
+    if (strncmp(str, SIGNAL_PREFIX, strlen(SIGNAL_PREFIX)) == 0) {
+        str += strlen(SIGNAL_PREFIX);
+    }
+
+    size_t index;
+    for (index = 0; index < SIGNAL_NAMES; ++index) {
+        if (strcmp(str, signal_names[index].name) == 0) {
+            return signal_names[index].signal;
+        }
+    }
+
+    return BAD_RESULT;
+}
+
+int timeout_create(unsigned long long duration) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd == BAD_RESULT) {
+        perror("Couldn't create timer");
+        return BAD_RESULT;
+    }
+
+    int exit_code = timeout_rearm(fd, duration);
+    if (exit_code == BAD_RESULT) {
+        close(fd);
+        return BAD_RESULT;
+    }
+
+    return fd;
+}
+
+int timeout_rearm(int fd, unsigned long long duration) {
+    struct itimerspec value;
+    memset(&value, 0, sizeof(value));
+    value.it_value.tv_sec = (time_t) (duration / MILLISECONDS);
+    value.it_value.tv_nsec = (long) (duration % MILLISECONDS
+                                     * NANOSECONDS_IN_MILLISECOND);
+
+    int exit_code = timerfd_settime(fd, 0, &value, NULL);
+    if (exit_code == BAD_RESULT) {
+        perror("Couldn't arm timer");
+    }
+
+    return exit_code;
+}
+
+int timeout_expired(int fd) {
+    unsigned long long expirations = 0;
+    ssize_t number_of_read = read(fd, &expirations, sizeof(expirations));
+    return number_of_read == sizeof(expirations) && expirations;
+}
+
+static int timeout_parse_duration(char const *str, unsigned long long *duration) {
+    char *end = NULL;
+    double value = strtod(str, &end);
+    if (end == str || value < 0) {
+        return BAD_RESULT;
+    }
+
+    double multiplier = 1;
+    switch (*end) {
+        case END:
+        case 's':
+            break;
+        case 'm':
+            multiplier = 60;
+            break;
+        case 'h':
+            multiplier = 60 * 60;
+            break;
+        case 'd':
+            multiplier = 24 * 60 * 60;
+            break;
+        default:
+            return BAD_RESULT;
+    }
+
+    if (*end != END && end[1] != END) {
+        return BAD_RESULT;
+    }
+
+    /* A duration shorter than the timer's millisecond would mean none */
+    *duration = (unsigned long long) (value * multiplier * MILLISECONDS);
+    return value > 0 && !*duration ? BAD_RESULT : EXIT_SUCCESS;
+}
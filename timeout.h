@@ -0,0 +1,37 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+
+#include "shell.h"
+
+
+#define TIMEOUT_STATUS 124
+#define TIMEOUT_FAILED_STATUS 125
+
+
+struct Timeout_St {
+    unsigned long long duration;
+    unsigned long long kill_after;
+    int signal;
+};
+
+typedef struct Timeout_St Timeout;
+
+
+int timeout_parse(char **arguments, Timeout *timeout);
+
+int timeout_parse_signal(char const *str);
+
+int timeout_create(unsigned long long duration);
+
+int timeout_rearm(int fd, unsigned long long duration);
+
+int timeout_expired(int fd);
+
+
+#endif //TIMEOUT_H
@@ -0,0 +1,223 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE \
+                      | IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_BUFFER (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define WATCH_HIDDEN '.'
+
+
+static int watch_tree(Watch *watch, char const *path);
+
+static int watch_entry(Watch *watch, char const *path, char const *name);
+
+static int watch_matches(Watch *watch,
+                         struct inotify_event const *event,
+                         char *changed,
+                         size_t size);
+
+
+int watch_open(Watch *watch) {
+    memset(watch, 0, sizeof(Watch));
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd == BAD_RESULT) {
+        perror("Couldn't create inotify instance");
+        return BAD_RESULT;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A directory is watched with all its subdirectories, except hidden ones
+ * like .git. A file is watched through its directory, so editors that save
+ * by renaming a new file over the old one are still seen.
+ */
+int watch_add(Watch *watch, char const *path) {
+    struct stat info;
+    if (stat(path, &info) == BAD_RESULT) {
+        fprintf(stderr, "shell: watch-run: %s: %s\n", path, strerror(errno));
+        return BAD_RESULT;
+    }
+
+    if (S_ISDIR(info.st_mode)) {
+        return watch_tree(watch, path);
+    }
+
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    char *slash = strrchr(directory, '/');
+    char const *name = path;
+    if (!slash) {
+        strcpy(directory, ".");
+    } else {
+        name = path + (slash - directory) + 1;
+        slash[slash == directory ? 1 : 0] = END;
+    }
+
+    return watch_entry(watch, directory, name);
+}
+
+/*
+ * Reads the pending events and returns how many of them are relevant,
+ * copying the path of the last one to changed. New directories in watched
+ * trees are watched from now on.
+ */
+int watch_read(Watch *watch, char *changed, size_t size) {
+    char buffer[WATCH_BUFFER]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int relevant = 0;
+
+    ssize_t number_of_read;
+    while ((number_of_read = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+        char *position = buffer;
+        while (position < buffer + number_of_read) {
+            struct inotify_event const *event =
+                    (struct inotify_event const *) position;
+            position += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                snprintf(changed, size, "%s", "(events overflowed)");
+                ++relevant;
+                continue;
+            }
+
+            if (watch_matches(watch, event, changed, size)) {
+                ++relevant;
+            }
+        }
+    }
+
+    if (number_of_read == BAD_RESULT && errno != EAGAIN) {
+        perror("Couldn't read inotify events");
+    }
+
+    return relevant;
+}
+
+void watch_close(Watch *watch) {
+    if (watch->fd != BAD_RESULT) {
+        close(watch->fd);
+    }
+
+    size_t index;
+    for (index = 0; index < watch->count; ++index) {
+        free(watch->entries[index].path);
+        free(watch->entries[index].name);
+    }
+
+    free(watch->entries);
+    memset(watch, 0, sizeof(Watch));
+    watch->fd = BAD_RESULT;
+}
+
+static int watch_tree(Watch *watch, char const *path) {
+    if (watch_entry(watch, path, NULL) == BAD_RESULT) {
+        return BAD_RESULT;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return EXIT_SUCCESS;
+    }
+
+    struct dirent *item;
+    while ((item = readdir(dir))) {
+        if (*item->d_name == WATCH_HIDDEN) {
+            continue;
+        }
+
+        struct stat info;
+        if (item->d_type != DT_DIR
+            && (item->d_type != DT_UNKNOWN
+                || fstatat(dirfd(dir), item->d_name, &info,
+                           AT_SYMLINK_NOFOLLOW) == BAD_RESULT
+                || !S_ISDIR(info.st_mode))) {
+            continue;
+        }
+
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, item->d_name)
+            < (int) sizeof(child)
+            && watch_tree(watch, child) == BAD_RESULT) {
+            closedir(dir);
+            return BAD_RESULT;
+        }
+    }
+
+    closedir(dir);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * The kernel gives the same descriptor to every watch on one directory, so
+ * an entry is kept for each watched file name in it; name is NULL when the
+ * whole directory is watched.
+ */
+static int watch_entry(Watch *watch, char const *path, char const *name) {
+    int wd = inotify_add_watch(watch->fd, path,
+                               WATCH_EVENTS | IN_ONLYDIR | IN_MASK_ADD);
+    if (wd == BAD_RESULT) {
+        fprintf(stderr, "shell: watch-run: %s: %s\n", path,
+                errno == ENOSPC ? "too many watches, see "
+                                  "/proc/sys/fs/inotify/max_user_watches"
+                                : strerror(errno));
+        return BAD_RESULT;
+    }
+
+    if (watch->count == watch->capacity) {
+        watch->capacity = watch->capacity ? watch->capacity * 2 : 16;
+        watch->entries = realloc(watch->entries,
+                                 watch->capacity * sizeof(WatchEntry));
+        check_memory(watch->entries);
+    }
+
+    WatchEntry *entry = &watch->entries[watch->count++];
+    entry->wd = wd;
+    entry->path = strdup(path);
+    check_memory(entry->path);
+    entry->name = NULL;
+    if (name) {
+        entry->name = strdup(name);
+        check_memory(entry->name);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int watch_matches(Watch *watch,
+                         struct inotify_event const *event,
+                         char *changed,
+                         size_t size) {
+    char const *name = event->len ? event->name : "";
+    size_t index;
+    for (index = 0; index < watch->count; ++index) {
+        WatchEntry const *entry = &watch->entries[index];
+        if (entry->wd != event->wd
+            || (entry->name && strcmp(entry->name, name) != 0)
+            || (!entry->name && *name == WATCH_HIDDEN)) {
+            continue;
+        }
+
+        snprintf(changed, size, "%s%s%s", entry->path, *name ? "/" : "", name);
+        if (!entry->name && (event->mask & IN_ISDIR)
+            && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+            watch_tree(watch, changed);
+        }
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
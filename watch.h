@@ -0,0 +1,45 @@
+/*
+ * Copyright © 2018 Dimonchik0036. All rights reserved.
+ */
+
+
+#ifndef WATCH_H
+#define WATCH_H
+
+
+#include "shell.h"
+
+#include <limits.h>
+
+
+#define WATCH_DEFAULT_DEBOUNCE 50
+
+
+struct WatchEntry_St {
+    int wd;
+    char *path;
+    char *name;
+};
+
+typedef struct WatchEntry_St WatchEntry;
+
+struct Watch_St {
+    int fd;
+    WatchEntry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+typedef struct Watch_St Watch;
+
+
+int watch_open(Watch *watch);
+
+int watch_add(Watch *watch, char const *path);
+
+int watch_read(Watch *watch, char *changed, size_t size);
+
+void watch_close(Watch *watch);
+
+
+#endif //WATCH_H